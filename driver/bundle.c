@@ -0,0 +1,156 @@
+/**
+ * Bundling of small packets, see bundle.h
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+
+#include "util.h"
+#include "bundle.h"
+
+// the type byte in front of the first length
+#define BUNDLE_HEADER_SIZE 1
+
+static int timer_fd = -1;
+static void (*submitted_callback)(void);
+
+// the bundle being filled, it's the frame get_free_frame returns
+static frame_t* open;
+static unsigned count;
+static streamlen_t first_len;
+
+/**
+ * (Dis)arm the delay timer.
+ */
+void _bundle_set_timer(bool on) {
+    struct itimerspec value;
+    memset(&value, 0, sizeof(value));
+    if (on) {
+        value.it_value.tv_sec = BUNDLE_DELAY_US / 1000000;
+        value.it_value.tv_nsec = (BUNDLE_DELAY_US % 1000000) * 1000;
+    }
+    timerfd_settime(timer_fd, 0, &value, NULL);
+}
+
+/**
+ * Close the open bundle, the frame is ready to be submitted afterwards.
+ */
+void _bundle_close(void) {
+    assert(open);
+    if (count == 1) {
+        // nobody joined, no need for the bundle header
+        memmove(open->raw, open->raw + BUNDLE_HEADER_SIZE + BUNDLE_LEN_SIZE, first_len);
+        open->len = first_len;
+    } else {
+        LOG_DEBUG("bundled %u packets in %u bytes", count, open->len);
+    }
+    _bundle_set_timer(false);
+    open = NULL;
+}
+
+/**
+ * Invoked by the glue module when a bundle waited long enough.
+ */
+void _bundle_timeout(fdglue_handler_t* that) {
+    (void)that;
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    frame_t* frame = bundle_flush();
+    if (!frame) {
+        return;
+    }
+    submit_frame(frame);
+    submitted_callback();
+}
+
+void init_bundling(fdglue_t* g, void (*submitted)(void)) {
+    assert(submitted);
+    submitted_callback = submitted;
+    open = NULL;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timer_fd == -1) {
+        LOG_ERROR("could not create the bundling timer");
+        exit(1);
+    }
+    fdglue_handler_t hand_timer = {
+        .p = NULL,
+        .handle = _bundle_timeout
+    };
+    g->set_handler(g, timer_fd, FDGHT_READ, hand_timer, FDGHR_APPEND, NULL);
+}
+
+streamlen_t bundle_offset(void) {
+    return open ? open->len + BUNDLE_LEN_SIZE : 0;
+}
+
+bool bundle_append(frame_t* frame, streamlen_t len) {
+    assert(frame);
+    if (!open) {
+        if (len > BUNDLE_MAX_PACKET) {
+            frame->len = len;
+            return true;
+        }
+        // make room for the header, the packet is small
+        memmove(frame->raw + BUNDLE_HEADER_SIZE + BUNDLE_LEN_SIZE, frame->raw, len);
+        frame->raw[0] = BUNDLE_TYPE << 4;
+        frame->len = BUNDLE_HEADER_SIZE;
+        open = frame;
+        count = 0;
+        first_len = len;
+        _bundle_set_timer(true);
+    } else {
+        assert(frame == open);
+        // different flows, but small packets together almost always get smaller
+        frame->compress = true;
+        frame->has_flow = false;
+    }
+    frame->raw[frame->len] = len >> 8;
+    frame->raw[frame->len + 1] = len & 0xFF;
+    frame->len += BUNDLE_LEN_SIZE + len;
+    count++;
+
+    // a big packet can still join, but then the bundle is full
+    if (frame->len >= BUNDLE_MAX_SIZE || len > BUNDLE_MAX_PACKET) {
+        _bundle_close();
+        return true;
+    }
+    return false;
+}
+
+frame_t* bundle_flush(void) {
+    frame_t* frame = open;
+    if (open) {
+        _bundle_close();
+    }
+    return frame;
+}
+
+bool is_bundle(payload_t const data) {
+    return data.len && (data.stream[0] >> 4) == BUNDLE_TYPE;
+}
+
+void unbundle(payload_t const bundle, void (*callback)(payload_t packet)) {
+    assert(is_bundle(bundle));
+    streamlen_t pos = BUNDLE_HEADER_SIZE;
+    while (pos + BUNDLE_LEN_SIZE <= bundle.len) {
+        streamlen_t len = (bundle.stream[pos] << 8) | bundle.stream[pos + 1];
+        if (pos + BUNDLE_LEN_SIZE + len > bundle.len) {
+            break;
+        }
+        payload_t packet = {
+            .stream = bundle.stream + pos + BUNDLE_LEN_SIZE,
+            .len = len
+        };
+        callback(packet);
+        pos += BUNDLE_LEN_SIZE + len;
+    }
+    if (pos != bundle.len) {
+        LOG_WARNING("malformed bundle, %u bytes left over", bundle.len - pos);
+    }
+}
@@ -0,0 +1,92 @@
+/**
+ * Bundling of small packets.
+ *
+ * A packet that fits in a single chunk still costs a sequence number and
+ * a whole chunk. Small packets read from the tun in a short time are
+ * therefore packed back to back into one frame, which is also compressed
+ * as a whole:
+ *
+ *   [BUNDLE_TYPE|0] [len hi] [len lo] [packet] [len hi] [len lo] [packet] ...
+ *
+ * The packets are the ones given to the workers, so header compressed if
+ * that is enabled. BUNDLE_TYPE is a frame type like the HC_TYPE_* ones
+ * (@see headercomp.h), a bundle of a single packet is sent as a plain frame.
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include "structs.h"
+#include "glue.h"
+#include "workers.h"
+
+/// frame type, stored in the upper nibble of the first byte
+#define BUNDLE_TYPE 0xB
+
+/// packets up to this size (after header compression) are bundled
+#ifndef BUNDLE_MAX_PACKET
+#define BUNDLE_MAX_PACKET MAX_CARRIED
+#endif
+
+/// a bundle is closed as soon as it gets this big
+#ifndef BUNDLE_MAX_SIZE
+#define BUNDLE_MAX_SIZE (8 * MAX_CARRIED)
+#endif
+
+/// longest time a packet waits in a bundle for others
+#ifndef BUNDLE_DELAY_US
+#define BUNDLE_DELAY_US 20000
+#endif
+
+/// the length prefix of every packet in a bundle
+#define BUNDLE_LEN_SIZE 2
+
+/**
+ * Set up the bundling.
+ *
+ * @param g the glue object the delay timer is registered with
+ * @param submitted called after a bundle was submitted because of the delay
+ */
+void init_bundling(fdglue_t* g, void (*submitted)(void));
+
+/**
+ * Where the next packet has to be written in the frame returned by
+ * get_free_frame. If a bundle is open that frame is the bundle.
+ *
+ * @return offset into frame->raw
+ */
+streamlen_t bundle_offset(void);
+
+/**
+ * Add the packet written at bundle_offset() to the frame.
+ * If no bundle is open, the flow related fields of the frame must have been set.
+ *
+ * @param frame frame returned by get_free_frame
+ * @param len length of the packet
+ *
+ * @return true if the frame has to be submitted now, false if it stays open
+ */
+bool bundle_append(frame_t* frame, streamlen_t len);
+
+/**
+ * Close the open bundle, even if it is not full yet.
+ *
+ * @return the bundle, to be submitted, NULL if none was open
+ */
+frame_t* bundle_flush(void);
+
+/**
+ * @return true if the data is a bundle
+ */
+bool is_bundle(payload_t const data);
+
+/**
+ * Call back for every packet in a bundle.
+ *
+ * @param bundle the received bundle
+ * @param callback gets the packets one by one
+ */
+void unbundle(payload_t const bundle, void (*callback)(payload_t packet));
+
+#endif /* BUNDLE_H */
@@ -50,10 +50,10 @@ int gen_packet(payload_t* const payload, my_packet* const packet, unsigned* send
         pkt.seq_no = seq_no;
         pkt.ord_no = 0;
         pkt.parts = chunk_number;
-        pkt.is_compressed = payload->is_compressed;
+        pkt.flags = payload->is_compressed ? CHUNK_COMPRESSED : 0;
     }
     // this should be always true unless we try to compress some chunks and not compress others
-    assert(pkt.is_compressed == payload->is_compressed);
+    assert(((pkt.flags & CHUNK_COMPRESSED) != 0) == payload->is_compressed);
 
     packet->packet_header = pkt;
     // increasing ord number on the static struct
@@ -68,26 +68,32 @@ int gen_packet(payload_t* const payload, my_packet* const packet, unsigned* send
     return (payload->len+MAX_CARRIED-1)/MAX_CARRIED;
 }
 
-void gen_my_packets2(payload_t *const payload, payload_t *const result, int const seq_no, const unsigned parts) {
-    assert(result);
-    unsigned rem_len = payload->len;
-    // FIXME: wrong, this must be set every time and go down!
-
-    unsigned sendsize;
-    for (unsigned int i = 0; i < parts; i++) {
-        sendsize = (rem_len < MAX_CARRIED) ? rem_len : MAX_CARRIED;
+unsigned split_payload(const payload_t payload, chunk_t *chunks) {
+    unsigned parts = needed_chunks(payload.len);
+    for (unsigned i = 0; i < parts; i++) {
+        memcpy(chunks[i].packet.payload, payload.stream + i * MAX_CARRIED, chunk_size(payload.len, i) - sizeof(my_packet_header));
+    }
+    return parts;
+}
 
-        my_packet_header pkt_header = {
-            .seq_no = seq_no,
-            .ord_no = i,
-            .parts = parts
-        };
+void set_chunk_headers(chunk_t *chunks, unsigned parts, seq_no_t seq_no, bool is_compressed) {
+    my_packet_header pkt = {
+        .sender = htons(sender_address),
+        .destination = htons(destination_address),
+        .seq_no = seq_no,
+        .flags = is_compressed ? CHUNK_COMPRESSED : 0,
+        .parts = parts
+    };
+    for (unsigned i = 0; i < parts; i++) {
+        pkt.ord_no = i;
+        chunks[i].packet.packet_header = pkt;
+    }
+}
 
-        // memory is already allocate outside
-        my_packet *pkt = (my_packet *) result[i].stream;
-        pkt->packet_header = pkt_header;
-        result[i].stream = (stream_t *) pkt;
-        result[i].len = sendsize;
-        memcpy(pkt->payload, payload->stream, sendsize);
+unsigned chunk_size(streamlen_t len, unsigned ord_no) {
+    streamlen_t left = len - ord_no * MAX_CARRIED;
+    if (left > MAX_CARRIED) {
+        left = MAX_CARRIED;
     }
+    return TOT_PACKET_SIZE(left);
 }
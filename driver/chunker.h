@@ -32,9 +32,33 @@ int gen_packet(payload_t* const payload, my_packet* const packet, unsigned* send
  */
 unsigned needed_chunks(int data_size);
 
-// NOT USED!
-// Another implementation of gen_my_packet which instead takes an array of payloads already allocated
-// This could be useful to keep an history if we need to send back some chunks
-void gen_my_packets2(payload_t *const payload, payload_t *const result, int const seq_no, const unsigned parts);
+/** 
+ * Copy the payload into the payloads of consecutive chunks, MAX_CARRIED bytes each.
+ * The headers are not touched, @see set_chunk_headers
+ *
+ * @param payload data to chunk
+ * @param chunks where to copy the data, there must be enough of them
+ *
+ * @return number of chunks used
+ */
+unsigned split_payload(const payload_t payload, chunk_t *chunks);
+
+/** 
+ * Write the headers of chunks whose payloads are already in place.
+ *
+ * @param chunks the chunks of one packet
+ * @param parts how many chunks there are
+ * @param seq_no sequential number of the packet
+ * @param is_compressed true if the data in the chunks is compressed
+ */
+void set_chunk_headers(chunk_t *chunks, unsigned parts, seq_no_t seq_no, bool is_compressed);
+
+/** 
+ * @param len total length of the data split in chunks
+ * @param ord_no ord number of the chunk
+ *
+ * @return size of the chunk including its header
+ */
+unsigned chunk_size(streamlen_t len, unsigned ord_no);
 
 #endif
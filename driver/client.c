@@ -15,6 +15,7 @@
 #include <sysexits.h>
 
 #include "tunnel.h"
+#include "mss.h"
 // our own declarations
 #include "client.h"
 #include "reconstruct.h"
@@ -49,6 +50,10 @@ void start_client(char const *dev) {
 
     // it will exit abruptly if it doesn't open it correctly
     tun_open(DEFAULT_CLIENT_NO, tun_name);
+    // only packets the MSS clamping lets through
+    if (mss_mtu()) {
+        tun_set_mtu(DEFAULT_CLIENT_NO, mss_mtu());
+    }
 
     fflush(stdout);
 
@@ -76,7 +81,7 @@ void start_client(char const *dev) {
  * @param name The program name used by the user.
  */
 void usage(char* name) {
-    LOG_ERROR("%s [<device>]",name);
+    LOG_ERROR("%s [<device>[,<device>...]]",name);
     exit(EX_USAGE);
 }
 
@@ -29,15 +29,23 @@ void _reset_zstream(z_stream *strm) {
     strm->opaque = Z_NULL;
 }
 
+void init_compressor(z_stream *strm) {
+    _reset_zstream(strm);
+    deflateInit(strm, LEVEL);
+}
+
+void close_compressor(z_stream *strm) {
+    deflateEnd(strm);
+}
+
 void init_compression(void) {
-    _reset_zstream(&strm_compress);
+    init_compressor(&strm_compress);
     _reset_zstream(&strm_decompress);
-    deflateInit(&strm_compress, LEVEL);
     inflateInit(&strm_decompress);
 }
 
 void close_compression(void) {
-    deflateEnd(&strm_compress);
+    close_compressor(&strm_compress);
     inflateEnd(&strm_decompress);
 }
 
@@ -64,28 +72,30 @@ void print_gained(streamlen_t before, streamlen_t after) {
  * Performs compression or decompression on a data stream.
  * 
  * @param mode Either COMPRESS or DECOMPRESS.
+ * @param strm The stream to use, it must have been initialised for mode.
  * @param data The stream's input.
  * @param result Address, where the result will be written.
  * 
- * @return Z_OK
+ * @return Z_OK, or Z_BUF_ERROR if the compressed data does not fit into result
  */
-int _zlib_manage(int mode, const payload_t data, payload_t *result) {
+int _zlib_manage(int mode, z_stream *strm, const payload_t data, payload_t *result) {
     int ret;
-    z_stream *strm;
 
+    _setup_zstream(strm, &data, result);
     switch (mode) {
     case COMPRESS:
-        strm = &strm_compress;
-        _setup_zstream(strm, &data, result);
         ret = deflate(strm, Z_FINISH);
-        deflateReset(&strm_compress);
+        deflateReset(strm);
+        // the caller can give us less space than the input to stop as soon
+        // as it's clear that compressing does not pay off
+        if (ret == Z_OK || ret == Z_BUF_ERROR) {
+            return Z_BUF_ERROR;
+        }
         break;
 
     case DECOMPRESS:
-        strm = &strm_decompress;
-        _setup_zstream(strm, &data, result);
         ret = inflate(strm, Z_FINISH);
-        inflateReset(&strm_decompress);
+        inflateReset(strm);
         break;
     }
 
@@ -94,10 +104,46 @@ int _zlib_manage(int mode, const payload_t data, payload_t *result) {
     return Z_OK;
 }
 
+int stream_compress_chunks(z_stream *strm, const payload_t data, chunk_t *chunks, streamlen_t limit, streamlen_t *len) {
+    int ret = Z_OK;
+    streamlen_t total = 0;
+    // bytes already written in the current chunk
+    streamlen_t used = 0;
+    unsigned ord = 0;
+
+    strm->next_in = (unsigned char *) data.stream;
+    strm->avail_in = data.len;
+    while (ret == Z_OK) {
+        if (used == MAX_CARRIED) {
+            ord++;
+            used = 0;
+        }
+        streamlen_t room = MAX_CARRIED - used;
+        if (room > limit - total) {
+            room = limit - total;
+        }
+        if (!room) {
+            break;
+        }
+        strm->next_out = chunks[ord].packet.payload + used;
+        strm->avail_out = room;
+        ret = deflate(strm, Z_FINISH);
+        used += room - strm->avail_out;
+        total += room - strm->avail_out;
+    }
+    deflateReset(strm);
+
+    if (ret != Z_STREAM_END) {
+        return Z_BUF_ERROR;
+    }
+    *len = total;
+    return Z_OK;
+}
+
 int payload_compress(const payload_t data, payload_t *result) {
-    return _zlib_manage(COMPRESS, data, result);
+    return _zlib_manage(COMPRESS, &strm_compress, data, result);
 }
 
 int payload_decompress(const payload_t data, payload_t *result) {
-    return _zlib_manage(DECOMPRESS, data, result);
+    return _zlib_manage(DECOMPRESS, &strm_decompress, data, result);
 }
@@ -1,16 +1,34 @@
 #ifndef COMPRESS_H
 #define COMPRESS_H
 
+#include <zlib.h>
+#include "structs.h"
+
 /** 
  * Compress the payload given into the result
  * 
  * @param data payload to compress
  * @param result where to write data
  * 
- * @return return code
+ * @return Z_OK, or Z_BUF_ERROR if result is too small for the compressed data
  */
 int payload_compress(const payload_t data, payload_t *result);
 
+/** 
+ * Compress the payload straight into the payloads of consecutive chunks,
+ * MAX_CARRIED bytes each, so that the compressed data is written only once.
+ * Every thread compressing data needs its own stream.
+ * 
+ * @param strm stream set up with init_compressor
+ * @param data payload to compress
+ * @param chunks where to write data, the headers are not touched
+ * @param limit give up when the compressed data gets this big
+ * @param len total length of the compressed data
+ * 
+ * @return Z_OK, or Z_BUF_ERROR if the compressed data would reach limit
+ */
+int stream_compress_chunks(z_stream *strm, const payload_t data, chunk_t *chunks, streamlen_t limit, streamlen_t *len);
+
 /** 
  * Decompress the data
  * 
@@ -39,4 +57,18 @@ void init_compression(void);
  */
 void close_compression(void);
 
+/** 
+ * Initializes a compression stream to be used with stream_compress_chunks.
+ * 
+ * @param strm stream to initialize
+ */
+void init_compressor(z_stream *strm);
+
+/** 
+ * Releases the memory held by a compression stream.
+ * 
+ * @param strm stream to finalize
+ */
+void close_compressor(z_stream *strm);
+
 #endif /* COMPRESS_H */
@@ -0,0 +1,93 @@
+/**
+ * Control messages, see control.h
+ *
+ */
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "util.h"
+#include "control.h"
+#include "sender.h"
+#include "fec.h"
+
+extern uint16_t sender_address;
+extern uint16_t destination_address;
+
+bool is_control(payload_t const data) {
+    return data.len >= sizeof(my_packet_header)
+        && ((my_packet_header const*)data.stream)->parts == 0;
+}
+
+void handle_control(motecomm_t* from, payload_t const data) {
+    assert(is_control(data));
+    my_packet_header const* header = (my_packet_header const*)data.stream;
+    switch (header->ord_no) {
+    case CONTROL_MOTE_STATUS:
+        if (data.len < sizeof(mote_status_t)) {
+            break;
+        }
+        mote_status_t const* status = (mote_status_t const*)data.stream;
+        sender_mote_status(from, status->queue_len, status->queue_size, status->dropped);
+        return;
+    case CONTROL_NACK:
+        if (data.len < sizeof(nack_t)) {
+            break;
+        }
+        nack_t const* nack = (nack_t const*)data.stream;
+        if (data.len < sizeof(nack_t) + nack->count) {
+            break;
+        }
+        sender_resend(header->seq_no, nack->ord_nos, nack->count);
+        return;
+    case CONTROL_LOSS_REPORT:
+        if (data.len < sizeof(loss_report_t)) {
+            break;
+        }
+        loss_report_t const* report = (loss_report_t const*)data.stream;
+        fec_report_loss(ntohs(report->expected), ntohs(report->lost));
+        return;
+    }
+    LOG_WARNING("unknown or short control message of type %u", (unsigned)header->ord_no);
+}
+
+payload_t make_nack(seq_no_t seq_no, unsigned round, uint8_t const* ord_nos, unsigned count) {
+    static stream_t buf[sizeof(nack_t) + NACK_MAX_ORD_NOS];
+    assert(count <= NACK_MAX_ORD_NOS);
+    nack_t* nack = (nack_t*)buf;
+    nack->header = (my_packet_header){
+        .sender = htons(sender_address),
+        .destination = htons(destination_address),
+        .seq_no = seq_no,
+        .ord_no = CONTROL_NACK,
+        .flags = (round << CHUNK_TRY_SHIFT) & CHUNK_TRY_MASK,
+        .parts = 0
+    };
+    nack->count = count;
+    memcpy(nack->ord_nos, ord_nos, count);
+    payload_t result = {
+        .stream = buf,
+        .len = sizeof(nack_t) + count
+    };
+    return result;
+}
+
+payload_t make_loss_report(unsigned expected, unsigned lost) {
+    static loss_report_t report;
+    // the motes drop what looks like a message they forwarded already
+    static seq_no_t seq_no = 0;
+    report.header = (my_packet_header){
+        .sender = htons(sender_address),
+        .destination = htons(destination_address),
+        .seq_no = seq_no++,
+        .ord_no = CONTROL_LOSS_REPORT,
+        .flags = 0,
+        .parts = 0
+    };
+    report.expected = htons(expected > 0xFFFF ? 0xFFFF : expected);
+    report.lost = htons(lost > 0xFFFF ? 0xFFFF : lost);
+    payload_t result = {
+        .stream = (stream_t*)&report,
+        .len = sizeof(report)
+    };
+    return result;
+}
@@ -0,0 +1,92 @@
+/**
+ * Control messages exchanged with the motes and the other end.
+ *
+ * They travel like chunks, but with parts == 0, which no chunk can have.
+ * ord_no then tells the type of the message.
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include "structs.h"
+#include "motecomm.h"
+
+/// WARNING must be the same as the ones in SimpleMoteApp.h
+typedef enum {
+    CONTROL_MOTE_STATUS = 0,
+    CONTROL_NACK = 1,
+    CONTROL_LOSS_REPORT = 2
+} control_type_t;
+
+/**
+ * Sent by the mote every few messages it got over the serial, and right away
+ * when its radio queue is full or refused one.
+ */
+typedef struct mote_status_t {
+    my_packet_header header;
+    /// messages waiting for the radio
+    uint8_t queue_len;
+    uint8_t queue_size;
+    /// messages that did not fit in the radio queue, wraps around
+    uint8_t dropped;
+} __attribute__((__packed__)) mote_status_t;
+
+/**
+ * Sent to the other end when chunks of a packet did not come in time.
+ * header.seq_no is the packet, the ord_nos of the missing chunks follow.
+ */
+typedef struct nack_t {
+    my_packet_header header;
+    uint8_t count;
+    uint8_t ord_nos[];
+} __attribute__((__packed__)) nack_t;
+
+/// at most as many chunks as reconstruct.c can track
+#define NACK_MAX_ORD_NOS 64
+
+/**
+ * Sent to the other end from time to time, so that it can choose
+ * how many parity chunks to add (@see fec.h).
+ * Both counts are in network order.
+ */
+typedef struct loss_report_t {
+    my_packet_header header;
+    /// chunks of the packets finished since the last report
+    uint16_t expected;
+    /// how many of them did not come the first time
+    uint16_t lost;
+} __attribute__((__packed__)) loss_report_t;
+
+/**
+ * @return true if the data received is a control message and not a chunk
+ */
+bool is_control(payload_t const data);
+
+/**
+ * Act on a control message.
+ *
+ * @param from the mote it came from
+ * @param data the message, is_control must be true
+ */
+void handle_control(motecomm_t* from, payload_t const data);
+
+/**
+ * Build a NACK, valid until the next call.
+ *
+ * @param seq_no the packet missing chunks
+ * @param round how many NACKs were sent for it before, so the motes forward this one too
+ * @param ord_nos the missing chunks
+ * @param count how many, at most NACK_MAX_ORD_NOS
+ */
+payload_t make_nack(seq_no_t seq_no, unsigned round, uint8_t const* ord_nos, unsigned count);
+
+/**
+ * Build a loss report, valid until the next call.
+ *
+ * @param expected chunks that should have come
+ * @param lost chunks that did not come the first time
+ */
+payload_t make_loss_report(unsigned expected, unsigned lost);
+
+#endif /* CONTROL_H */
@@ -0,0 +1,216 @@
+/**
+ * Parity chunks, see fec.h
+ *
+ */
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "fec.h"
+
+#define FEC_POLY 0x11D
+
+static uint8_t _fec_exp[512];
+static uint8_t _fec_log[256];
+static pthread_once_t _fec_once = PTHREAD_ONCE_INIT;
+
+// chunk loss reported by the other end, in 1/65536, read by the workers
+static unsigned loss_rate = 0;
+
+void _fec_make_tables(void) {
+    unsigned x = 1;
+    for (unsigned i = 0; i < 255; i++) {
+        _fec_exp[i] = x;
+        _fec_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= FEC_POLY;
+        }
+    }
+    for (unsigned i = 255; i < 512; i++) {
+        _fec_exp[i] = _fec_exp[i - 255];
+    }
+}
+
+static inline uint8_t _fec_mul(uint8_t a, uint8_t b) {
+    return (a && b) ? _fec_exp[_fec_log[a] + _fec_log[b]] : 0;
+}
+
+static inline uint8_t _fec_inv(uint8_t a) {
+    return _fec_exp[255 - _fec_log[a]];
+}
+
+/**
+ * @return the coefficient of the data chunk j in the parity chunk i
+ */
+static inline uint8_t _fec_coef(bool rs, unsigned i, unsigned j) {
+    // the rows and the columns of the cauchy matrix use distinct elements
+    return rs ? _fec_inv(i ^ (FEC_MAX_PARITY + j)) : 1;
+}
+
+/**
+ * dst += c * src
+ */
+void _fec_mul_add(stream_t* dst, stream_t const* src, unsigned len, uint8_t c) {
+    if (c == 1) {
+        for (unsigned b = 0; b < len; b++) {
+            dst[b] ^= src[b];
+        }
+        return;
+    }
+    uint8_t row[256];
+    for (unsigned v = 0; v < 256; v++) {
+        row[v] = _fec_mul(c, v);
+    }
+    for (unsigned b = 0; b < len; b++) {
+        dst[b] ^= row[src[b]];
+    }
+}
+
+static inline unsigned _fec_len(unsigned j, unsigned parts, unsigned last_len) {
+    return (j == parts - 1) ? last_len : MAX_CARRIED;
+}
+
+void fec_report_loss(unsigned expected, unsigned lost) {
+    if (!expected) {
+        return;
+    }
+    if (lost > expected) {
+        lost = expected;
+    }
+    unsigned sample = (unsigned)(65536.0 * lost / expected);
+    unsigned old = __atomic_load_n(&loss_rate, __ATOMIC_RELAXED);
+    unsigned now = (1 - FEC_LOSS_ALPHA) * old + FEC_LOSS_ALPHA * sample;
+    __atomic_store_n(&loss_rate, now, __ATOMIC_RELAXED);
+    LOG_DEBUG("%u of %u chunks lost, loss rate now %.2f%%", lost, expected, now * 100.0 / 65536);
+}
+
+unsigned fec_parity_count(unsigned parts) {
+    double p = __atomic_load_n(&loss_rate, __ATOMIC_RELAXED) / 65536.0;
+    if (parts > FEC_MAX_PARTS || p <= 0) {
+        return 0;
+    }
+    // the smallest k with which more than k losses out of parts + k chunks are unlikely enough
+    for (unsigned k = 0; k <= FEC_MAX_PARITY; k++) {
+        unsigned n = parts + k;
+        double term = 1, recovered = 0;
+        for (unsigned i = 0; i < n; i++) {
+            term *= 1 - p;
+        }
+        for (unsigned lost = 0; lost <= k; lost++) {
+            recovered += term;
+            term *= (double)(n - lost) / (lost + 1) * p / (1 - p);
+        }
+        if (1 - recovered < FEC_TARGET_LOSS) {
+            return k;
+        }
+    }
+    return FEC_MAX_PARITY;
+}
+
+void fec_encode(stream_t const* const data[], unsigned parts, unsigned last_len, unsigned parity, stream_t* const out[]) {
+    assert(parity <= FEC_MAX_PARITY && parts <= FEC_MAX_PARTS);
+    pthread_once(&_fec_once, _fec_make_tables);
+    bool rs = parity > 1;
+    for (unsigned i = 0; i < parity; i++) {
+        memset(out[i], 0, MAX_CARRIED);
+        for (unsigned j = 0; j < parts; j++) {
+            _fec_mul_add(out[i], data[j], _fec_len(j, parts, last_len), _fec_coef(rs, i, j));
+        }
+    }
+}
+
+bool fec_decode(stream_t* const data[], unsigned parts, unsigned last_len, uint64_t missing,
+                stream_t const* const parity[FEC_MAX_PARITY], bool rs) {
+    pthread_once(&_fec_once, _fec_make_tables);
+    unsigned lost[FEC_MAX_PARITY], rows[FEC_MAX_PARITY];
+    unsigned e = 0, r = 0;
+    for (unsigned j = 0; j < parts; j++) {
+        if (missing & (1ull << j)) {
+            if (e == FEC_MAX_PARITY) {
+                return false;
+            }
+            lost[e++] = j;
+        }
+    }
+    for (unsigned i = 0; i < FEC_MAX_PARITY && r < e; i++) {
+        if (parity[i]) {
+            rows[r++] = i;
+        }
+    }
+    if (r < e) {
+        return false;
+    }
+
+    // what the parity chunks still hold once the chunks we have are taken out
+    stream_t residual[FEC_MAX_PARITY][MAX_CARRIED];
+    for (unsigned k = 0; k < e; k++) {
+        memcpy(residual[k], parity[rows[k]], MAX_CARRIED);
+        for (unsigned j = 0; j < parts; j++) {
+            if (!(missing & (1ull << j))) {
+                _fec_mul_add(residual[k], data[j], _fec_len(j, parts, last_len), _fec_coef(rs, rows[k], j));
+            }
+        }
+    }
+
+    // invert the coefficients of the missing chunks, gauss jordan
+    uint8_t m[FEC_MAX_PARITY][FEC_MAX_PARITY], inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    for (unsigned k = 0; k < e; k++) {
+        for (unsigned c = 0; c < e; c++) {
+            m[k][c] = _fec_coef(rs, rows[k], lost[c]);
+            inv[k][c] = (k == c);
+        }
+    }
+    for (unsigned c = 0; c < e; c++) {
+        unsigned pivot = c;
+        while (pivot < e && !m[pivot][c]) {
+            pivot++;
+        }
+        if (pivot == e) {
+            return false;
+        }
+        for (unsigned x = 0; x < e; x++) {
+            uint8_t t = m[c][x]; m[c][x] = m[pivot][x]; m[pivot][x] = t;
+            t = inv[c][x]; inv[c][x] = inv[pivot][x]; inv[pivot][x] = t;
+        }
+        uint8_t scale = _fec_inv(m[c][c]);
+        for (unsigned x = 0; x < e; x++) {
+            m[c][x] = _fec_mul(m[c][x], scale);
+            inv[c][x] = _fec_mul(inv[c][x], scale);
+        }
+        for (unsigned k = 0; k < e; k++) {
+            uint8_t f = m[k][c];
+            if (k == c || !f) {
+                continue;
+            }
+            for (unsigned x = 0; x < e; x++) {
+                m[k][x] ^= _fec_mul(f, m[c][x]);
+                inv[k][x] ^= _fec_mul(f, inv[c][x]);
+            }
+        }
+    }
+
+    for (unsigned c = 0; c < e; c++) {
+        unsigned len = _fec_len(lost[c], parts, last_len);
+        memset(data[lost[c]], 0, len);
+        for (unsigned k = 0; k < e; k++) {
+            _fec_mul_add(data[lost[c]], residual[k], len, inv[c][k]);
+        }
+    }
+    return true;
+}
+
+void fec_set_headers(chunk_t* chunks, unsigned parts, unsigned parity, streamlen_t chunked_len) {
+    my_packet_header header = chunks[0].packet.packet_header;
+    header.flags |= CHUNK_PARITY | ((parity > 1) ? CHUNK_RS : 0);
+    header.parts = chunked_len - (parts - 1) * MAX_CARRIED;
+    for (unsigned i = 0; i < parity; i++) {
+        header.ord_no = FEC_ORD_NO(i, parts);
+        chunks[parts + i].packet.packet_header = header;
+    }
+}
+
+unsigned fec_chunk_size(unsigned parts, streamlen_t chunked_len) {
+    unsigned carried = (parts > 1) ? MAX_CARRIED : chunked_len;
+    return TOT_PACKET_SIZE(carried);
+}
@@ -0,0 +1,101 @@
+/**
+ * Forward error correction: parity chunks sent after the data chunks of a packet.
+ *
+ * With one parity chunk it is the xor of the data chunks, with more it is a
+ * Reed-Solomon code (a Cauchy matrix over GF(256)). Any k chunks missing out
+ * of the data can be restored from k parity chunks. The data chunks are seen
+ * as padded with zeros to MAX_CARRIED.
+ *
+ * A parity chunk has CHUNK_PARITY set, and CHUNK_RS with the Reed-Solomon
+ * code. Its ord_no holds both its index and the number of data chunks, its
+ * parts the length of the last data chunk, which could not be told otherwise
+ * when that is the chunk restored.
+ *
+ * How many parity chunks a packet gets depends on the chunk loss the other end
+ * reports (@see control.h).
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include "structs.h"
+
+/// send parity chunks, they are understood anyway
+#ifndef FEC_ENABLED
+#define FEC_ENABLED 0
+#endif
+
+/// parity chunks sent at most with a packet
+#define FEC_MAX_PARITY 4
+/// bigger packets do not get parity chunks, the ord_no has no room for them
+#define FEC_MAX_PARTS 64
+
+/// the parity chunks are chosen so that a packet is lost with less than this probability
+#ifndef FEC_TARGET_LOSS
+#define FEC_TARGET_LOSS 0.01
+#endif
+
+/// weight of a new report in the loss rate
+#define FEC_LOSS_ALPHA 0.25
+
+#define FEC_ORD_NO(index, parts) (((index) << 6) | ((parts) - 1))
+#define FEC_INDEX(ord_no) ((ord_no) >> 6)
+#define FEC_PARTS(ord_no) (((ord_no) & 0x3F) + 1)
+
+/**
+ * The other end told how many chunks it got.
+ *
+ * @param expected chunks it should have got
+ * @param lost chunks that did not come the first time
+ */
+void fec_report_loss(unsigned expected, unsigned lost);
+
+/**
+ * @return the parity chunks to send with a packet of that many chunks
+ */
+unsigned fec_parity_count(unsigned parts);
+
+/**
+ * Compute the parity chunks of a packet.
+ *
+ * @param data the payloads of the data chunks
+ * @param parts how many
+ * @param last_len length of the last one, the others are MAX_CARRIED long
+ * @param parity how many parity chunks to compute
+ * @param out where to write them, MAX_CARRIED bytes each
+ */
+void fec_encode(stream_t const* const data[], unsigned parts, unsigned last_len, unsigned parity, stream_t* const out[]);
+
+/**
+ * Restore the missing data chunks of a packet.
+ *
+ * @param data the payloads of the data chunks, the missing ones are written
+ * @param parts how many
+ * @param last_len length of the last one
+ * @param missing bit i set if the chunk i is missing
+ * @param parity the parity chunks, NULL for the ones that did not come
+ * @param rs true if the parity chunks had CHUNK_RS
+ *
+ * @return false if there are not enough parity chunks
+ */
+bool fec_decode(stream_t* const data[], unsigned parts, unsigned last_len, uint64_t missing,
+                stream_t const* const parity[FEC_MAX_PARITY], bool rs);
+
+/**
+ * Write the headers of the parity chunks, after the data chunks and with the same numbers.
+ *
+ * @param chunks the chunks of the packet, the data ones with their headers already set
+ * @param parts number of data chunks
+ * @param parity number of parity chunks after them
+ * @param chunked_len length of the data in the chunks
+ */
+void fec_set_headers(chunk_t* chunks, unsigned parts, unsigned parity, streamlen_t chunked_len);
+
+/**
+ * @return the size of a parity chunk of a packet, including the header
+ */
+unsigned fec_chunk_size(unsigned parts, streamlen_t chunked_len);
+
+#endif /* FEC_H */
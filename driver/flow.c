@@ -0,0 +1,150 @@
+/**
+ * Per flow compressibility cache, see flow.h
+ *
+ */
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "flow.h"
+
+#define IPPROTO_TCP_NO 6
+#define IPPROTO_UDP_NO 17
+
+typedef struct {
+    bool used;
+    flow_key_t key;
+    // compressions in a row that did not shrink the packet
+    uint8_t failures;
+    // packets not compressed since the last probe
+    uint8_t skipped;
+    unsigned last_seen;
+} flow_t;
+
+static flow_t flows[FLOW_TABLE_SIZE];
+static unsigned clock_tick;
+// the workers record the outcomes
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+void init_flows(void) {
+    pthread_mutex_lock(&lock);
+    memset(flows, 0, sizeof(flows));
+    clock_tick = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+bool flow_parse(const payload_t pkt, flow_key_t *key) {
+    stream_t const* p = pkt.stream;
+    unsigned transport;
+
+    memset(key, 0, sizeof(flow_key_t));
+    if (pkt.len < 20) {
+        return false;
+    }
+    switch (p[0] >> 4) {
+    case 4:
+        transport = (p[0] & 0x0F) * 4;
+        key->proto = p[9];
+        memcpy(key->src, p + 12, 4);
+        memcpy(key->dst, p + 16, 4);
+        // only the first fragment carries the ports
+        if ((p[6] & 0x1F) || p[7]) {
+            return true;
+        }
+        break;
+    case 6:
+        if (pkt.len < 40) {
+            return false;
+        }
+        transport = 40;
+        key->proto = p[6];
+        memcpy(key->src, p + 8, 16);
+        memcpy(key->dst, p + 24, 16);
+        break;
+    default:
+        return false;
+    }
+
+    if ((key->proto == IPPROTO_TCP_NO || key->proto == IPPROTO_UDP_NO) && pkt.len >= transport + 4) {
+        key->sport = (p[transport] << 8) | p[transport + 1];
+        key->dport = (p[transport + 2] << 8) | p[transport + 3];
+    }
+    return true;
+}
+
+bool flow_key_equals(const flow_key_t *x, const flow_key_t *y) {
+    return x->proto == y->proto && x->sport == y->sport && x->dport == y->dport
+        && !memcmp(x->src, y->src, sizeof(x->src)) && !memcmp(x->dst, y->dst, sizeof(x->dst));
+}
+
+uint32_t flow_hash(const flow_key_t *key) {
+    // FNV-1a over the fields
+    uint32_t h = 2166136261u;
+    for (unsigned i = 0; i < sizeof(key->src); i++) {
+        h = (h ^ key->src[i]) * 16777619u;
+        h = (h ^ key->dst[i]) * 16777619u;
+    }
+    h = (h ^ key->sport) * 16777619u;
+    h = (h ^ key->dport) * 16777619u;
+    h = (h ^ key->proto) * 16777619u;
+    return h;
+}
+
+/**
+ * Look for a flow, the lock must be held.
+ *
+ * @param create if true and the flow is unknown, replace the oldest flow of its slots
+ *
+ * @return the flow or NULL
+ */
+flow_t* _flow_find(const flow_key_t *key, bool create) {
+    unsigned start = flow_hash(key) % FLOW_TABLE_SIZE;
+    flow_t* oldest = NULL;
+    for (unsigned i = 0; i < FLOW_WAYS; i++) {
+        flow_t* f = &flows[(start + i) % FLOW_TABLE_SIZE];
+        if (f->used && flow_key_equals(&f->key, key)) {
+            return f;
+        }
+        if (!oldest || !f->used || (oldest->used && f->last_seen < oldest->last_seen)) {
+            oldest = f;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    memset(oldest, 0, sizeof(flow_t));
+    oldest->used = true;
+    oldest->key = *key;
+    return oldest;
+}
+
+bool flow_should_compress(const flow_key_t *key) {
+    bool result = true;
+    pthread_mutex_lock(&lock);
+    flow_t* f = _flow_find(key, true);
+    f->last_seen = ++clock_tick;
+    if (f->failures >= FLOW_SKIP_AFTER) {
+        // try again once in a while, the content of a flow may change
+        if (++f->skipped >= FLOW_REPROBE_INTERVAL) {
+            f->skipped = 0;
+        } else {
+            result = false;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void flow_record(const flow_key_t *key, bool shrunk) {
+    pthread_mutex_lock(&lock);
+    // the flow may have been replaced in the meantime
+    flow_t* f = _flow_find(key, false);
+    if (f) {
+        if (shrunk) {
+            f->failures = 0;
+        } else if (f->failures < 0xFF) {
+            f->failures++;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,82 @@
+/**
+ * Small table of the flows going through the tun, remembering whether
+ * their packets could be compressed.
+ *
+ * Compressibility is very stable within a flow: a tls stream never shrinks
+ * while plain http usually does. Flows that keep failing are not given to
+ * deflate anymore, except for a probe every now and then.
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef FLOW_H
+#define FLOW_H
+
+#include "structs.h"
+
+/// number of flows remembered, the least recently seen one is replaced
+#define FLOW_TABLE_SIZE 64
+
+/// how many slots are looked at for a flow before replacing one
+#define FLOW_WAYS 4
+
+/// failed compressions in a row before a flow is not compressed anymore
+#define FLOW_SKIP_AFTER 3
+
+/// one packet every so many of a skipped flow is compressed anyway
+#define FLOW_REPROBE_INTERVAL 32
+
+/**
+ * The usual 5-tuple, ipv4 addresses are stored in the first 4 bytes.
+ */
+typedef struct {
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+} flow_key_t;
+
+/**
+ * Forget all the flows.
+ */
+void init_flows(void);
+
+/**
+ * Extract the 5-tuple from an ip packet.
+ *
+ * @param pkt ip packet as read from the tun
+ * @param key where to store the 5-tuple
+ *
+ * @return false if it is not an ip packet we understand
+ */
+bool flow_parse(const payload_t pkt, flow_key_t *key);
+
+/**
+ * Compare two keys field by field, the struct has padding.
+ */
+bool flow_key_equals(const flow_key_t *x, const flow_key_t *y);
+
+/**
+ * @return a hash of the 5-tuple, to find the flow in a table
+ */
+uint32_t flow_hash(const flow_key_t *key);
+
+/**
+ * Check if a packet of the flow is worth compressing.
+ * Must be called for every packet, the flow is added if new.
+ *
+ * @param key the flow of the packet
+ *
+ * @return true if deflate should be tried
+ */
+bool flow_should_compress(const flow_key_t *key);
+
+/**
+ * Store the outcome of a compression, can be called by any thread.
+ *
+ * @param key the flow of the packet
+ * @param shrunk true if the packet got smaller
+ */
+void flow_record(const flow_key_t *key, bool shrunk);
+
+#endif /* FLOW_H */
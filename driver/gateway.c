@@ -21,7 +21,7 @@
 #endif
 
 #if SERIAL_STYLE == 0
-#define USAGE "%s <usbdevice> <externalInterface>"
+#define USAGE "%s <usbdevice>[,<usbdevice>...] <externalInterface>"
 #elif SERIAL_STYLE == 1
 #define USAGE "%s <host:port> <externalInterface>"
 #else
@@ -30,6 +30,7 @@
 
 // Functions for using a tunnel device
 #include "tunnel.h"
+#include "mss.h"
 
 // our own declarations
 #include "client.h"
@@ -70,6 +71,10 @@ void start_gateway(serialif_t* sif, mcp_t* mcp, char const *eth) {
     
     // it will exit abruptly if it doesn't open it correctly
     tun_open(DEFAULT_CLIENT_NO, tun_name);
+    // only packets the MSS clamping lets through
+    if (mss_mtu()) {
+        tun_set_mtu(DEFAULT_CLIENT_NO, mss_mtu());
+    }
 
     setup_iptables(tun_name, eth);
 
@@ -0,0 +1,187 @@
+/**
+ * Serial framing, see hdlc.h
+ *
+ */
+#include <string.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "util.h"
+#include "hdlc.h"
+
+// crc of a byte followed by 0 to 7 zero bytes, for slice by 8
+static uint16_t _hdlc_crc_table[8][256];
+static pthread_once_t _hdlc_crc_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Same as crcByte in TinyOS.
+ */
+static inline uint16_t _hdlc_crc_byte(uint16_t crc, uint8_t b) {
+    crc = (uint8_t)(crc >> 8) | (crc << 8);
+    crc ^= b;
+    crc ^= (uint8_t)(crc & 0xff) >> 4;
+    crc ^= crc << 12;
+    crc ^= (crc & 0xff) << 5;
+    return crc;
+}
+
+void _hdlc_crc_make_table(void) {
+    for (unsigned v = 0; v < 256; v++) {
+        _hdlc_crc_table[0][v] = _hdlc_crc_byte(0, v);
+    }
+    for (unsigned k = 1; k < 8; k++) {
+        for (unsigned v = 0; v < 256; v++) {
+            uint16_t prev = _hdlc_crc_table[k - 1][v];
+            _hdlc_crc_table[k][v] = (prev << 8) ^ _hdlc_crc_table[0][prev >> 8];
+        }
+    }
+}
+
+uint16_t hdlc_crc(uint16_t crc, stream_t const* data, unsigned len) {
+    pthread_once(&_hdlc_crc_once, _hdlc_crc_make_table);
+    uint16_t const (*t)[256] = (uint16_t const (*)[256])_hdlc_crc_table;
+    // the crc so far goes in with the first two bytes, the eight lookups are independent
+    for (; len >= 8; data += 8, len -= 8) {
+        crc = t[7][data[0] ^ (crc >> 8)] ^ t[6][data[1] ^ (crc & 0xFF)] ^ t[5][data[2]] ^ t[4][data[3]]
+            ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    for (; len; data++, len--) {
+        crc = (crc << 8) ^ t[0][(crc >> 8) ^ *data];
+    }
+    return crc;
+}
+
+/**
+ * @return the index of the first flag or escape byte, len if there is none
+ */
+static inline unsigned _hdlc_scan(stream_t const* data, unsigned len) {
+    unsigned i = 0;
+#ifdef __SSE2__
+    __m128i const flag = _mm_set1_epi8(HDLC_FLAG);
+    __m128i const escape = _mm_set1_epi8(HDLC_ESCAPE);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const*)(data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, escape)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (i < len && data[i] != HDLC_FLAG && data[i] != HDLC_ESCAPE) {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Append a byte to a frame, escaping it if needed.
+ */
+static inline stream_t* _hdlc_put(stream_t* out, uint8_t b) {
+    if (b == HDLC_FLAG || b == HDLC_ESCAPE) {
+        *out++ = HDLC_ESCAPE;
+        b ^= HDLC_ESCAPE_XOR;
+    }
+    *out++ = b;
+    return out;
+}
+
+unsigned hdlc_encode(stream_t* out, uint8_t protocol, int seqno, stream_t const* data, unsigned len) {
+    stream_t* start = out;
+    *out++ = HDLC_FLAG;
+    uint16_t crc = _hdlc_crc_byte(0, protocol);
+    out = _hdlc_put(out, protocol);
+    if (seqno >= 0) {
+        crc = _hdlc_crc_byte(crc, seqno);
+        out = _hdlc_put(out, seqno);
+    }
+    crc = hdlc_crc(crc, data, len);
+    // copy the runs between the bytes to escape
+    for (unsigned i = 0; i < len; ) {
+        unsigned run = _hdlc_scan(data + i, len - i);
+        memcpy(out, data + i, run);
+        out += run;
+        i += run;
+        if (i < len) {
+            out = _hdlc_put(out, data[i++]);
+        }
+    }
+    out = _hdlc_put(out, crc & 0xFF);
+    out = _hdlc_put(out, crc >> 8);
+    *out++ = HDLC_FLAG;
+    return out - start;
+}
+
+void hdlc_decoder_init(hdlc_decoder_t* dec) {
+    dec->in_sync = false;
+    dec->escaped = false;
+    dec->count = 0;
+}
+
+/**
+ * A flag ended a frame, check it and hand it out.
+ */
+void _hdlc_frame_done(hdlc_decoder_t* dec, hdlc_frame_handler_t handler, void* p) {
+    // protocol and crc at least
+    if (dec->count >= 3 && !dec->escaped) {
+        unsigned len = dec->count - 2;
+        uint16_t crc = dec->frame[len] | (dec->frame[len + 1] << 8);
+        if (hdlc_crc(0, dec->frame, len) == crc) {
+            handler(p, dec->frame[0], dec->frame + 1, len - 1);
+        } else {
+            LOG_DEBUG("dropping a serial frame with a wrong crc");
+        }
+    }
+    dec->count = 0;
+    dec->escaped = false;
+}
+
+/**
+ * Append bytes to the frame being decoded, dropping it when it gets too long.
+ */
+static inline void _hdlc_append(hdlc_decoder_t* dec, stream_t const* data, unsigned len) {
+    if (dec->count + len > HDLC_MTU) {
+        // wait for the next frame
+        LOG_DEBUG("serial frame too long, resynchronising");
+        dec->in_sync = false;
+        dec->count = 0;
+        return;
+    }
+    memcpy(dec->frame + dec->count, data, len);
+    dec->count += len;
+}
+
+void hdlc_decode(hdlc_decoder_t* dec, stream_t const* in, unsigned len, hdlc_frame_handler_t handler, void* p) {
+    unsigned i = 0;
+    while (i < len) {
+        if (!dec->in_sync) {
+            stream_t const* flag = memchr(in + i, HDLC_FLAG, len - i);
+            if (!flag) {
+                return;
+            }
+            i = flag - in + 1;
+            dec->in_sync = true;
+            dec->escaped = false;
+            dec->count = 0;
+            continue;
+        }
+        uint8_t b = in[i];
+        if (b == HDLC_FLAG) {
+            _hdlc_frame_done(dec, handler, p);
+            i++;
+        } else if (b == HDLC_ESCAPE) {
+            dec->escaped = true;
+            i++;
+        } else if (dec->escaped) {
+            b ^= HDLC_ESCAPE_XOR;
+            dec->escaped = false;
+            _hdlc_append(dec, &b, 1);
+            i++;
+        } else {
+            // take everything up to the next flag or escape at once
+            unsigned run = _hdlc_scan(in + i, len - i);
+            _hdlc_append(dec, in + i, run);
+            i += run;
+        }
+    }
+}
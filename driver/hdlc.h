@@ -0,0 +1,84 @@
+/**
+ * Framing of the TinyOS serial protocol (TEP 113).
+ *
+ * A frame is [flag] [protocol] [seqno] [data] [crc lo] [crc hi] [flag],
+ * the seqno is only there for the protocols that are acknowledged. Flag
+ * and escape bytes inside the frame are escaped. The crc is the CRC-CCITT
+ * of everything between the flags.
+ *
+ * The crc is computed 8 bytes at a time and, with SSE2, the bytes to escape
+ * are looked for 16 at a time, the rest is copied in runs.
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef HDLC_H
+#define HDLC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "structs.h"
+
+#define HDLC_FLAG 0x7E
+#define HDLC_ESCAPE 0x7D
+#define HDLC_ESCAPE_XOR 0x20
+
+/// protocols, the first byte of every frame
+#define HDLC_P_ACK 0x43
+#define HDLC_P_PACKET_ACK 0x44
+#define HDLC_P_PACKET_NO_ACK 0x45
+
+/// longest frame, unescaped and without flags
+#define HDLC_MTU 300
+
+/// bytes needed to encode data of the given length in the worst case
+#define HDLC_ENCODED_SIZE(len) (2 + 2 * (4 + (len)))
+
+typedef struct {
+    bool in_sync;
+    bool escaped;
+    unsigned count;
+    stream_t frame[HDLC_MTU];
+} hdlc_decoder_t;
+
+/**
+ * Called for every correct frame found by hdlc_decode.
+ *
+ * @param p what was given to hdlc_decode
+ * @param protocol the first byte of the frame
+ * @param frame the rest of the frame (seqno included), without the crc
+ * @param len its length
+ */
+typedef void (*hdlc_frame_handler_t)(void* p, uint8_t protocol, stream_t const* frame, unsigned len);
+
+/**
+ * Update a CRC-CCITT with some data.
+ *
+ * @param crc the crc so far, 0 to start
+ */
+uint16_t hdlc_crc(uint16_t crc, stream_t const* data, unsigned len);
+
+/**
+ * Build a frame.
+ *
+ * @param out at least HDLC_ENCODED_SIZE(len) bytes
+ * @param protocol HDLC_P_*
+ * @param seqno the sequence number, negative for none
+ *
+ * @return the length of the frame
+ */
+unsigned hdlc_encode(stream_t* out, uint8_t protocol, int seqno, stream_t const* data, unsigned len);
+
+/**
+ * Reset a decoder, it waits for the next flag.
+ */
+void hdlc_decoder_init(hdlc_decoder_t* dec);
+
+/**
+ * Feed bytes to a decoder, frames can span several calls.
+ *
+ * @param handler called for every complete frame with a correct crc
+ * @param p given to the handler
+ */
+void hdlc_decode(hdlc_decoder_t* dec, stream_t const* in, unsigned len, hdlc_frame_handler_t handler, void* p);
+
+#endif /* HDLC_H */
@@ -0,0 +1,551 @@
+/**
+ * Header compression for the ip packets we carry over the motes.
+ * See headercomp.h for an overview of the scheme.
+ *
+ * Layout of the frames we produce (everything else is passed unchanged):
+ *
+ *   refresh:    [HC_TYPE_REFRESH|gen] [cid] [reference header] [body]
+ *   compressed: [HC_TYPE_COMPRESSED|gen] [cid] [body]
+ *
+ *   body:       [mask] [changed fields...] [transport checksum] [payload]
+ *
+ * The reference header is the complete ip + tcp/udp header of the first
+ * packet of a generation, all further packets of that generation encode
+ * their fields relative to it. A refresh is repeated HC_FULL_REPEAT times
+ * with the same reference, so losing a single one of them is harmless.
+ * The transport checksum is always carried verbatim: if we ever rebuild a
+ * wrong header the receiving stack will simply drop the packet.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#include "util.h"
+#include "headercomp.h"
+
+#define IP_HLEN sizeof(struct iphdr)
+
+/// largest header we keep as reference: ip without options + tcp with options
+#define HC_MAX_HEADER (IP_HLEN + 60)
+/// worst case size of everything we put in front of the payload
+#define HC_MAX_OVERHEAD (HC_MAX_HEADER + HC_MAX_GROWTH)
+
+// bits of the change mask
+#define HC_IPID  0x01
+#define HC_SEQ   0x02
+#define HC_ACK   0x04
+#define HC_WIN   0x08
+#define HC_FLAGS 0x10
+#define HC_TSVAL 0x20
+#define HC_TSECR 0x40
+
+// offsets of the fields inside the ip header
+#define IP_LEN_OFFSET     2
+#define IP_ID_OFFSET      4
+#define IP_FRAG_OFFSET    6
+#define IP_PROTO_OFFSET   9
+#define IP_CHECK_OFFSET  10
+#define IP_SADDR_OFFSET  12
+#define IP_DADDR_OFFSET  16
+
+// offsets of the fields inside the tcp header
+#define TCP_SEQ_OFFSET    4
+#define TCP_ACK_OFFSET    8
+#define TCP_DOFF_OFFSET  12
+#define TCP_FLAGS_OFFSET 13
+#define TCP_WIN_OFFSET   14
+#define TCP_CHECK_OFFSET 16
+#define TCP_URG_OFFSET   18
+
+// offsets of the fields inside the udp header
+#define UDP_LEN_OFFSET   4
+#define UDP_CHECK_OFFSET 6
+
+typedef struct {
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+} hc_key_t;
+
+/// one flow, both sides use the same structure
+typedef struct {
+    bool in_use;
+    hc_key_t key;
+    // only the lower nibble is used, it travels in the first byte of each frame
+    uint8_t generation;
+    unsigned since_refresh;
+    unsigned full_left;
+    unsigned long last_used;
+    unsigned header_len;
+    stream_t header[HC_MAX_HEADER];
+} hc_context_t;
+
+static hc_context_t compress_ctx[HC_CONTEXTS];
+static hc_context_t decompress_ctx[HC_CONTEXTS];
+static unsigned long hc_clock = 0;
+
+void init_header_compression(void) {
+    memset(compress_ctx, 0, sizeof(compress_ctx));
+    memset(decompress_ctx, 0, sizeof(decompress_ctx));
+    hc_clock = 0;
+}
+
+/****************************************************/
+/* helpers to access big endian fields in a stream  */
+/****************************************************/
+
+uint16_t _hc_get16(stream_t const* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+uint32_t _hc_get32(stream_t const* p) {
+    return ((uint32_t)_hc_get16(p) << 16) | _hc_get16(p + 2);
+}
+
+void _hc_put16(stream_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+void _hc_put32(stream_t* p, uint32_t v) {
+    _hc_put16(p, v >> 16);
+    _hc_put16(p + 2, v & 0xFFFF);
+}
+
+/**
+ * Write a 16 bit delta the way VJ does: 1 byte for 1..255, 0 and 2 bytes otherwise.
+ *
+ * @return pointer past the written delta
+ */
+stream_t* _hc_put_delta(stream_t* out, uint16_t delta) {
+    if (delta >= 1 && delta <= 255) {
+        *out++ = delta;
+    } else {
+        *out++ = 0;
+        _hc_put16(out, delta);
+        out += 2;
+    }
+    return out;
+}
+
+/**
+ * Read back what _hc_put_delta wrote.
+ *
+ * @return pointer past the delta, NULL if the stream ended
+ */
+stream_t const* _hc_get_delta(stream_t const* in, stream_t const* end, uint16_t* delta) {
+    if (in >= end)
+        return NULL;
+    if (*in) {
+        *delta = *in;
+        return in + 1;
+    }
+    if (in + 3 > end)
+        return NULL;
+    *delta = _hc_get16(in + 1);
+    return in + 3;
+}
+
+/**
+ * Standard internet checksum of the ip header.
+ */
+uint16_t _hc_ip_checksum(stream_t const* header) {
+    uint32_t sum = 0;
+    for (unsigned i = 0; i < IP_HLEN; i += 2) {
+        sum += _hc_get16(header + i);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return ~sum & 0xFFFF;
+}
+
+/**
+ * Find the timestamp option inside a tcp header.
+ *
+ * @param tcp start of the tcp header
+ * @param tcp_len length of the tcp header including options
+ *
+ * @return offset of the option inside the tcp header or 0 if there is none
+ */
+unsigned _hc_ts_offset(stream_t const* tcp, unsigned tcp_len) {
+    unsigned i = sizeof(struct tcphdr);
+    while (i < tcp_len) {
+        if (tcp[i] == TCPOPT_EOL)
+            break;
+        if (tcp[i] == TCPOPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= tcp_len || tcp[i + 1] < 2)
+            break;
+        if (tcp[i] == TCPOPT_TIMESTAMP && tcp[i + 1] == TCPOLEN_TIMESTAMP && i + TCPOLEN_TIMESTAMP <= tcp_len)
+            return i;
+        i += tcp[i + 1];
+    }
+    return 0;
+}
+
+/**
+ * Length of the ip + transport header, as far as we are able to compress it.
+ *
+ * @param p start of the ip header
+ * @param avail how many bytes there are at p
+ *
+ * @return the header length or 0 if unsupported
+ */
+unsigned _hc_header_len(stream_t const* p, unsigned avail) {
+    // only ipv4 without options
+    if (avail < IP_HLEN || p[0] != 0x45)
+        return 0;
+
+    unsigned len;
+    switch (p[IP_PROTO_OFFSET]) {
+    case IPPROTO_TCP:
+        if (avail < IP_HLEN + sizeof(struct tcphdr))
+            return 0;
+        len = IP_HLEN + (p[IP_HLEN + TCP_DOFF_OFFSET] >> 4) * 4;
+        if (len < IP_HLEN + sizeof(struct tcphdr))
+            return 0;
+        break;
+    case IPPROTO_UDP:
+        len = IP_HLEN + sizeof(struct udphdr);
+        break;
+    default:
+        return 0;
+    }
+    return len <= avail ? len : 0;
+}
+
+/**
+ * Check whether we know how to compress the packet.
+ *
+ * @param data the whole ip packet
+ * @param key filled with the flow the packet belongs to
+ *
+ * @return length of the ip + transport header, 0 if not compressible
+ */
+unsigned _hc_parse(payload_t const data, hc_key_t* key) {
+    stream_t const* p = data.stream;
+    unsigned len = _hc_header_len(p, data.len);
+    if (!len || _hc_get16(p + IP_LEN_OFFSET) != data.len)
+        return 0;
+    // fragments would need a context on their own
+    if (_hc_get16(p + IP_FRAG_OFFSET) & (IP_MF | IP_OFFMASK))
+        return 0;
+    if (p[IP_PROTO_OFFSET] == IPPROTO_UDP && _hc_get16(p + IP_HLEN + UDP_LEN_OFFSET) != data.len - IP_HLEN)
+        return 0;
+
+    *key = (hc_key_t){
+        .saddr = _hc_get32(p + IP_SADDR_OFFSET),
+        .daddr = _hc_get32(p + IP_DADDR_OFFSET),
+        .proto = p[IP_PROTO_OFFSET],
+        .sport = _hc_get16(p + IP_HLEN),
+        .dport = _hc_get16(p + IP_HLEN + 2)
+    };
+    return len;
+}
+
+bool _hc_key_equals(hc_key_t const* x, hc_key_t const* y) {
+    return x->saddr == y->saddr && x->daddr == y->daddr && x->sport == y->sport
+        && x->dport == y->dport && x->proto == y->proto;
+}
+
+/**
+ * Find the context of a flow or take over the least recently used one.
+ */
+hc_context_t* _hc_lookup(hc_key_t const* key) {
+    hc_context_t* victim = compress_ctx;
+    for (hc_context_t* ctx = compress_ctx; ctx < compress_ctx + HC_CONTEXTS; ctx++) {
+        if (ctx->in_use && _hc_key_equals(&ctx->key, key)) {
+            return ctx;
+        }
+        if (!ctx->in_use || (victim->in_use && ctx->last_used < victim->last_used)) {
+            victim = ctx;
+        }
+    }
+    LOG_DEBUG("header compression: new context %u", (unsigned)(victim - compress_ctx));
+    victim->in_use = true;
+    victim->key = *key;
+    victim->header_len = 0;
+    victim->full_left = 0;
+    return victim;
+}
+
+/**
+ * Do the fields which are not transmitted match the reference?
+ */
+bool _hc_constant_fields_match(stream_t const* ref, stream_t const* hdr, unsigned len) {
+    // version, ihl, tos
+    if (memcmp(ref, hdr, 2))
+        return false;
+    // fragment bits, ttl, protocol, addresses
+    if (memcmp(ref + IP_FRAG_OFFSET, hdr + IP_FRAG_OFFSET, 4) || memcmp(ref + IP_SADDR_OFFSET, hdr + IP_SADDR_OFFSET, 8))
+        return false;
+    bool udp = hdr[IP_PROTO_OFFSET] == IPPROTO_UDP;
+    ref += IP_HLEN;
+    hdr += IP_HLEN;
+    len -= IP_HLEN;
+    // ports
+    if (memcmp(ref, hdr, 4))
+        return false;
+    if (udp)
+        return true;
+    if (ref[TCP_DOFF_OFFSET] != hdr[TCP_DOFF_OFFSET] || memcmp(ref + TCP_URG_OFFSET, hdr + TCP_URG_OFFSET, 2))
+        return false;
+    // options must be identical, apart from the timestamp values
+    unsigned ts = _hc_ts_offset(hdr, len);
+    if (ts != _hc_ts_offset(ref, len))
+        return false;
+    if (ts) {
+        return !memcmp(ref + sizeof(struct tcphdr), hdr + sizeof(struct tcphdr), ts + 2 - sizeof(struct tcphdr))
+            && !memcmp(ref + ts + TCPOLEN_TIMESTAMP, hdr + ts + TCPOLEN_TIMESTAMP, len - ts - TCPOLEN_TIMESTAMP);
+    }
+    return !memcmp(ref + sizeof(struct tcphdr), hdr + sizeof(struct tcphdr), len - sizeof(struct tcphdr));
+}
+
+/**
+ * Encode a 32 bit field as delta to the reference if it fits into 16 bits.
+ *
+ * @return false if the delta is too big (or negative)
+ */
+bool _hc_encode_field32(stream_t const* ref, stream_t const* hdr, unsigned char bit, unsigned char* mask, stream_t** out) {
+    uint32_t delta = _hc_get32(hdr) - _hc_get32(ref);
+    if (delta > 0xFFFF)
+        return false;
+    if (delta) {
+        *mask |= bit;
+        *out = _hc_put_delta(*out, delta);
+    }
+    return true;
+}
+
+/**
+ * Write mask and changed fields of hdr relative to ref.
+ *
+ * @return pointer past the encoded body (without payload), NULL if the header
+ *         cannot be expressed relative to the reference
+ */
+stream_t* _hc_encode(stream_t const* ref, stream_t const* hdr, unsigned len, stream_t* out) {
+    if (!_hc_constant_fields_match(ref, hdr, len))
+        return NULL;
+
+    unsigned char mask = 0;
+    stream_t* mask_pos = out++;
+
+    uint16_t ipid = _hc_get16(hdr + IP_ID_OFFSET) - _hc_get16(ref + IP_ID_OFFSET);
+    if (ipid) {
+        mask |= HC_IPID;
+        out = _hc_put_delta(out, ipid);
+    }
+
+    bool tcp = hdr[IP_PROTO_OFFSET] == IPPROTO_TCP;
+    ref += IP_HLEN;
+    hdr += IP_HLEN;
+    len -= IP_HLEN;
+    if (tcp) {
+        if (!_hc_encode_field32(ref + TCP_SEQ_OFFSET, hdr + TCP_SEQ_OFFSET, HC_SEQ, &mask, &out))
+            return NULL;
+        if (!_hc_encode_field32(ref + TCP_ACK_OFFSET, hdr + TCP_ACK_OFFSET, HC_ACK, &mask, &out))
+            return NULL;
+        if (memcmp(ref + TCP_WIN_OFFSET, hdr + TCP_WIN_OFFSET, 2)) {
+            mask |= HC_WIN;
+            memcpy(out, hdr + TCP_WIN_OFFSET, 2);
+            out += 2;
+        }
+        if (ref[TCP_FLAGS_OFFSET] != hdr[TCP_FLAGS_OFFSET]) {
+            mask |= HC_FLAGS;
+            *out++ = hdr[TCP_FLAGS_OFFSET];
+        }
+        unsigned ts = _hc_ts_offset(hdr, len);
+        if (ts) {
+            if (!_hc_encode_field32(ref + ts + 2, hdr + ts + 2, HC_TSVAL, &mask, &out))
+                return NULL;
+            if (!_hc_encode_field32(ref + ts + 6, hdr + ts + 6, HC_TSECR, &mask, &out))
+                return NULL;
+        }
+        memcpy(out, hdr + TCP_CHECK_OFFSET, 2);
+    } else {
+        memcpy(out, hdr + UDP_CHECK_OFFSET, 2);
+    }
+    out += 2;
+    *mask_pos = mask;
+    return out;
+}
+
+bool header_compress(const payload_t data, payload_t *result) {
+    hc_key_t key;
+    unsigned hlen = _hc_parse(data, &key);
+
+    if (!hlen || result->len < data.len + HC_MAX_OVERHEAD) {
+        if (result->len < data.len)
+            return false;
+        copy_payload((payload_t*)&data, result);
+        return true;
+    }
+
+    hc_context_t* ctx = _hc_lookup(&key);
+    ctx->last_used = ++hc_clock;
+
+    stream_t* out = (stream_t*)result->stream;
+    stream_t* body = NULL;
+    bool refresh = ctx->full_left || ctx->header_len != hlen || ++ctx->since_refresh >= HC_REFRESH_INTERVAL;
+    if (!refresh) {
+        body = _hc_encode(ctx->header, data.stream, hlen, out + 2);
+    }
+
+    if (body) {
+        out[0] = (HC_TYPE_COMPRESSED << 4) | ctx->generation;
+        LOG_DEBUG("header compression: %u byte header sent as %u", hlen, (unsigned)(body - out));
+    } else {
+        // a repeated refresh still carries the reference of its generation
+        if (ctx->full_left && ctx->header_len == hlen) {
+            body = _hc_encode(ctx->header, data.stream, hlen, out + 2 + hlen);
+        }
+        if (!body) {
+            // start a new generation with this header as reference
+            ctx->generation = (ctx->generation + 1) & 0xF;
+            ctx->full_left = HC_FULL_REPEAT;
+            ctx->since_refresh = 0;
+            ctx->header_len = hlen;
+            memcpy(ctx->header, data.stream, hlen);
+            body = _hc_encode(ctx->header, data.stream, hlen, out + 2 + hlen);
+            assert(body);
+        }
+        ctx->full_left--;
+        out[0] = (HC_TYPE_REFRESH << 4) | ctx->generation;
+        memcpy(out + 2, ctx->header, hlen);
+    }
+    out[1] = ctx - compress_ctx;
+
+    memcpy(body, data.stream + hlen, data.len - hlen);
+    result->len = (body - out) + data.len - hlen;
+    return true;
+}
+
+/**
+ * Apply the changed fields of a body onto a copy of the reference.
+ *
+ * @return pointer to the payload, NULL if the body is malformed
+ */
+stream_t const* _hc_decode(stream_t* hdr, unsigned len, stream_t const* in, stream_t const* end) {
+    if (in >= end)
+        return NULL;
+    unsigned char mask = *in++;
+    uint16_t delta;
+
+    if (mask & HC_IPID) {
+        if (!(in = _hc_get_delta(in, end, &delta)))
+            return NULL;
+        _hc_put16(hdr + IP_ID_OFFSET, _hc_get16(hdr + IP_ID_OFFSET) + delta);
+    }
+
+    stream_t* l4 = hdr + IP_HLEN;
+    if (hdr[IP_PROTO_OFFSET] == IPPROTO_TCP) {
+        if (mask & HC_SEQ) {
+            if (!(in = _hc_get_delta(in, end, &delta)))
+                return NULL;
+            _hc_put32(l4 + TCP_SEQ_OFFSET, _hc_get32(l4 + TCP_SEQ_OFFSET) + delta);
+        }
+        if (mask & HC_ACK) {
+            if (!(in = _hc_get_delta(in, end, &delta)))
+                return NULL;
+            _hc_put32(l4 + TCP_ACK_OFFSET, _hc_get32(l4 + TCP_ACK_OFFSET) + delta);
+        }
+        if (mask & HC_WIN) {
+            if (in + 2 > end)
+                return NULL;
+            memcpy(l4 + TCP_WIN_OFFSET, in, 2);
+            in += 2;
+        }
+        if (mask & HC_FLAGS) {
+            if (in >= end)
+                return NULL;
+            l4[TCP_FLAGS_OFFSET] = *in++;
+        }
+        if (mask & (HC_TSVAL | HC_TSECR)) {
+            unsigned ts = _hc_ts_offset(l4, len - IP_HLEN);
+            if (!ts)
+                return NULL;
+            if (mask & HC_TSVAL) {
+                if (!(in = _hc_get_delta(in, end, &delta)))
+                    return NULL;
+                _hc_put32(l4 + ts + 2, _hc_get32(l4 + ts + 2) + delta);
+            }
+            if (mask & HC_TSECR) {
+                if (!(in = _hc_get_delta(in, end, &delta)))
+                    return NULL;
+                _hc_put32(l4 + ts + 6, _hc_get32(l4 + ts + 6) + delta);
+            }
+        }
+        if (in + 2 > end)
+            return NULL;
+        memcpy(l4 + TCP_CHECK_OFFSET, in, 2);
+    } else {
+        if (in + 2 > end)
+            return NULL;
+        memcpy(l4 + UDP_CHECK_OFFSET, in, 2);
+    }
+    return in + 2;
+}
+
+bool header_decompress(const payload_t data, payload_t *result) {
+    stream_t const* in = data.stream;
+    stream_t const* end = data.stream + data.len;
+    unsigned type = data.len ? in[0] >> 4 : 0;
+
+    if (type != HC_TYPE_REFRESH && type != HC_TYPE_COMPRESSED) {
+        if (result->len < data.len)
+            return false;
+        copy_payload((payload_t*)&data, result);
+        return true;
+    }
+    if (data.len < 2 || in[1] >= HC_CONTEXTS)
+        return false;
+
+    hc_context_t* ctx = &decompress_ctx[in[1]];
+    uint8_t generation = in[0] & 0xF;
+    in += 2;
+
+    if (type == HC_TYPE_REFRESH) {
+        // the reference of the generation comes first
+        unsigned hlen = _hc_header_len(in, end - in);
+        if (!hlen)
+            return false;
+        ctx->in_use = true;
+        ctx->generation = generation;
+        ctx->header_len = hlen;
+        memcpy(ctx->header, in, hlen);
+        in += hlen;
+    } else if (!ctx->in_use || ctx->generation != generation) {
+        LOG_DEBUG("header decompression: context %u generation %u unknown", (unsigned)(ctx - decompress_ctx), (unsigned)generation);
+        return false;
+    }
+
+    stream_t* out = (stream_t*)result->stream;
+    unsigned hlen = ctx->header_len;
+    if (result->len < hlen)
+        return false;
+    memcpy(out, ctx->header, hlen);
+    stream_t const* payload = _hc_decode(out, hlen, in, end);
+    if (!payload || result->len < hlen + (end - payload))
+        return false;
+
+    unsigned payload_len = end - payload;
+    memcpy(out + hlen, payload, payload_len);
+    result->len = hlen + payload_len;
+
+    // lengths and the ip checksum are never transmitted
+    _hc_put16(out + IP_LEN_OFFSET, result->len);
+    if (out[IP_PROTO_OFFSET] == IPPROTO_UDP)
+        _hc_put16(out + IP_HLEN + UDP_LEN_OFFSET, result->len - IP_HLEN);
+    _hc_put16(out + IP_CHECK_OFFSET, 0);
+    _hc_put16(out + IP_CHECK_OFFSET, _hc_ip_checksum(out));
+    return true;
+}
@@ -0,0 +1,63 @@
+/**
+ * IPv4/TCP/UDP header compression in the spirit of Van Jacobson (RFC 1144).
+ *
+ * Both ends keep a table of contexts, one per flow. The compressor sends the
+ * full packet once to (re)initialise a context and then only the fields that
+ * changed with respect to that reference header. Deltas are always computed
+ * against the last full header rather than the previous packet, so losing a
+ * compressed packet never corrupts the following ones.
+ *
+ * The first nibble of every frame tells the receiver what it is getting:
+ * 4 and 6 are plain ip packets, the HC_TYPE_* values below are ours.
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef HEADERCOMP_H
+#define HEADERCOMP_H
+
+#include "structs.h"
+
+/// number of flows that can be compressed at the same time
+#define HC_CONTEXTS 16
+
+/// every so many packets a flow sends its full header again, this bounds
+/// the damage done by a lost context refresh
+#define HC_REFRESH_INTERVAL 16
+
+/// how many packets in a row carry the full header after a refresh
+#define HC_FULL_REPEAT 2
+
+/// frame types, stored in the upper nibble of the first byte
+#define HC_TYPE_REFRESH    0x8
+#define HC_TYPE_COMPRESSED 0x9
+
+/// a frame is at most that much bigger than its packet: type, context and the changed fields of a refresh
+#define HC_MAX_GROWTH (2 + 1 + 5 * 3 + 2 + 1 + 2)
+
+/**
+ * Initializes (or resets) all compression and decompression contexts.
+ */
+void init_header_compression(void);
+
+/**
+ * Compress the ip/tcp/udp headers of the packet given into result.
+ * Packets that cannot be compressed are copied unchanged.
+ *
+ * @param data ip packet as read from the tun device
+ * @param result where to write data, len must hold the available space
+ *
+ * @return true on success
+ */
+bool header_compress(const payload_t data, payload_t *result);
+
+/**
+ * Restore the original ip packet from a frame produced by header_compress.
+ *
+ * @param data frame to decompress
+ * @param result where to write data, len must hold the available space
+ *
+ * @return false if the frame refers to an unknown or outdated context and must be dropped
+ */
+bool header_decompress(const payload_t data, payload_t *result);
+
+#endif /* HEADERCOMP_H */
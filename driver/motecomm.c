@@ -39,6 +39,7 @@ void _serialif_t_read(serialif_t* this, payload_t* const payload);
 void _serialif_t_dtor(serialif_t* this);
 void _serialif_t_ditch(serialif_t* this, payload_t* const payload);
 int _serialif_t_fd(serialif_t* this);
+bool _serialif_t_pending(serialif_t* this);
 void _serialif_t_open(serialif_t* this, char const* dev, char* const platform, serial_source_msg* ssm);
 
 // rest of these is in serialif.c or serialforwardif.c
@@ -52,7 +53,9 @@ serialif_t* serialif(serialif_t* this, char const* const dev, char* const platfo
     this->read = _serialif_t_read;
     this->ditch = _serialif_t_ditch;
     this->fd = _serialif_t_fd;
+    this->pending = _serialif_t_pending;
     this->source = 0;
+    this->pool = NULL;
     _serialif_t_open(this,dev,platform,ssm);
     if (!this->source) { // there was a problem
         DTOR(this);
@@ -67,6 +70,7 @@ void _serialforwardif_t_read(serialif_t* this, payload_t* const payload);
 void _serialforwardif_t_dtor(serialif_t* this);
 void _serialforwardif_t_ditch(serialif_t* this, payload_t* const payload);
 int _serialforwardif_t_fd(serialif_t* this);
+bool _serialforwardif_t_pending(serialif_t* this);
 void _serialforwardif_t_open(serialif_t* this, char const* dev, char* const platform, serial_source_msg* ssm);
 
 // serialforwardif_t constructor
@@ -78,7 +82,9 @@ serialif_t* serialforwardif(serialif_t* this, char const* const host, char* cons
     this->read = _serialforwardif_t_read;
     this->ditch = _serialforwardif_t_ditch;
     this->fd = _serialforwardif_t_fd;
+    this->pending = _serialforwardif_t_pending;
     this->source = 0;
+    this->pool = NULL;
     _serialforwardif_t_open(this,host,port,0);
     if (!this->source) { // there was a problem
         DTOR(this);
@@ -93,6 +99,7 @@ void _serialfakeif_t_read(serialif_t* this, payload_t* const payload);
 void _serialfakeif_t_dtor(serialif_t* this);
 void _serialfakeif_t_ditch(serialif_t* this, payload_t* const payload);
 int _serialfakeif_t_fd(serialif_t* this);
+bool _serialfakeif_t_pending(serialif_t* this);
 void _serialfakeif_t_open(serialif_t* this, char const* dev, char* const platform, serial_source_msg* ssm);
 
 // serialforwardif_t constructor
@@ -102,7 +109,9 @@ serialif_t* serialfakeif(serialif_t* this) {
     this->read = _serialfakeif_t_read;
     this->ditch = _serialfakeif_t_ditch;
     this->fd = _serialfakeif_t_fd;
+    this->pending = _serialfakeif_t_pending;
     this->source = 0;
+    this->pool = NULL;
     _serialfakeif_t_open(this,0,0,0);
     if (!this->source) {
         DTOR(this);
@@ -134,11 +143,15 @@ void _motecomm_t_read(motecomm_t* this) {
     payload_t payload = {.stream = NULL, .len = 0}; 
     assert(this);
     assert(this->motecomm_handler.receive);
-    this->serialif.read(&(this->serialif), &payload);
-    if (payload.stream) {
-        this->motecomm_handler.receive(&(this->motecomm_handler),payload);
-    }
-    this->serialif.ditch(&(this->serialif),&payload);
+    serialif_t* sif = &(this->serialif);
+    // a single read from the fd may have brought several frames
+    do {
+        sif->read(sif, &payload);
+        if (payload.stream) {
+            this->motecomm_handler.receive(&(this->motecomm_handler),payload);
+        }
+        sif->ditch(sif,&payload);
+    } while (sif->pending && sif->pending(sif));
 }
 
 /**
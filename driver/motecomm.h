@@ -63,6 +63,18 @@ typedef char time_t;
 #define READ_NON_BLOCKING 0
 #endif
 
+// if set to 1, the serial interface is read by a thread of its own (see reader.h)
+// and the main loop only gets complete frames.
+#ifndef SERIAL_READER_THREAD
+#define SERIAL_READER_THREAD 0
+#endif
+
+// with the reader thread, how long a read on a serial device waits for data
+// before checking for frames received while sending
+#ifndef SERIAL_READER_POLL_MS
+#define SERIAL_READER_POLL_MS 10
+#endif
+
 /****************************************************************
  *  util                                                        *
  ****************************************************************/
@@ -71,6 +83,7 @@ typedef char time_t;
 
 forward(mcp_t);
 forward(serialif_t);
+forward(pool_t);
 
 // wrapper build up a default mcp connection, you can do it on your own if you want to - in tos, you have to
 forward(mcp_t)* open_mcp_connection(char const* const dev, char* const platform, forward(serialif_t)** sif);
@@ -85,6 +98,8 @@ forward(mcp_t)* open_mcp_connection(char const* const dev, char* const platform,
               class (serialif_t,
                      serial_source source;
                      serial_source_msg msg;
+                     // recycled receive buffers, if the implementation uses them
+                     forward(pool_t)* pool;
                      // send a datastream over the serial
                      int (*send)(serialif_t* this, payload_t const payload);
                      // initiate a read operation (will block if READ_NON_BLOCKING if 0)
@@ -94,6 +109,8 @@ forward(mcp_t)* open_mcp_connection(char const* const dev, char* const platform,
                      void (*ditch)(serialif_t* this, payload_t* const payload);
                      // return the used file descriptor (if any) -- deprecated
                      int (*fd)(serialif_t* this);
+                     // true if read can return a frame without waiting for the fd (may be NULL)
+                     bool (*pending)(serialif_t* this);
                   );
 
 /**
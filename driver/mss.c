@@ -0,0 +1,123 @@
+/**
+ * MSS clamping, see mss.h
+ *
+ */
+#include "util.h"
+#include "mss.h"
+
+#define IPPROTO_TCP_NO 6
+
+#define TCP_SYN 0x02
+
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_MSS_LEN 4
+
+/// the ipv6 header is 20 bytes longer than the ipv4 one
+#define MSS_IPV6_EXTRA 20
+
+unsigned mss_mtu(void) {
+#if TUN_MSS == MSS_CHUNK_ALIGNED
+    return ((MSS_MAX_MTU + MSS_FRAME_GROWTH) / MAX_CARRIED) * MAX_CARRIED - MSS_FRAME_GROWTH;
+#elif TUN_MSS > 0
+    return TUN_MSS + MSS_HEADERS;
+#else
+    return 0;
+#endif
+}
+
+unsigned mss_value(void) {
+    unsigned mtu = mss_mtu();
+    return mtu ? mtu - MSS_HEADERS : 0;
+}
+
+uint16_t _mss_get16(stream_t const* p) {
+    return (p[0] << 8) | p[1];
+}
+
+/**
+ * @return the checksum of the tcp segment, with the pseudo header of its ip packet
+ */
+uint16_t _mss_checksum(stream_t const* packet, unsigned transport, unsigned end) {
+    uint32_t sum = IPPROTO_TCP_NO + (end - transport);
+    // the addresses, source and destination next to each other
+    bool v4 = (packet[0] >> 4) == 4;
+    for (unsigned i = v4 ? 12 : 8; i < (v4 ? 20u : 40u); i += 2) {
+        sum += _mss_get16(packet + i);
+    }
+    for (unsigned i = transport; i < end; i += 2) {
+        sum += (i + 1 < end) ? _mss_get16(packet + i) : (packet[i] << 8);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return ~sum & 0xFFFF;
+}
+
+bool mss_clamp(stream_t* packet, streamlen_t len) {
+    unsigned mss = mss_value();
+    unsigned transport, end;
+    if (!mss || len < 20) {
+        return false;
+    }
+    switch (packet[0] >> 4) {
+    case 4:
+        // fragments are left alone
+        if (packet[9] != IPPROTO_TCP_NO || (packet[6] & 0x3F) || packet[7]) {
+            return false;
+        }
+        transport = (packet[0] & 0x0F) * 4;
+        end = _mss_get16(packet + 2);
+        break;
+    case 6:
+        // so are extension headers, a SYN hardly ever has any
+        if (len < 40 || packet[6] != IPPROTO_TCP_NO) {
+            return false;
+        }
+        transport = 40;
+        end = 40 + _mss_get16(packet + 4);
+        mss -= MSS_IPV6_EXTRA;
+        break;
+    default:
+        return false;
+    }
+    if (end > len || end < transport + 20) {
+        return false;
+    }
+    stream_t* tcp = packet + transport;
+    unsigned header = (tcp[12] >> 4) * 4;
+    if (!(tcp[13] & TCP_SYN) || header < 20 || transport + header > end) {
+        return false;
+    }
+    for (unsigned o = 20; o < header; ) {
+        unsigned kind = tcp[o];
+        if (kind == TCP_OPT_END) {
+            break;
+        }
+        if (kind == TCP_OPT_NOP) {
+            o++;
+            continue;
+        }
+        unsigned opt_len = (o + 1 < header) ? tcp[o + 1] : 0;
+        if (opt_len < 2 || o + opt_len > header) {
+            return false;
+        }
+        if (kind == TCP_OPT_MSS && opt_len == TCP_OPT_MSS_LEN) {
+            if (_mss_get16(tcp + o + 2) <= mss) {
+                return false;
+            }
+            LOG_DEBUG("clamping the MSS of a SYN from %u to %u", _mss_get16(tcp + o + 2), mss);
+            tcp[o + 2] = mss >> 8;
+            tcp[o + 3] = mss & 0xFF;
+            // the option may sit at an odd offset, the checksum is computed again
+            tcp[16] = tcp[17] = 0;
+            uint16_t sum = _mss_checksum(packet, transport, end);
+            tcp[16] = sum >> 8;
+            tcp[17] = sum & 0xFF;
+            return true;
+        }
+        o += opt_len;
+    }
+    return false;
+}
@@ -0,0 +1,62 @@
+/**
+ * TCP MSS clamping on the packets going through the tun.
+ *
+ * A 1500 bytes packet takes 16 chunks, the last one almost empty, and the
+ * loss of any of them loses the whole packet. The MSS option of the tcp SYNs
+ * read from and written to the tun is therefore lowered, so that the
+ * connections through the tunnel send packets that fill whole chunks, and
+ * the tun gets the MTU of such packets.
+ *
+ * TUN_MSS gives the MSS of ipv4 (ipv6 gets 20 bytes less), 0 disables
+ * the clamping and MSS_CHUNK_ALIGNED picks the biggest packets up to
+ * MSS_MAX_MTU whose frames fill a whole number of chunks. A frame is the
+ * packet as it is chunked, with the header compression it can be up to
+ * MSS_FRAME_GROWTH bytes bigger.
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef MSS_H
+#define MSS_H
+
+#include "structs.h"
+
+#define MSS_CHUNK_ALIGNED -1
+
+#ifndef TUN_MSS
+#define TUN_MSS MSS_CHUNK_ALIGNED
+#endif
+
+/// the packets are never bigger than that
+#define MSS_MAX_MTU 1500
+
+/// ipv4 and tcp headers without options
+#define MSS_HEADERS 40
+
+#if HEADER_COMPRESSION_ENABLED
+#include "headercomp.h"
+#define MSS_FRAME_GROWTH HC_MAX_GROWTH
+#else
+#define MSS_FRAME_GROWTH 0
+#endif
+
+/**
+ * @return the MTU of the tun, 0 to leave it as it is
+ */
+unsigned mss_mtu(void);
+
+/**
+ * @return the MSS of ipv4 written into the SYNs, 0 if they are left alone
+ */
+unsigned mss_value(void);
+
+/**
+ * Lower the MSS option of a tcp SYN, fixing its checksum.
+ *
+ * @param packet an ip packet, changed in place
+ * @param len its length
+ *
+ * @return true if the packet was changed
+ */
+bool mss_clamp(stream_t* packet, streamlen_t len);
+
+#endif /* MSS_H */
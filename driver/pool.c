@@ -0,0 +1,74 @@
+#include "pool.h"
+
+#include <stdlib.h>
+
+/**
+ * Implementation of pool_t::get.
+ *
+ * @return a free slab, or a malloced buffer if the pool is exhausted
+ */
+stream_t* _pool_t_get(pool_t* this) {
+    assert(this);
+    stream_t* buf = NULL;
+    pthread_mutex_lock(&this->lock);
+    if (this->free_count) {
+        buf = this->free_slabs[--this->free_count];
+    }
+    pthread_mutex_unlock(&this->lock);
+    if (!buf) {
+        LOG_DEBUG("buffer pool exhausted, allocating");
+        buf = malloc(this->slab_size);
+    }
+    return buf;
+}
+
+/**
+ * Implementation of pool_t::put.
+ *
+ * @param buf a buffer obtained with pool_t::get
+ */
+void _pool_t_put(pool_t* this, stream_t const* buf) {
+    assert(this);
+    if (!buf) {
+        return;
+    }
+    if (buf < this->slabs || buf >= this->slabs + this->slab_size * this->count) {
+        // was allocated when the pool was empty
+        free((void*)buf);
+        return;
+    }
+    assert((buf - this->slabs) % this->slab_size == 0);
+    pthread_mutex_lock(&this->lock);
+    assert(this->free_count < this->count);
+    this->free_slabs[this->free_count++] = (stream_t*)buf;
+    pthread_mutex_unlock(&this->lock);
+}
+
+/**
+ * Custom destructor for pool_t, all the buffers must have been given back.
+ */
+void _pool_t_dtor(pool_t* this) {
+    assert(this);
+    assert(this->free_count == this->count);
+    free(this->slabs);
+    free(this->free_slabs);
+    pthread_mutex_destroy(&this->lock);
+}
+
+pool_t* pool(pool_t* this, unsigned slab_size, unsigned count) {
+    assert(slab_size && count);
+    SETDTOR(CTOR(this)) _pool_t_dtor;
+    this->slab_size = slab_size;
+    this->count = count;
+    this->slabs = malloc(slab_size * count);
+    this->free_slabs = malloc(sizeof(stream_t*) * count);
+    assert(this->slabs && this->free_slabs);
+    for (unsigned i = 0; i < count; i++) {
+        this->free_slabs[i] = this->slabs + i * slab_size;
+    }
+    this->free_count = count;
+    pthread_mutex_init(&this->lock, NULL);
+    this->get = _pool_t_get;
+    this->put = _pool_t_put;
+    return this;
+}
@@ -0,0 +1,35 @@
+/**
+ * Pool of fixed size buffers, to avoid a malloc/free pair for every packet.
+ * @author Oscar Dustmann
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include "util.h"
+
+/// a pool hands out slabs of slab_size bytes, if it is empty get falls back to malloc
+/// buffers can be given back from any thread
+class (pool_t,
+       stream_t* slabs;
+       // stack of the free slabs
+       stream_t** free_slabs;
+       unsigned free_count;
+       unsigned slab_size;
+       unsigned count;
+       pthread_mutex_t lock;
+       // get a buffer of at least slab_size bytes
+       stream_t* (*get)(pool_t* this);
+       // give a buffer back, as it was returned by get
+       void (*put)(pool_t* this, stream_t const* buf);
+    );
+
+/**
+ * Create a new pool_t object.
+ *
+ * @param slab_size size of every buffer
+ * @param count how many buffers are preallocated
+ */
+pool_t* pool(pool_t* this, unsigned slab_size, unsigned count);
+
+#endif
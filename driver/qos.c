@@ -0,0 +1,688 @@
+/**
+ * Priority queues, see qos.h
+ *
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "util.h"
+#include "pool.h"
+#include "flow.h"
+#include "qos.h"
+
+#define IPPROTO_ICMP_NO 1
+#define IPPROTO_TCP_NO 6
+#define IPPROTO_UDP_NO 17
+#define IPPROTO_ICMPV6_NO 58
+
+#define DNS_PORT 53
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_ACK 0x10
+#define TCP_URG 0x20
+#define TCP_ECE 0x40
+#define TCP_CWR 0x80
+
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_SACK 5
+#define TCP_OPT_TIMESTAMP 8
+
+/// sack blocks that fit in the options
+#define TCP_MAX_SACKS 4
+
+/// no packet, no flow
+#define NONE (-1)
+
+typedef struct {
+    stream_t* buf;
+    streamlen_t len;
+    // when it was queued, in ms
+    unsigned long enqueued;
+    // the next packet of the same flow, or of the free list
+    int next;
+} packet_t;
+
+typedef struct {
+    flow_key_t key;
+    // packets waiting, oldest first
+    int head, tail;
+    unsigned count;
+    // what the flow may still send in this round, in chunks
+    int deficit;
+    // the next flow of the round
+    int next;
+    // codel: when the delay went above the target, 0 if it is below
+    unsigned long first_above;
+    // codel: dropping since the delay stayed above the target for an interval
+    bool dropping;
+    unsigned long drop_next;
+    unsigned drops, last_drops;
+} qos_flow_t;
+
+typedef struct {
+    qos_flow_t flows[QOS_FLOWS];
+    // flows with packets waiting, served in turn
+    int first, last;
+    unsigned count;
+    // times the class was passed over while not empty
+    unsigned skipped;
+    // packets dropped because the class was full
+    unsigned long dropped;
+    // packets sent, and dropped because they waited too long
+    unsigned long sent, late;
+    // pure acks dropped because a newer one was queued
+    unsigned long acks_filtered;
+    // how long the packets waited, average and worst
+    double delay_ms;
+    unsigned long max_delay_ms;
+} queue_t;
+
+static packet_t packets[QOS_CLASSES * QOS_QUEUE_LEN];
+static int free_packets;
+static queue_t queues[QOS_CLASSES];
+static pool_t* buffers = NULL;
+static unsigned codel_target_ms = QOS_CODEL_TARGET_MS;
+static unsigned codel_interval_ms = QOS_CODEL_INTERVAL_MS;
+
+void init_qos(void) {
+    if (!buffers) {
+        buffers = pool(NULL, QOS_SLAB_SIZE, QOS_CLASSES * QOS_QUEUE_LEN);
+    }
+    for (unsigned c = 0; c < QOS_CLASSES; c++) {
+        for (unsigned f = 0; f < QOS_FLOWS; f++) {
+            qos_flow_t* flow = &queues[c].flows[f];
+            for (unsigned i = 0; i < flow->count; i++) {
+                buffers->put(buffers, packets[flow->head].buf);
+                flow->head = packets[flow->head].next;
+            }
+        }
+    }
+    memset(queues, 0, sizeof(queues));
+    for (unsigned i = 0; i < QOS_CLASSES * QOS_QUEUE_LEN; i++) {
+        packets[i].next = (i + 1 < QOS_CLASSES * QOS_QUEUE_LEN) ? (int)i + 1 : NONE;
+    }
+    free_packets = 0;
+    for (unsigned c = 0; c < QOS_CLASSES; c++) {
+        queues[c].first = queues[c].last = NONE;
+    }
+}
+
+void qos_codel_params(unsigned target_ms, unsigned interval_ms) {
+    assert(target_ms && target_ms < interval_ms);
+    codel_target_ms = target_ms;
+    codel_interval_ms = interval_ms;
+}
+
+unsigned long _qos_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ul + now.tv_nsec / 1000000;
+}
+
+unsigned long _qos_isqrt(unsigned long x) {
+    unsigned long r = x, y = (x + 1) / 2;
+    while (y < r) {
+        r = y;
+        y = (r + x / r) / 2;
+    }
+    return r;
+}
+
+/**
+ * @return when to drop the next packet, the more were dropped the sooner
+ */
+unsigned long _qos_control_law(unsigned long t, unsigned drops) {
+    return t + codel_interval_ms * 1000ul / _qos_isqrt(drops * 1000000ul);
+}
+
+/**
+ * @return the cost of a packet for the round robin
+ */
+static inline int _qos_chunks(streamlen_t len) {
+    return (len + MAX_CARRIED - 1) / MAX_CARRIED;
+}
+
+/**
+ * Find the queue of a flow. A flow that is not there takes a free slot near
+ * its hash, with no free slot it shares the queue of another flow.
+ *
+ * @return the index of the flow in the table of the class
+ */
+int _qos_find_flow(queue_t* queue, flow_key_t const* key) {
+    unsigned start = flow_hash(key) % QOS_FLOWS;
+    int unused = NONE;
+    for (unsigned way = 0; way < QOS_FLOW_WAYS; way++) {
+        unsigned f = (start + way) % QOS_FLOWS;
+        if (!queue->flows[f].count) {
+            if (unused == NONE) {
+                unused = f;
+            }
+        } else if (flow_key_equals(&queue->flows[f].key, key)) {
+            return f;
+        }
+    }
+    if (unused == NONE) {
+        LOG_DEBUG("no room for the flow, sharing slot %u", start);
+        return start;
+    }
+    qos_flow_t* flow = &queue->flows[unused];
+    flow->key = *key;
+    flow->head = flow->tail = NONE;
+    flow->deficit = 0;
+    flow->first_above = 0;
+    flow->dropping = false;
+    flow->drops = flow->last_drops = 0;
+    return unused;
+}
+
+/**
+ * Take the oldest packet of a flow out, the flow stays in the round.
+ */
+packet_t* _qos_pop(queue_t* queue, qos_flow_t* flow) {
+    packet_t* packet = &packets[flow->head];
+    flow->head = packet->next;
+    if (--flow->count == 0) {
+        flow->tail = NONE;
+    }
+    queue->count--;
+    return packet;
+}
+
+/**
+ * Give the packet and its buffer back.
+ */
+void _qos_free(packet_t* packet) {
+    buffers->put(buffers, packet->buf);
+    packet->next = free_packets;
+    free_packets = packet - packets;
+}
+
+/**
+ * Make room in a full class, dropping the oldest packet of its longest flow.
+ */
+void _qos_drop(queue_t* queue) {
+    qos_flow_t* fattest = NULL;
+    for (int f = queue->first; f != NONE; f = queue->flows[f].next) {
+        if (!fattest || queue->flows[f].count > fattest->count) {
+            fattest = &queue->flows[f];
+        }
+    }
+    // there are less flows than packets, so it keeps one and its place in the round
+    assert(fattest && fattest->count > 1);
+    _qos_free(_qos_pop(queue, fattest));
+    if (!(queue->dropped++ % QOS_QUEUE_LEN)) {
+        LOG_WARNING("queue of class %u full, %lu packets dropped so far", (unsigned)(queue - queues), queue->dropped);
+    }
+}
+
+/**
+ * @return the class asked for by the DSCP, QOS_CLASSES if it does not tell
+ */
+qos_class_t _qos_dscp_class(unsigned dscp) {
+    switch (dscp) {
+    case 46:    // EF
+    case 40:    // CS5
+    case 48:    // CS6
+    case 56:    // CS7
+    case 34:    // AF41
+    case 36:    // AF42
+    case 38:    // AF43
+        return QOS_INTERACTIVE;
+    case 8:     // CS1
+        return QOS_BULK;
+    default:
+        return QOS_CLASSES;
+    }
+}
+
+qos_class_t qos_classify(payload_t const packet) {
+    stream_t const* p = packet.stream;
+    unsigned dscp, proto, transport, end;
+
+    switch (p[0] >> 4) {
+    case 4:
+        dscp = p[1] >> 2;
+        proto = p[9];
+        transport = (p[0] & 0x0F) * 4;
+        end = (p[2] << 8) | p[3];
+        // only the first fragment carries the ports
+        if ((p[6] & 0x1F) || p[7]) {
+            transport = packet.len;
+        }
+        break;
+    case 6:
+        dscp = (((p[0] & 0x0F) << 4) | (p[1] >> 4)) >> 2;
+        proto = p[6];
+        transport = 40;
+        end = 40 + ((p[4] << 8) | p[5]);
+        break;
+    default:
+        return (packet.len <= QOS_SMALL_PACKET) ? QOS_INTERACTIVE : QOS_NORMAL;
+    }
+    if (end > packet.len) {
+        end = packet.len;
+    }
+    // the short last segment of a tcp transfer must not overtake the ones before it
+    if (proto != IPPROTO_TCP_NO && packet.len <= QOS_SMALL_PACKET) {
+        return QOS_INTERACTIVE;
+    }
+
+    qos_class_t asked = _qos_dscp_class(dscp);
+    if (asked != QOS_CLASSES) {
+        return asked;
+    }
+    if (proto == IPPROTO_ICMP_NO || proto == IPPROTO_ICMPV6_NO) {
+        return QOS_INTERACTIVE;
+    }
+    if ((proto == IPPROTO_TCP_NO || proto == IPPROTO_UDP_NO) && end >= transport + 4) {
+        unsigned sport = (p[transport] << 8) | p[transport + 1];
+        unsigned dport = (p[transport + 2] << 8) | p[transport + 3];
+        if (sport == DNS_PORT || dport == DNS_PORT) {
+            return QOS_INTERACTIVE;
+        }
+    }
+    if (proto == IPPROTO_TCP_NO && end >= transport + 20) {
+        // an ack with options, the data offset is all there is
+        unsigned header = (p[transport + 12] >> 4) * 4;
+        if (transport + header == end && !(p[transport + 13] & (TCP_FIN | TCP_SYN | TCP_RST))) {
+            return QOS_INTERACTIVE;
+        }
+    }
+    return QOS_NORMAL;
+}
+
+/**
+ * Take the oldest packet of a flow out and tell whether it waited too long
+ * for too long, as dodequeue in RFC 8289.
+ */
+packet_t* _qos_codel_pop(queue_t* queue, qos_flow_t* flow, unsigned long now, bool* ok_to_drop) {
+    packet_t* packet = _qos_pop(queue, flow);
+    *ok_to_drop = false;
+    // the last packet of a flow is no standing queue
+    if (now - packet->enqueued < codel_target_ms || !flow->count) {
+        flow->first_above = 0;
+    } else if (!flow->first_above) {
+        flow->first_above = now + codel_interval_ms;
+    } else if (now >= flow->first_above) {
+        *ok_to_drop = true;
+    }
+    return packet;
+}
+
+/**
+ * Drop a packet that waited too long.
+ */
+void _qos_drop_late(queue_t* queue, packet_t* packet, unsigned long now) {
+    LOG_DEBUG("dropping a packet of class %u, it waited %lu ms", (unsigned)(queue - queues), now - packet->enqueued);
+    queue->late++;
+    _qos_free(packet);
+}
+
+/**
+ * CoDel on the queue of a flow, as dequeue in RFC 8289.
+ *
+ * @return the next packet of the flow to send, NULL if all of them were dropped
+ */
+packet_t* _qos_codel(queue_t* queue, qos_flow_t* flow, unsigned long now) {
+    bool ok_to_drop;
+    packet_t* packet = _qos_codel_pop(queue, flow, now, &ok_to_drop);
+    if (flow->dropping) {
+        if (!ok_to_drop) {
+            flow->dropping = false;
+        }
+        while (flow->dropping && now >= flow->drop_next) {
+            _qos_drop_late(queue, packet, now);
+            flow->drops++;
+            if (!flow->count) {
+                flow->dropping = false;
+                return NULL;
+            }
+            packet = _qos_codel_pop(queue, flow, now, &ok_to_drop);
+            if (!ok_to_drop) {
+                flow->dropping = false;
+            } else {
+                flow->drop_next = _qos_control_law(flow->drop_next, flow->drops);
+            }
+        }
+    } else if (ok_to_drop) {
+        _qos_drop_late(queue, packet, now);
+        flow->dropping = true;
+        // start where the last dropping state left, if it was not long ago
+        unsigned delta = flow->drops - flow->last_drops;
+        flow->drops = (delta > 1 && (long)(now - flow->drop_next) < 16l * codel_interval_ms) ? delta : 1;
+        flow->drop_next = _qos_control_law(now, flow->drops);
+        flow->last_drops = flow->drops;
+        if (!flow->count) {
+            return NULL;
+        }
+        packet = _qos_codel_pop(queue, flow, now, &ok_to_drop);
+    }
+    return packet;
+}
+
+/**
+ * What the ack filter needs to know of a pure tcp ack.
+ */
+typedef struct {
+    flow_key_t key;
+    uint32_t ack;
+    uint8_t flags;
+    unsigned sacks;
+    uint32_t sack[TCP_MAX_SACKS][2];
+    // options that could matter, such an ack is kept
+    bool other_options;
+} tcp_ack_t;
+
+static inline uint32_t _qos_get32(stream_t const* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/// a is before b in sequence space
+static inline bool _qos_seq_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+/**
+ * @param packet an ip packet
+ * @param ack where to store the fields of the ack
+ *
+ * @return true if the packet is a tcp ack without data or any flag but ECE or CWR
+ */
+bool _qos_parse_ack(payload_t const packet, tcp_ack_t* ack) {
+    stream_t const* p = packet.stream;
+    unsigned transport, end;
+    if (!flow_parse(packet, &ack->key) || ack->key.proto != IPPROTO_TCP_NO) {
+        return false;
+    }
+    if ((p[0] >> 4) == 4) {
+        if ((p[6] & 0x1F) || p[7] || (p[6] & 0x20)) {
+            // fragments are left alone
+            return false;
+        }
+        transport = (p[0] & 0x0F) * 4;
+        end = (p[2] << 8) | p[3];
+    } else {
+        transport = 40;
+        end = 40 + ((p[4] << 8) | p[5]);
+    }
+    if (end > packet.len || end < transport + 20) {
+        return false;
+    }
+    stream_t const* tcp = p + transport;
+    unsigned header = (tcp[12] >> 4) * 4;
+    ack->flags = tcp[13];
+    if (header < 20 || transport + header != end
+        || (ack->flags & (TCP_FIN | TCP_SYN | TCP_RST | TCP_URG | TCP_ACK)) != TCP_ACK) {
+        return false;
+    }
+    ack->ack = _qos_get32(tcp + 8);
+    ack->sacks = 0;
+    ack->other_options = false;
+    for (unsigned o = 20; o < header; ) {
+        unsigned kind = tcp[o];
+        if (kind == TCP_OPT_END) {
+            break;
+        }
+        if (kind == TCP_OPT_NOP) {
+            o++;
+            continue;
+        }
+        unsigned len = (o + 1 < header) ? tcp[o + 1] : 0;
+        if (len < 2 || o + len > header) {
+            ack->other_options = true;
+            break;
+        }
+        if (kind == TCP_OPT_SACK && (len - 2) % 8 == 0 && (len - 2) / 8 <= TCP_MAX_SACKS) {
+            for (unsigned b = 0; b < (len - 2) / 8; b++) {
+                ack->sack[ack->sacks][0] = _qos_get32(tcp + o + 2 + 8 * b);
+                ack->sack[ack->sacks][1] = _qos_get32(tcp + o + 6 + 8 * b);
+                ack->sacks++;
+            }
+        } else if (kind != TCP_OPT_TIMESTAMP) {
+            ack->other_options = true;
+        }
+        o += len;
+    }
+    return true;
+}
+
+/**
+ * @return true if the older ack tells nothing the newer one does not
+ */
+bool _qos_ack_redundant(tcp_ack_t const* older, tcp_ack_t const* newer) {
+    // the same ack number again is a duplicate ack or a window update, they matter
+    if (!flow_key_equals(&older->key, &newer->key) || older->other_options
+        || !_qos_seq_before(older->ack, newer->ack)
+        || (older->flags & (TCP_ECE | TCP_CWR) & ~newer->flags)) {
+        return false;
+    }
+    for (unsigned i = 0; i < older->sacks; i++) {
+        bool covered = !_qos_seq_before(newer->ack, older->sack[i][1]);
+        for (unsigned j = 0; j < newer->sacks && !covered; j++) {
+            covered = !_qos_seq_before(older->sack[i][0], newer->sack[j][0])
+                && !_qos_seq_before(newer->sack[j][1], older->sack[i][1]);
+        }
+        if (!covered) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Drop the acks of a flow made useless by a newer one.
+ *
+ * @param newer the ack about to be queued
+ */
+void _qos_filter_acks(queue_t* queue, qos_flow_t* flow, tcp_ack_t const* newer) {
+    int prev = NONE;
+    for (int i = flow->head; i != NONE; ) {
+        int next = packets[i].next;
+        tcp_ack_t older;
+        payload_t queued = {.stream = packets[i].buf, .len = packets[i].len};
+        if (_qos_parse_ack(queued, &older) && _qos_ack_redundant(&older, newer)) {
+            if (prev == NONE) {
+                flow->head = next;
+            } else {
+                packets[prev].next = next;
+            }
+            if (flow->tail == i) {
+                flow->tail = prev;
+            }
+            flow->count--;
+            queue->count--;
+            queue->acks_filtered++;
+            _qos_free(&packets[i]);
+        } else {
+            prev = i;
+        }
+        i = next;
+    }
+}
+
+bool qos_enqueue(payload_t const packet) {
+    assert(buffers);
+    qos_class_t class = qos_classify(packet);
+    queue_t* queue = &queues[class];
+    flow_key_t key;
+    flow_parse(packet, &key);
+    int f = _qos_find_flow(queue, &key);
+    qos_flow_t* flow = &queue->flows[f];
+    // in the round even if the ack filter empties it
+    bool in_round = flow->count != 0;
+
+#if QOS_ACK_FILTER
+    tcp_ack_t ack;
+    if (in_round && _qos_parse_ack(packet, &ack)) {
+        _qos_filter_acks(queue, flow, &ack);
+    }
+#endif
+
+    bool dropped = false;
+    if (queue->count == QOS_QUEUE_LEN) {
+        if (flow->count == queue->count) {
+            // alone in its class, the newest packet goes
+            if (!(queue->dropped++ % QOS_QUEUE_LEN)) {
+                LOG_WARNING("queue of class %u full, %lu packets dropped so far", (unsigned)class, queue->dropped);
+            }
+            return false;
+        }
+        _qos_drop(queue);
+        dropped = true;
+    }
+
+    int i = free_packets;
+    assert(i != NONE);
+    free_packets = packets[i].next;
+    packets[i].buf = (packet.len <= QOS_SLAB_SIZE) ? buffers->get(buffers) : malloc(packet.len);
+    assert(packets[i].buf);
+    memcpy(packets[i].buf, packet.stream, packet.len);
+    packets[i].len = packet.len;
+    packets[i].enqueued = _qos_now_ms();
+    packets[i].next = NONE;
+
+    if (flow->count++) {
+        packets[flow->tail].next = i;
+    } else {
+        flow->head = i;
+    }
+    if (!in_round) {
+        // a new flow joins the round at its end
+        flow->next = NONE;
+        if (queue->last == NONE) {
+            queue->first = f;
+        } else {
+            queue->flows[queue->last].next = f;
+        }
+        queue->last = f;
+    }
+    flow->tail = i;
+    queue->count++;
+    LOG_DEBUG("packet of %u bytes queued in class %u, flow %d", (unsigned)packet.len, (unsigned)class, f);
+    return !dropped;
+}
+
+/**
+ * Deficit round robin among the flows of a class.
+ *
+ * @return the next packet of the class, NULL if the ones left waited too long
+ */
+packet_t* _qos_next(queue_t* queue, unsigned long now) {
+    while (queue->count) {
+        int f = queue->first;
+        qos_flow_t* flow = &queue->flows[f];
+        if (flow->deficit >= _qos_chunks(packets[flow->head].len)) {
+            packet_t* packet = _qos_codel(queue, flow, now);
+            if (!flow->count) {
+                // gone from the round, it does not keep what it did not use
+                flow->deficit = 0;
+                queue->first = flow->next;
+                if (queue->first == NONE) {
+                    queue->last = NONE;
+                }
+            }
+            if (!packet) {
+                continue;
+            }
+            flow->deficit -= _qos_chunks(packet->len);
+            return packet;
+        }
+        // its turn is over, the next one gets a quantum more
+        flow->deficit += QOS_QUANTUM_CHUNKS;
+        if (flow->next != NONE) {
+            queue->first = flow->next;
+            queue->flows[queue->last].next = f;
+            queue->last = f;
+            flow->next = NONE;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return the class to take the next packet from, NULL if all are empty
+ */
+queue_t* _qos_choose(void) {
+    queue_t* chosen = NULL;
+    // a class passed over too often comes first, then the highest one
+    for (unsigned c = 0; c < QOS_CLASSES && !chosen; c++) {
+        if (queues[c].count && queues[c].skipped >= QOS_MAX_SKIPS) {
+            chosen = &queues[c];
+        }
+    }
+    for (unsigned c = 0; c < QOS_CLASSES && !chosen; c++) {
+        if (queues[c].count) {
+            chosen = &queues[c];
+        }
+    }
+    return chosen;
+}
+
+bool qos_dequeue(payload_t* packet) {
+    unsigned long now = _qos_now_ms();
+    queue_t* chosen;
+    packet_t* next = NULL;
+    // the packets of a class can all be dropped for waiting too long
+    while (!next && (chosen = _qos_choose())) {
+        next = _qos_next(chosen, now);
+    }
+    if (!next) {
+        return false;
+    }
+    for (queue_t* q = chosen + 1; q < queues + QOS_CLASSES; q++) {
+        if (q->count) {
+            q->skipped++;
+        }
+    }
+    chosen->skipped = 0;
+
+    unsigned long delay = now - next->enqueued;
+    chosen->sent++;
+    chosen->delay_ms = (1 - QOS_DELAY_ALPHA) * chosen->delay_ms + QOS_DELAY_ALPHA * delay;
+    if (delay > chosen->max_delay_ms) {
+        chosen->max_delay_ms = delay;
+    }
+
+    assert(next->len <= packet->len);
+    memcpy((stream_t*)packet->stream, next->buf, next->len);
+    packet->len = next->len;
+    _qos_free(next);
+    return true;
+}
+
+unsigned qos_queued(void) {
+    unsigned count = 0;
+    for (unsigned c = 0; c < QOS_CLASSES; c++) {
+        count += queues[c].count;
+    }
+    return count;
+}
+
+void qos_get_stats(qos_class_t class, qos_stats_t* stats) {
+    assert(class < QOS_CLASSES);
+    queue_t const* queue = &queues[class];
+    *stats = (qos_stats_t){
+        .queued = queue->count,
+        .sent = queue->sent,
+        .dropped_full = queue->dropped,
+        .dropped_late = queue->late,
+        .acks_filtered = queue->acks_filtered,
+        .delay_ms = queue->delay_ms,
+        .max_delay_ms = queue->max_delay_ms
+    };
+}
+
+void qos_print_statistics(void) {
+    static char const* const names[QOS_CLASSES] = {"interactive", "normal", "bulk"};
+    for (unsigned c = 0; c < QOS_CLASSES; c++) {
+        qos_stats_t stats;
+        qos_get_stats(c, &stats);
+        LOG_NOTE("%s: %u queued, %lu sent, %lu dropped full, %lu dropped late, %lu acks filtered, delay %.0f ms (worst %lu ms)",
+                 names[c], stats.queued, stats.sent, stats.dropped_full, stats.dropped_late, stats.acks_filtered,
+                 stats.delay_ms, stats.max_delay_ms);
+    }
+}
@@ -0,0 +1,171 @@
+/**
+ * Priority queues in front of the chunker.
+ *
+ * A 1500 bytes packet takes 16 chunks, so a keystroke or a DNS query read
+ * from the tun right after it would wait for all of them. The packets are
+ * therefore read from the tun as soon as they come and kept here, one queue
+ * per class, and only given to the workers when the pipeline is short
+ * (@see QOS_PIPELINE_DEPTH). The interactive class always goes first, a
+ * lower class is served anyway when it was passed over QOS_MAX_SKIPS times.
+ *
+ * Within a class every flow (the 5-tuple, @see flow.h) has its own queue and
+ * the flows take turns with a deficit round robin counted in chunks, so a
+ * bulk download gets no more of the link than a small transfer next to it.
+ * The table of flows is small, a flow finding no free slot near its hash
+ * shares the queue of another one.
+ *
+ * When a class is full, the oldest packet of its longest flow is dropped.
+ * Before that, the queue of every flow is kept short by CoDel (RFC 8289): a
+ * flow whose packets kept waiting longer than the target for an interval
+ * loses some of them, more often the longer it goes on. The packets are
+ * dropped when they leave the queue, before any work is done on them.
+ *
+ * With QOS_ACK_FILTER, a pure tcp ack also drops the older acks of its flow
+ * still waiting, when it acknowledges more and covers their SACK blocks.
+ * Duplicate acks, acks with ECN flags the new one lacks and acks with
+ * options other than SACK and timestamps are always kept.
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef QOS_H
+#define QOS_H
+
+#include "structs.h"
+
+typedef enum {
+    /// DSCP EF, CS5-CS7, AF4x, ICMP, DNS, pure TCP ACKs and small packets other than tcp data
+    QOS_INTERACTIVE = 0,
+    QOS_NORMAL,
+    /// DSCP CS1, the lower effort traffic
+    QOS_BULK,
+    QOS_CLASSES
+} qos_class_t;
+
+/// packets up to this size are interactive, whatever they are, unless they are tcp segments with data
+#ifndef QOS_SMALL_PACKET
+#define QOS_SMALL_PACKET 128
+#endif
+
+/// packets waiting in every class
+#ifndef QOS_QUEUE_LEN
+#define QOS_QUEUE_LEN 64
+#endif
+
+/// flows with packets waiting in every class
+#ifndef QOS_FLOWS
+#define QOS_FLOWS 32
+#endif
+
+/// slots looked at for a flow before sharing one
+#define QOS_FLOW_WAYS 4
+
+/// what a flow may send in a turn of the round robin, in chunks
+#ifndef QOS_QUANTUM_CHUNKS
+#define QOS_QUANTUM_CHUNKS 4
+#endif
+
+#if QOS_FLOWS >= QOS_QUEUE_LEN
+#error "a full class must have a flow with more than one packet"
+#endif
+
+/// a waiting class is served after the ones above it went first that many times
+#define QOS_MAX_SKIPS 16
+
+/// drop the queued tcp acks a newer one makes useless, the Makefile turns it on
+#ifndef QOS_ACK_FILTER
+#define QOS_ACK_FILTER 0
+#endif
+
+/// codel: the delay a queue should not keep, and for how long it may
+/// the link is slow, a big packet alone takes more than half a second
+#ifndef QOS_CODEL_TARGET_MS
+#define QOS_CODEL_TARGET_MS 1000
+#endif
+#ifndef QOS_CODEL_INTERVAL_MS
+#define QOS_CODEL_INTERVAL_MS 8000
+#endif
+
+/// weight of a new packet in the average delay
+#define QOS_DELAY_ALPHA 0.125
+
+/// frames given to the workers and not sent yet, the rest waits here
+/// one more than two frames of a flow, so a packet of another flow can be sent along with them
+#ifndef QOS_PIPELINE_DEPTH
+#define QOS_PIPELINE_DEPTH 3
+#endif
+
+/// the packets are kept in buffers of this size, bigger ones are allocated
+#define QOS_SLAB_SIZE 2048
+
+/**
+ * What the packets of a class went through.
+ */
+typedef struct {
+    unsigned queued;
+    unsigned long sent;
+    /// the class was full
+    unsigned long dropped_full;
+    /// dropped by codel
+    unsigned long dropped_late;
+    /// dropped by the ack filter
+    unsigned long acks_filtered;
+    /// time spent in the queue by the packets sent, average and worst
+    double delay_ms;
+    unsigned long max_delay_ms;
+} qos_stats_t;
+
+/**
+ * Set up the queues, empty.
+ */
+void init_qos(void);
+
+/**
+ * Change the parameters of codel.
+ *
+ * @param target_ms delay a queue should not keep
+ * @param interval_ms for how long it may keep it before packets are dropped
+ */
+void qos_codel_params(unsigned target_ms, unsigned interval_ms);
+
+/**
+ * @param packet an ip packet as read from the tun
+ *
+ * @return the class it belongs to
+ */
+qos_class_t qos_classify(payload_t const packet);
+
+/**
+ * Queue a copy of the packet in its class and flow.
+ *
+ * @param packet an ip packet as read from the tun
+ *
+ * @return false if the class was full and a packet dropped
+ */
+bool qos_enqueue(payload_t const packet);
+
+/**
+ * Take the next packet to send out of the queues.
+ *
+ * @param packet where to copy it, len must hold the available space
+ *
+ * @return false if there is nothing queued
+ */
+bool qos_dequeue(payload_t* packet);
+
+/**
+ * @return packets waiting in all the queues
+ */
+unsigned qos_queued(void);
+
+/**
+ * @param class the class to look at
+ * @param stats where to write what its packets went through
+ */
+void qos_get_stats(qos_class_t class, qos_stats_t* stats);
+
+/**
+ * Log the statistics of all the classes.
+ */
+void qos_print_statistics(void);
+
+#endif /* QOS_H */
@@ -0,0 +1,98 @@
+/**
+ * Serial reader thread, see reader.h
+ *
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "util.h"
+#include "reader.h"
+
+#define POS(x) ((x) & (READER_RING_SIZE - 1))
+
+typedef struct {
+    motecomm_t* comm;
+    int event_fd;
+    pthread_t thread;
+    // written only by the reader thread (head) and only by the main thread (tail)
+    payload_t ring[READER_RING_SIZE];
+    unsigned head, tail;
+} reader_t;
+
+static reader_t readers[READER_MAX];
+static unsigned num_readers = 0;
+
+/**
+ * Main function of a reader thread.
+ */
+void* _reader_run(void* arg) {
+    reader_t* r = (reader_t*)arg;
+    serialif_t* sif = &r->comm->serialif;
+    for (;;) {
+        payload_t payload = {.stream = NULL, .len = 0};
+        sif->read(sif, &payload);
+        if (!payload.stream) {
+            continue;
+        }
+        while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == READER_RING_SIZE) {
+            LOG_DEBUG("reader ring full, waiting for the main loop");
+            usleep(READER_FULL_SLEEP_US);
+        }
+        r->ring[POS(r->head)] = payload;
+        __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+
+        uint64_t one = 1;
+        if (write(r->event_fd, &one, sizeof(one)) != sizeof(one)) {
+            LOG_WARNING("could not wake up the main loop");
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Invoked by the glue module when a reader put frames into its ring.
+ */
+void _reader_notified(fdglue_handler_t* that) {
+    reader_t* r = (reader_t*)that->p;
+    uint64_t count;
+    if (read(r->event_fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    serialif_t* sif = &r->comm->serialif;
+    unsigned available = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    while (r->tail != available) {
+        payload_t payload = r->ring[POS(r->tail)];
+        r->comm->motecomm_handler.receive(&r->comm->motecomm_handler, payload);
+        sif->ditch(sif, &payload);
+        __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void init_reader(fdglue_t* g, motecomm_t* mc) {
+    assert(mc);
+    assert(mc->motecomm_handler.receive);
+    assert(num_readers < READER_MAX);
+    reader_t* r = &readers[num_readers++];
+    r->comm = mc;
+    r->head = r->tail = 0;
+
+    r->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (r->event_fd == -1) {
+        LOG_ERROR("could not create the reader eventfd");
+        exit(1);
+    }
+    fdglue_handler_t hand_event = {
+        .p = r,
+        .handle = _reader_notified
+    };
+    g->set_handler(g, r->event_fd, FDGHT_READ, hand_event, FDGHR_APPEND, NULL);
+
+    if (pthread_create(&r->thread, NULL, _reader_run, r)) {
+        LOG_ERROR("could not start the serial reader thread");
+        exit(1);
+    }
+    LOG_DEBUG("serial reader thread %u started", num_readers);
+}
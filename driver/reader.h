@@ -0,0 +1,34 @@
+/**
+ * Thread reading frames from the serial interface.
+ *
+ * The reader thread waits for whole frames and puts them into a single
+ * producer / single consumer ring. The main loop is woken up through an
+ * eventfd and passes the frames to the motecomm handler, so a frame that
+ * arrives in pieces never holds up the tun.
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef READER_H
+#define READER_H
+
+#include "glue.h"
+#include "motecomm.h"
+
+/// frames that can wait for the main loop, must be a power of two
+#define READER_RING_SIZE 64
+
+/// serial interfaces that can have a reader
+#define READER_MAX 8
+
+/// how long the reader sleeps when the ring is full
+#define READER_FULL_SLEEP_US 1000
+
+/**
+ * Start a reader thread, one for every serial interface.
+ *
+ * @param g the glue object to be woken up with
+ * @param mc the frames are read from its serialif and given to its handler
+ */
+void init_reader(fdglue_t* g, motecomm_t* mc);
+
+#endif /* READER_H */
@@ -9,11 +9,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
 #include "reconstruct.h"
 #include "chunker.h"
 #include "tunnel.h"
 #include "compress.h"
 #include "structs.h"
+#include "bundle.h"
+#include "control.h"
+#include "fec.h"
 
 #define POS(x) (x % MAX_RECONSTRUCTABLE)
 
@@ -28,16 +34,42 @@ typedef struct {
     stream_t chunks[MAX_FRAME_SIZE];
     int tot_size;
     bool is_compressed;
+    // when the last chunk came or the last NACK was sent
+    struct timespec last_seen;
+    // when the first and the last chunk sent only once came, and how many did
+    struct timespec first_seen, last_chunk;
+    unsigned received;
+    unsigned nacks;
+    // data chunks, the parity ones are not in the bitmask
+    unsigned parts;
+    // length of the last data chunk, -1 until a chunk tells it
+    int last_len;
+    stream_t parity[FEC_MAX_PARITY][MAX_CARRIED];
+    uint8_t parity_mask;
+    bool rs;
+    // chunks that did not come the first time
+    unsigned lost;
 } packet_t;
 
 // Statistic variables
 unsigned long started_pkts = 0;
 unsigned long finished_pkts = 0;
+static unsigned long chunks_received = 0;
+static unsigned long chunks_duplicate = 0;
+static unsigned long chunks_invalid = 0;
 
 /// array of packets that we are reconstructing
 static packet_t temp_packets[MAX_RECONSTRUCTABLE];
 /// callback called when we complete one packet
 static void (*send_back)(payload_t completed);
+/// where the NACKs and the loss reports go, NULL if they are not used
+static void (*control_callback)(payload_t const msg) = NULL;
+static int gap_timer_fd = -1;
+/// chunks of the packets done with since the last loss report
+static unsigned loss_expected = 0, loss_lost = 0;
+static unsigned ticks_since_report = 0;
+/// milliseconds between two chunks of the last packets, 0 until a packet told it
+static double chunk_spacing_ms = 0;
 
 /** 
  * @param seq_no sequential number to look for
@@ -74,17 +106,27 @@ bool is_completed(packet_t *pkt) {
     return (pkt->missing_bitmask == 0);
 }
 
-/** 
- * Check if two packets represents exactly the same data or not
- * 
- * @param pkt1 first packet
- * @param pkt2 second packet
- * @param size size of both
- * 
- * @return 1 if equal, 0 otherwise
+long _reconstruct_ms(struct timespec const* from, struct timespec const* to) {
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/**
+ * @return milliseconds between two chunks of the packet, as far as it knows,
+ *         otherwise between two chunks of the last packets
+ */
+double _reconstruct_spacing(packet_t const* pkt) {
+    if (pkt->received < 2) {
+        return chunk_spacing_ms;
+    }
+    return (double)_reconstruct_ms(&pkt->first_seen, &pkt->last_chunk) / (pkt->received - 1);
+}
+
+/**
+ * @return how long the packet waits for its next chunk before a NACK
  */
-bool check_if_same_chunk(packet_t *pkt1, packet_t *pkt2, int size) {
-    return memcmp(pkt1, pkt2, size);
+long _reconstruct_gap(packet_t const* pkt) {
+    long gap = RECONSTRUCT_GAP_FACTOR * _reconstruct_spacing(pkt);
+    return (gap > RECONSTRUCT_GAP_MS) ? gap : RECONSTRUCT_GAP_MS;
 }
 
 /** 
@@ -95,6 +137,15 @@ bool check_if_same_chunk(packet_t *pkt1, packet_t *pkt2, int size) {
 void send_if_completed(packet_t *pkt) {
     // now we check if everything if the packet is completed and sends it back
     if (is_completed(pkt)) {
+        loss_expected += pkt->parts;
+        loss_lost += pkt->lost;
+        if (pkt->received >= 2) {
+            double spacing = _reconstruct_spacing(pkt);
+            chunk_spacing_ms = chunk_spacing_ms
+                ? (1 - RECONSTRUCT_SPACING_ALPHA) * chunk_spacing_ms + RECONSTRUCT_SPACING_ALPHA * spacing
+                : spacing;
+        }
+
         LOG_DEBUG("packet seqno=%d completed, tot_size=%d", pkt->seq_no, pkt->tot_size);
         if(DEBUG)
             finished_pkts++;
@@ -120,7 +171,11 @@ void send_if_completed(packet_t *pkt) {
             copy_payload(&compressed, &payload);
         }
 #endif
-        send_back(payload);
+        if (is_bundle(payload)) {
+            unbundle(payload, send_back);
+        } else {
+            send_back(payload);
+        }
     }
 }
 
@@ -136,7 +191,8 @@ void init_temp_packet(packet_t* const pkt) {
         .seq_no = -1,
         .missing_bitmask = -1ul,
         .tot_size = 0,
-        .is_compressed = true
+        .is_compressed = true,
+        .last_len = -1
     };
 
     memset((void*)(pkt->chunks), 0, MAX_FRAME_SIZE * sizeof(stream_t));
@@ -164,12 +220,65 @@ void init_reconstruction(void (*callback)(payload_t completed)) {
     }
 }
 
+/**
+ * Restore the missing chunks of a packet from its parity chunks,
+ * if enough came and the size of the packet is known.
+ *
+ * @param pkt packet to check
+ */
+void _reconstruct_try_fec(packet_t* pkt) {
+    if (is_completed(pkt) || pkt->last_len < 0
+        || (unsigned)__builtin_popcountl(pkt->missing_bitmask) > (unsigned)__builtin_popcount(pkt->parity_mask)) {
+        return;
+    }
+    stream_t* data[FEC_MAX_PARTS];
+    stream_t const* parity[FEC_MAX_PARITY];
+    for (unsigned j = 0; j < pkt->parts; j++) {
+        data[j] = pkt->chunks + j * MAX_CARRIED;
+    }
+    for (unsigned i = 0; i < FEC_MAX_PARITY; i++) {
+        parity[i] = (pkt->parity_mask & (1 << i)) ? pkt->parity[i] : NULL;
+    }
+    if (!fec_decode(data, pkt->parts, pkt->last_len, pkt->missing_bitmask, parity, pkt->rs)) {
+        return;
+    }
+    LOG_DEBUG("packet %d: %d chunks restored from the parity", pkt->seq_no, __builtin_popcountl(pkt->missing_bitmask));
+    pkt->lost += __builtin_popcountl(pkt->missing_bitmask);
+    pkt->tot_size = (pkt->parts - 1) * MAX_CARRIED + pkt->last_len;
+    pkt->missing_bitmask = 0;
+}
+
+/**
+ * Keep a parity chunk and see if the packet can be completed with it.
+ *
+ * @param pkt packet it belongs to
+ * @param chunk the parity chunk
+ * @param len its length, header included
+ */
+void _reconstruct_add_parity(packet_t* pkt, my_packet* chunk, unsigned len) {
+    unsigned index = FEC_INDEX(get_header(chunk)->ord_no);
+    if (is_completed(pkt) || index >= FEC_MAX_PARITY || (unsigned)FEC_PARTS(get_header(chunk)->ord_no) != pkt->parts) {
+        return;
+    }
+    // shorter only when the packet has a single chunk, the rest is zero
+    unsigned size = len - sizeof(my_packet_header);
+    memcpy(pkt->parity[index], chunk->payload, size);
+    memset(pkt->parity[index] + size, 0, MAX_CARRIED - size);
+    pkt->parity_mask |= 1 << index;
+    pkt->rs = (get_header(chunk)->flags & CHUNK_RS) != 0;
+    pkt->last_len = get_header(chunk)->parts;
+    _reconstruct_try_fec(pkt);
+    send_if_completed(pkt);
+}
+
 /** 
  * Main logic of the program.
- * We first convert the payload to our own data structure
+ * We first look at the header of the chunk in place.
  * Then we check the packet at the position has the same sequential number,
  * if it does then we add the chunk to the packet, otherwise we
- * initialize a new one
+ * initialize a new one.
+ * A chunk already there (the flooding and the several motes deliver many
+ * of them) is dropped before anything is copied.
  * 
  * @param data 
  */
@@ -177,8 +286,8 @@ void add_chunk(payload_t data) {
     assert(data.len <= sizeof(my_packet));
     assert(data.len >= sizeof(my_packet_header));
 
-    my_packet *original = malloc(sizeof(my_packet));
-    memcpy(original, data.stream, sizeof(my_packet));
+    // only read, never changed
+    my_packet *original = (my_packet*)data.stream;
 
     int seq_no = get_seq_no(original);
     int ord_no = get_ord_no(original);
@@ -186,18 +295,70 @@ void add_chunk(payload_t data) {
     // just for readability
     packet_t *pkt = &temp_packets[POS(seq_no)];
     
-    if (pkt->seq_no != seq_no) {
+    bool parity = (get_header(original)->flags & CHUNK_PARITY) != 0;
+    chunks_received++;
+
+    // what comes from the wire has to fit the bitmask before it goes near a slot
+    unsigned parts = parity ? (unsigned)FEC_PARTS(ord_no) : (unsigned)get_parts(original);
+    if (!parts || parts > MAX_FRAME_CHUNKS || (!parity && ord_no >= (int)parts)) {
+        LOG_WARNING("chunk %d of packet %d does not fit in %u parts, dropped", ord_no, seq_no, parts);
+        chunks_invalid++;
+        return;
+    }
+
+    if (pkt->seq_no == seq_no) {
+        if (parity ? (FEC_INDEX(ord_no) < FEC_MAX_PARITY && (pkt->parity_mask & (1 << FEC_INDEX(ord_no))))
+                   : (ord_no < (int)pkt->parts && !(pkt->missing_bitmask & (1ul << ord_no)))) {
+            LOG_DEBUG("dropping a duplicate of chunk %d of packet %d", ord_no, seq_no);
+            chunks_duplicate++;
+            return;
+        }
+    } else {
         LOG_DEBUG("Overwriting or creating new packet at position %d", POS(seq_no));
         
         if (DEBUG)
             started_pkts++;
+
+        if (pkt->seq_no >= 0 && !is_completed(pkt)) {
+            // given up on, what it misses is lost
+            loss_expected += pkt->parts;
+            loss_lost += pkt->lost + __builtin_popcountl(pkt->missing_bitmask);
+        }
         
         // payload can be adaptively compressed or not, so we need a flag in the packet
         pkt->is_compressed = is_compressed(original);
         // resetting to the initial configuration
-        pkt->missing_bitmask = (1ul << get_parts(original)) - 1;
+        pkt->parts = parts;
+        pkt->missing_bitmask = (parts == MAX_FRAME_CHUNKS) ? ~0ul : (1ul << parts) - 1;
         pkt->seq_no = seq_no;
         pkt->tot_size = 0;
+        pkt->nacks = 0;
+        pkt->last_len = -1;
+        pkt->parity_mask = 0;
+        pkt->lost = 0;
+        pkt->received = 0;
+    }
+
+    if (!parity && parts != pkt->parts) {
+        LOG_WARNING("chunk %d of packet %d does not match its %u parts, dropped", ord_no, seq_no, pkt->parts);
+        chunks_invalid++;
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &pkt->last_seen);
+
+    if (get_header(original)->flags & CHUNK_TRY_MASK) {
+        pkt->lost++;
+    } else {
+        // a resent chunk comes when asked for, it tells nothing about the spacing
+        if (!pkt->received++) {
+            pkt->first_seen = pkt->last_seen;
+        }
+        pkt->last_chunk = pkt->last_seen;
+    }
+
+    if (parity) {
+        _reconstruct_add_parity(pkt, original, data.len);
+        return;
     }
 
     // all the chunks of the same packet are compressed OR not compressed
@@ -209,29 +370,81 @@ void add_chunk(payload_t data) {
     // getting the real data size of the packet
     int size = get_size(original, data.len);
     pkt->tot_size += size;
+    if (ord_no == get_parts(original) - 1) {
+        pkt->last_len = size;
+    }
 
     // finally copy on the chunks variable the size
     memcpy(pkt->chunks + (MAX_CARRIED * ord_no), original->payload, size);
     
     // remove the arrived packet from the bitmask
-    bitmask_t new_bm = (pkt->missing_bitmask) & ~(1ul << ord_no);
-
-    if (new_bm == pkt->missing_bitmask) {
-        LOG_WARNING("adding twice the same chunk, this could happen very very rarely");
-        // the other one is at position POS(seq_no)
-        if (check_if_same_chunk(pkt, &temp_packets[POS(seq_no)], sizeof(packet_t))) {
-            // check if really the same one
-            LOG_WARNING("REALLY THE SAME CHUNK");
+    pkt->missing_bitmask &= ~(1ul << ord_no);
+    _reconstruct_try_fec(pkt);
+    send_if_completed(pkt);
+}
+
+/**
+ * Invoked by the glue module at every tick of the gap timer,
+ * sends a NACK for every packet that waited too long for its chunks
+ * and from time to time tells the other end how many chunks were lost.
+ */
+void _reconstruct_gap_tick(fdglue_handler_t* that) {
+    (void)that;
+    uint64_t expirations;
+    if (read(gap_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < MAX_RECONSTRUCTABLE; i++) {
+        packet_t* pkt = &temp_packets[i];
+        if (pkt->seq_no < 0 || is_completed(pkt) || pkt->nacks >= RECONSTRUCT_MAX_NACKS) {
+            continue;
         }
-        
-    } else  {
-        // don't really need to even check for completion if it's a duplicate chunk
-        pkt->missing_bitmask = new_bm;
-        send_if_completed(pkt);
+        if (_reconstruct_ms(&pkt->last_seen, &now) < _reconstruct_gap(pkt)) {
+            continue;
+        }
+        uint8_t missing[NACK_MAX_ORD_NOS];
+        unsigned count = 0;
+        for (unsigned ord_no = 0; ord_no < NACK_MAX_ORD_NOS; ord_no++) {
+            if (pkt->missing_bitmask & (1ul << ord_no)) {
+                missing[count++] = ord_no;
+            }
+        }
+        LOG_DEBUG("packet %d still misses %u chunks, sending a NACK", pkt->seq_no, count);
+        control_callback(make_nack(pkt->seq_no, pkt->nacks++, missing, count));
+        pkt->last_seen = now;
     }
-    
-    // finally free the memory we allocated
-    free(original);
+
+#if FEC_ENABLED
+    if (++ticks_since_report * (RECONSTRUCT_GAP_MS / 2) >= RECONSTRUCT_REPORT_MS && loss_expected) {
+        control_callback(make_loss_report(loss_expected, loss_lost));
+        loss_expected = loss_lost = 0;
+        ticks_since_report = 0;
+    }
+#endif
+}
+
+void init_feedback(fdglue_t* g, void (*send_control)(payload_t const msg)) {
+    assert(send_control);
+    control_callback = send_control;
+    gap_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (gap_timer_fd == -1) {
+        LOG_ERROR("could not create the reconstruction gap timer");
+        exit(1);
+    }
+    // checking twice per gap is precise enough
+    struct itimerspec interval;
+    interval.it_value.tv_sec = (RECONSTRUCT_GAP_MS / 2) / 1000;
+    interval.it_value.tv_nsec = ((RECONSTRUCT_GAP_MS / 2) % 1000) * 1000000;
+    interval.it_interval = interval.it_value;
+    timerfd_settime(gap_timer_fd, 0, &interval, NULL);
+
+    fdglue_handler_t hand_timer = {
+        .p = NULL,
+        .handle = _reconstruct_gap_tick
+    };
+    g->set_handler(g, gap_timer_fd, FDGHT_READ, hand_timer, FDGHR_APPEND, NULL);
 }
 
 stream_t *get_chunks(int seq_no) {
@@ -249,4 +462,12 @@ stream_t *get_chunks(int seq_no) {
 void print_statistics(void){
     LOG_NOTE("%lu packets were recognized and %lu were really sent (%f%%).", 
              started_pkts, finished_pkts, ((finished_pkts*100.0)/started_pkts));
+    LOG_NOTE("%lu chunks received, %lu duplicates and %lu not matching their packet were dropped.",
+             chunks_received, chunks_duplicate, chunks_invalid);
+}
+
+void get_chunk_statistics(chunk_stats_t* stats) {
+    stats->received = chunks_received;
+    stats->duplicates = chunks_duplicate;
+    stats->invalid = chunks_invalid;
 }
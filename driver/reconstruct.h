@@ -6,7 +6,49 @@
 // using a dividend of 256 to make much less likely that nasty things happen
 #define MAX_RECONSTRUCTABLE 32
 
+/// a packet missing chunks for that long asks for them with a NACK, at least
+#ifndef RECONSTRUCT_GAP_MS
+#define RECONSTRUCT_GAP_MS 300
+#endif
+
+/**
+ * The chunks of a packet come that far apart as the link is slowed down and
+ * the frames are interleaved: a packet asks for its chunks only after
+ * RECONSTRUCT_GAP_FACTOR times the spacing of its chunks, or of the last
+ * packets when it did not get two of them yet.
+ */
+#ifndef RECONSTRUCT_GAP_FACTOR
+#define RECONSTRUCT_GAP_FACTOR 4
+#endif
+
+/// weight of the last completed packet in the spacing of the chunks
+#ifndef RECONSTRUCT_SPACING_ALPHA
+#define RECONSTRUCT_SPACING_ALPHA 0.25
+#endif
+
+/// NACKs sent for the same packet before giving up on it
+#ifndef RECONSTRUCT_MAX_NACKS
+#define RECONSTRUCT_MAX_NACKS 3
+#endif
+
+/// how often the chunk loss is reported to the other end
+#ifndef RECONSTRUCT_REPORT_MS
+#define RECONSTRUCT_REPORT_MS 1000
+#endif
+
 #include "util.h"
+#include "glue.h"
+
+/**
+ * What happened to the chunks given to add_chunk.
+ */
+typedef struct {
+    unsigned long received;
+    /// already there, dropped
+    unsigned long duplicates;
+    /// the ord_no or the parts do not match the packet of the slot, dropped
+    unsigned long invalid;
+} chunk_stats_t;
 
 /** 
  * Initialize the reconstruction of packets
@@ -15,6 +57,16 @@
  */
 void init_reconstruction(void (*callback)(payload_t completed));
 
+/**
+ * Ask the other end for the chunks that do not come, and with FEC_ENABLED
+ * report how many chunks are lost.
+ * Without it, a packet missing a chunk waits until its slot is reused.
+ *
+ * @param g the glue object the gap timer is registered with
+ * @param send_control called with every NACK and loss report to send (@see control.h)
+ */
+void init_feedback(fdglue_t* g, void (*send_control)(payload_t const msg));
+
 /** 
  * Adding a new chunk of data
  * 
@@ -35,4 +87,9 @@ stream_t *get_chunks(int seq_no);
  */
 void print_statistics(void);
 
+/**
+ * @param stats where to write what happened to the chunks so far
+ */
+void get_chunk_statistics(chunk_stats_t* stats);
+
 #endif
@@ -0,0 +1,617 @@
+/**
+ * Paced chunk transmission, see sender.h
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <arpa/inet.h>
+
+#include "chunker.h"
+#include "workers.h"
+#include "sender.h"
+#include "fec.h"
+#include "flow.h"
+
+typedef struct {
+    // bytes per second, 0 if there is no limit
+    unsigned rate;
+    unsigned burst;
+    double tokens;
+    // when the tokens were last added
+    struct timespec last;
+} bucket_t;
+
+typedef struct {
+    motecomm_t* comm;
+    // the last chunk could not be written to the mote
+    bool failed;
+    // credit of the smooth weighted round robin
+    double current;
+    // time between two chunks the mote can take, adapted to what it reports
+    unsigned gap_us;
+    // last counter of dropped messages reported by the mote
+    uint8_t dropped;
+    bool has_status;
+    bucket_t bucket;
+} link_t;
+
+static int timer_fd = -1;
+static bool timer_running;
+static unsigned initial_gap_us;
+static struct itimerspec interval;
+// the interval changed, to be applied at the next tick
+static bool interval_changed;
+static link_t links[SENDER_MAX_LINKS];
+static unsigned num_links;
+static void (*sent_callback)(void);
+
+// the destinations with a limit of their own
+static struct {
+    uint16_t address;
+    bucket_t bucket;
+} clients[SENDER_MAX_CLIENTS];
+static unsigned num_clients;
+
+// frames taken from the workers, oldest first, and the next chunk of each
+static struct {
+    frame_t* frame;
+    unsigned ord_no;
+} in_flight[SENDER_INTERLEAVE];
+static unsigned num_in_flight;
+// where to look for the frame whose chunk goes next
+static unsigned turn;
+static seq_no_t seqno;
+
+// the last chunks sent, oldest overwritten first
+static struct {
+    chunk_t chunk;
+    unsigned len;
+    // waiting to be sent again
+    bool resend;
+} history[SENDER_HISTORY];
+static unsigned history_next;
+static unsigned resend_count;
+
+static struct {
+    chunk_t chunk;
+    unsigned len;
+} controls[SENDER_CONTROL_QUEUE];
+static unsigned control_first, control_count;
+
+/**
+ * (Dis)arm the timer.
+ */
+void _sender_set_timer(bool on) {
+    struct itimerspec off;
+    memset(&off, 0, sizeof(off));
+    timerfd_settime(timer_fd, 0, on ? &interval : &off, NULL);
+    timer_running = on;
+}
+
+/**
+ * The timer ticks as often as all the links together can take a chunk.
+ */
+void _sender_set_interval(void) {
+    double per_second = 0;
+    for (unsigned i = 0; i < num_links; i++) {
+        per_second += 1e6 / links[i].gap_us;
+    }
+    unsigned us = 1e6 / per_second;
+    interval.it_value.tv_sec = us / 1000000;
+    interval.it_value.tv_nsec = (us % 1000000) * 1000;
+    interval.it_interval = interval.it_value;
+    interval_changed = true;
+}
+
+/**
+ * Set the limit of a bucket and fill it.
+ */
+void _sender_bucket_set(bucket_t* bucket, unsigned rate, unsigned burst) {
+    if (!burst) {
+        burst = rate * SENDER_DEFAULT_BURST;
+    }
+    // a burst smaller than a chunk would never let anything through
+    if (burst < sizeof(my_packet)) {
+        burst = sizeof(my_packet);
+    }
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+/**
+ * Add the tokens earned since the last time and look if there are enough.
+ *
+ * @param bucket NULL if there is no limit
+ * @param len bytes to send
+ * @param now the current time
+ *
+ * @return true if the bytes can be sent
+ */
+bool _sender_bucket_allows(bucket_t* bucket, unsigned len, struct timespec const* now) {
+    if (!bucket || !bucket->rate) {
+        return true;
+    }
+    double elapsed = (now->tv_sec - bucket->last.tv_sec) + (now->tv_nsec - bucket->last.tv_nsec) / 1e9;
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->last = *now;
+    return bucket->tokens >= len;
+}
+
+void _sender_bucket_take(bucket_t* bucket, unsigned len) {
+    if (bucket && bucket->rate) {
+        bucket->tokens -= len;
+    }
+}
+
+/**
+ * @return the bucket of the destination of a chunk, NULL if it has no limit
+ */
+bucket_t* _sender_client_bucket(my_packet_header const* header) {
+    uint16_t address = ntohs(header->destination);
+    for (unsigned i = 0; i < num_clients; i++) {
+        if (clients[i].address == address && clients[i].bucket.rate) {
+            return &clients[i].bucket;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The write to the serial returns as soon as the frame is in the window, its
+ * duration says nothing about the radio. What the mote can forward is known
+ * from its status reports, they set the gap of the link.
+ *
+ * @return the weight of a link in the round robin
+ */
+double _sender_weight(link_t const* link) {
+    if (link->failed) {
+        return SENDER_RATE_FLOOR;
+    }
+    // what the mote lets us send
+    double allowed = TOSH_DATA_LENGTH * 1e6 / link->gap_us;
+    if (link->bucket.rate && allowed > link->bucket.rate) {
+        allowed = link->bucket.rate;
+    }
+    return allowed + SENDER_RATE_FLOOR;
+}
+
+/**
+ * Smooth weighted round robin: every link gains its weight, the richest one
+ * sends and pays for it with the total. The links without tokens for the
+ * chunk sit this one out.
+ *
+ * @param len bytes to send
+ * @param now the current time
+ *
+ * @return the link to send the next chunk over, NULL if every link is held back
+ */
+link_t* _sender_pick_link(unsigned len, struct timespec const* now) {
+    link_t* best = NULL;
+    double total = 0;
+    for (unsigned i = 0; i < num_links; i++) {
+        if (!_sender_bucket_allows(&links[i].bucket, len, now)) {
+            continue;
+        }
+        double weight = _sender_weight(&links[i]);
+        links[i].current += weight;
+        total += weight;
+        if (!best || links[i].current > best->current) {
+            best = &links[i];
+        }
+    }
+    if (best) {
+        best->current -= total;
+    }
+    return best;
+}
+
+/**
+ * Send a chunk over a link, a link that fails is only tried now and then.
+ */
+void _sender_send(link_t* link, payload_t const chunk) {
+    // the serialif directly, motecomm_t::send does not tell whether it worked
+    serialif_t* sif = &link->comm->serialif;
+    bool failed = sif->send(sif, chunk) < 0;
+    if (failed && !link->failed) {
+        LOG_WARNING("sending over link %u failed", (unsigned)(link - links));
+    }
+    link->failed = failed;
+}
+
+/**
+ * Send a chunk over the next link, if the limits let it go.
+ *
+ * @param chunk what to send
+ * @param client the bucket of its destination, NULL if it has none
+ *
+ * @return false if it has to wait
+ */
+bool _sender_transmit(payload_t const chunk, bucket_t* client) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!_sender_bucket_allows(client, chunk.len, &now)) {
+        return false;
+    }
+    link_t* link = _sender_pick_link(chunk.len, &now);
+    if (!link) {
+        return false;
+    }
+    _sender_bucket_take(client, chunk.len);
+    _sender_bucket_take(&link->bucket, chunk.len);
+    _sender_send(link, chunk);
+    return true;
+}
+
+/**
+ * The receiver puts the packets back together in the order their last chunk
+ * comes, and the header compression contexts of a flow need them in order.
+ * A frame therefore waits for the older ones of its flow, and a bundle, which
+ * may carry packets of any flow, for all of them.
+ *
+ * @param i position of the frame in flight
+ *
+ * @return true if its chunks can be sent now
+ */
+bool _sender_can_start(unsigned i) {
+    frame_t const* frame = in_flight[i].frame;
+    for (unsigned j = 0; j < i; j++) {
+        frame_t const* older = in_flight[j].frame;
+        if (!frame->has_flow || !older->has_flow || flow_key_equals(&older->flow, &frame->flow)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Take the frames done by the workers, as many as can be in flight.
+ *
+ * @return true if there is something to send
+ */
+bool _sender_next_frames(void) {
+    frame_t* frame;
+    while (num_in_flight < SENDER_INTERLEAVE && (frame = next_ready_frame())) {
+        // now that the frame is in order we know its sequence number
+        set_chunk_headers(frame->chunks, frame->parts, ++seqno, frame->is_compressed);
+        if (frame->parity) {
+            fec_set_headers(frame->chunks, frame->parts, frame->parity, frame->chunked_len);
+        }
+        in_flight[num_in_flight].frame = frame;
+        in_flight[num_in_flight].ord_no = 0;
+        num_in_flight++;
+
+        unsigned sum = 0;
+        if (DEBUG) {
+            for (unsigned i = 0; i < frame->chunked_len; i++) {
+                sum += frame->chunks[i / MAX_CARRIED].packet.payload[i % MAX_CARRIED];
+            }
+        }
+        static unsigned sent_count = 0;
+        LOG_NOTE("<= Checksum of SENT packet %u is %08X", sent_count++, sum);
+    }
+    return num_in_flight > 0;
+}
+
+/**
+ * Send what is waiting before the new chunks, a control message or a chunk asked for again.
+ * What the limits hold back stays queued, a resend held by the limit of its
+ * client leaves the others and the new chunks their turn.
+ *
+ * @return true if something was sent
+ */
+bool _sender_send_urgent(void) {
+    payload_t to_send = {.headroom = CHUNK_HEADROOM};
+    if (control_count) {
+        to_send.stream = (stream_t*)&controls[control_first].chunk.packet;
+        to_send.len = controls[control_first].len;
+        if (_sender_transmit(to_send, NULL)) {
+            control_first = (control_first + 1) % SENDER_CONTROL_QUEUE;
+            control_count--;
+            return true;
+        }
+    }
+    // the oldest first
+    for (unsigned n = 0, i = history_next; n < SENDER_HISTORY && resend_count; n++, i = (i + 1) % SENDER_HISTORY) {
+        if (!history[i].resend) {
+            continue;
+        }
+        my_packet_header* header = &history[i].chunk.packet.packet_header;
+        uint8_t flags = header->flags;
+        header->flags = (flags & ~CHUNK_TRY_MASK) | ((flags + (1 << CHUNK_TRY_SHIFT)) & CHUNK_TRY_MASK);
+        to_send.stream = (stream_t*)&history[i].chunk.packet;
+        to_send.len = history[i].len;
+        if (_sender_transmit(to_send, _sender_client_bucket(header))) {
+            LOG_DEBUG("Sent again ord_no: %u (seq_no: %u)", (unsigned)header->ord_no, (unsigned)header->seq_no);
+            history[i].resend = false;
+            resend_count--;
+            return true;
+        }
+        // the next try is still this one
+        header->flags = flags;
+    }
+    return false;
+}
+
+/**
+ * Keep a chunk in case it has to be sent again.
+ */
+void _sender_remember(my_packet const* pkt, unsigned len) {
+    if (history[history_next].resend) {
+        resend_count--;
+    }
+    memcpy(&history[history_next].chunk.packet, pkt, len);
+    history[history_next].len = len;
+    history[history_next].resend = false;
+    history_next = (history_next + 1) % SENDER_HISTORY;
+}
+
+/**
+ * @param i position of a frame in flight
+ *
+ * @return its next chunk
+ */
+payload_t _sender_next_chunk(unsigned i) {
+    frame_t* frame = in_flight[i].frame;
+    unsigned ord_no = in_flight[i].ord_no;
+    return (payload_t){
+        .stream = (stream_t*)&frame->chunks[ord_no].packet,
+        .len = (ord_no < frame->parts) ? chunk_size(frame->chunked_len, ord_no)
+            : fec_chunk_size(frame->parts, frame->chunked_len),
+        .headroom = CHUNK_HEADROOM
+    };
+}
+
+/**
+ * Invoked by the glue module at every tick of the timer, sends one chunk.
+ */
+void _sender_tick(fdglue_handler_t* that) {
+    (void)that;
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    if (interval_changed) {
+        _sender_set_timer(true);
+        interval_changed = false;
+    }
+    if (_sender_send_urgent()) {
+        return;
+    }
+    if (!_sender_next_frames()) {
+        // nothing to do until sender_kick is called again
+        _sender_set_timer(false);
+        return;
+    }
+
+    // the frames in flight take turns, so a short one is done after a few chunks,
+    // and one held by the limit of its client leaves the others their turn
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned i = turn % num_in_flight;
+    unsigned tried = 0;
+    payload_t to_send = {.len = 0};
+    for (; tried < num_in_flight; tried++, i = (i + 1) % num_in_flight) {
+        if (!_sender_can_start(i)) {
+            continue;
+        }
+        to_send = _sender_next_chunk(i);
+        my_packet_header const* header = (my_packet_header const*)to_send.stream;
+        if (_sender_bucket_allows(_sender_client_bucket(header), to_send.len, &now)) {
+            break;
+        }
+    }
+    if (tried == num_in_flight) {
+        // every frame that may go waits for its client
+        return;
+    }
+    frame_t* frame = in_flight[i].frame;
+    my_packet* pkt = (my_packet*)to_send.stream;
+    if (!_sender_transmit(to_send, _sender_client_bucket(&pkt->packet_header))) {
+        // held back by the links, the next tick tries again
+        return;
+    }
+    LOG_DEBUG("Sent ord_no: %u (seq_no: %u)", (unsigned)pkt->packet_header.ord_no,
+              (unsigned)pkt->packet_header.seq_no);
+    _sender_remember(pkt, to_send.len);
+
+    if (++in_flight[i].ord_no < frame->parts + frame->parity) {
+        turn = i + 1;
+        return;
+    }
+    // done, the next one moves into its place
+    release_frame(frame);
+    num_in_flight--;
+    memmove(&in_flight[i], &in_flight[i + 1], (num_in_flight - i) * sizeof(in_flight[0]));
+    turn = i;
+    sent_callback();
+}
+
+void init_sender(fdglue_t* g, motecomm_t* mcomm, unsigned gap_us, void (*frame_sent)(void)) {
+    assert(frame_sent);
+    sent_callback = frame_sent;
+    num_in_flight = 0;
+    turn = 0;
+    memset(history, 0, sizeof(history));
+    history_next = 0;
+    resend_count = 0;
+    control_first = control_count = 0;
+    initial_gap_us = gap_us;
+    num_links = 0;
+    num_clients = 0;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timer_fd == -1) {
+        LOG_ERROR("could not create the sender timer");
+        exit(1);
+    }
+    timer_running = false;
+    sender_add_link(mcomm);
+
+    fdglue_handler_t hand_timer = {
+        .p = NULL,
+        .handle = _sender_tick
+    };
+    g->set_handler(g, timer_fd, FDGHT_READ, hand_timer, FDGHR_APPEND, NULL);
+}
+
+void sender_add_link(motecomm_t* mcomm) {
+    assert(mcomm);
+    assert(num_links < SENDER_MAX_LINKS);
+    links[num_links++] = (link_t){
+        .comm = mcomm,
+        .failed = false,
+        .current = 0,
+        .gap_us = initial_gap_us,
+        .has_status = false
+    };
+    _sender_set_interval();
+}
+
+void sender_mote_status(motecomm_t* mcomm, unsigned queue_len, unsigned queue_size, uint8_t dropped) {
+    link_t* link = NULL;
+    for (unsigned i = 0; i < num_links; i++) {
+        if (links[i].comm == mcomm) {
+            link = &links[i];
+        }
+    }
+    if (!link) {
+        return;
+    }
+
+    // additive increase of the rate, multiplicative decrease when the mote is overrun
+    unsigned gap = link->gap_us;
+    if ((link->has_status && dropped != link->dropped) || queue_len >= queue_size) {
+        gap *= 2;
+    } else if (queue_len > SENDER_QUEUE_TARGET) {
+        gap += gap / 8;
+    } else if (gap > SENDER_GAP_STEP_US) {
+        gap -= SENDER_GAP_STEP_US;
+    }
+    if (gap < SENDER_MIN_GAP_US) {
+        gap = SENDER_MIN_GAP_US;
+    }
+    if (gap > SENDER_MAX_GAP_US) {
+        gap = SENDER_MAX_GAP_US;
+    }
+    link->dropped = dropped;
+    link->has_status = true;
+
+    if (gap != link->gap_us) {
+        LOG_DEBUG("link %u: radio queue %u/%u, gap now %u us", (unsigned)(link - links), queue_len, queue_size, gap);
+        link->gap_us = gap;
+        _sender_set_interval();
+    }
+}
+
+void sender_kick(void) {
+    if (!timer_running) {
+        _sender_set_timer(true);
+    }
+}
+
+void sender_resend(seq_no_t seq_no, uint8_t const* ord_nos, unsigned count) {
+    for (unsigned n = 0; n < count; n++) {
+        bool found = false;
+        for (unsigned i = 0; i < SENDER_HISTORY; i++) {
+            my_packet_header const* header = &history[i].chunk.packet.packet_header;
+            // the NACKs name data chunks, the first parity chunk has the ord_no of the last one
+            if (history[i].len && header->seq_no == seq_no && header->ord_no == ord_nos[n]
+                && !(header->flags & CHUNK_PARITY)) {
+                if (!history[i].resend) {
+                    history[i].resend = true;
+                    resend_count++;
+                }
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            LOG_DEBUG("chunk %u of packet %u is not in the history anymore", (unsigned)ord_nos[n], (unsigned)seq_no);
+        }
+    }
+    if (resend_count) {
+        sender_kick();
+    }
+}
+
+void sender_send_control(payload_t const msg) {
+    assert(msg.len <= sizeof(my_packet));
+    if (control_count == SENDER_CONTROL_QUEUE) {
+        LOG_WARNING("too many control messages, dropping one");
+        return;
+    }
+    unsigned last = (control_first + control_count++) % SENDER_CONTROL_QUEUE;
+    memcpy(&controls[last].chunk.packet, msg.stream, msg.len);
+    controls[last].len = msg.len;
+    sender_kick();
+}
+
+void sender_set_link_limit(unsigned link, unsigned bytes_per_s, unsigned burst) {
+    if (link >= num_links) {
+        LOG_WARNING("there is no link %u to limit", link);
+        return;
+    }
+    _sender_bucket_set(&links[link].bucket, bytes_per_s, burst);
+    LOG_INFO("link %u limited to %u bytes/s, burst %u", link, bytes_per_s, links[link].bucket.burst);
+}
+
+void sender_set_client_limit(uint16_t address, unsigned bytes_per_s, unsigned burst) {
+    unsigned i = 0;
+    while (i < num_clients && clients[i].address != address) {
+        i++;
+    }
+    if (i == num_clients) {
+        if (num_clients == SENDER_MAX_CLIENTS) {
+            LOG_WARNING("too many clients, %u is not limited", (unsigned)address);
+            return;
+        }
+        num_clients++;
+    }
+    clients[i].address = address;
+    _sender_bucket_set(&clients[i].bucket, bytes_per_s, burst);
+    LOG_INFO("client %u limited to %u bytes/s, burst %u", (unsigned)address, bytes_per_s, clients[i].bucket.burst);
+}
+
+bool sender_load_limits(char const* path) {
+    for (unsigned i = 0; i < num_links; i++) {
+        links[i].bucket.rate = 0;
+    }
+    num_clients = 0;
+
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = 0;
+        char kind[16];
+        unsigned id, rate, burst = 0;
+        int fields = sscanf(line, "%15s %u %u %u", kind, &id, &rate, &burst);
+        if (fields <= 0 || kind[0] == '#') {
+            continue;
+        }
+        if (fields >= 3 && !strcmp(kind, "link")) {
+            sender_set_link_limit(id, rate, burst);
+        } else if (fields >= 3 && !strcmp(kind, "client") && id > 0xFFFF) {
+            LOG_WARNING("%s: %u is not a mote address", path, id);
+        } else if (fields >= 3 && !strcmp(kind, "client")) {
+            sender_set_client_limit(id, rate, burst);
+        } else {
+            LOG_WARNING("%s: cannot understand '%s'", path, line);
+        }
+    }
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,173 @@
+/**
+ * Paced transmission of the compressed frames over the serial.
+ *
+ * The mote can only forward a chunk every now and then, so the chunks are
+ * sent one per timer tick. The timer lives in the glue loop, so the main
+ * thread keeps reading from the tun and the serial in between.
+ *
+ * Several motes can be attached, every one is a link. The timer then ticks
+ * once per link in the same interval, and each chunk goes to a link chosen
+ * by a smooth weighted round robin. The chunks of a frame can take different
+ * links, the receiver puts them together by their numbers anyway.
+ *
+ * The motes report how full their radio queue is (@see control.h). The gap
+ * between two chunks of a link shrinks a little with every report of a short
+ * queue, and grows fast when the queue fills up or the mote drops messages.
+ * A mote that does not report keeps the initial gap. The weight of a link is
+ * the rate its gap allows, a link whose serial fails gets almost nothing.
+ *
+ * Every link, and every destination on the gateway, can also be held to a
+ * rate with a token bucket. The limits are read from SENDER_LIMITS_FILE when
+ * starting and again on SIGHUP, so they can follow the capacity measured for
+ * the radios of a deployment without recompiling. A link that has no tokens
+ * left for a chunk is passed over, when no link has any the chunk waits for
+ * the next tick.
+ *
+ * Several frames are sent at the same time, taking turns chunk by chunk, so
+ * a short packet taken from the workers while a long one is being sent does
+ * not wait for all of its chunks. The frames of the same flow, and bundles,
+ * are still sent one after the other: the other end must finish them in
+ * order for the header compression. How many frames the workers have ready
+ * is bounded by QOS_PIPELINE_DEPTH as well.
+ *
+ * The last chunks sent are kept, so the ones the other end asks for with a
+ * NACK can be sent again. Control messages and chunks sent again go out
+ * before the new chunks.
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef SENDER_H
+#define SENDER_H
+
+#include "glue.h"
+#include "motecomm.h"
+
+/// how many motes can be used at the same time
+#ifndef SENDER_MAX_LINKS
+#define SENDER_MAX_LINKS 8
+#endif
+
+/// bytes per second every link is credited with, so a link that failed is still tried now and then
+#define SENDER_RATE_FLOOR 100.0
+
+/// radio queue length the motes should not exceed
+#ifndef SENDER_QUEUE_TARGET
+#define SENDER_QUEUE_TARGET 2
+#endif
+
+/// the gap gets this much shorter with every report of a short queue
+#define SENDER_GAP_STEP_US 500
+
+/// bounds of the gap between two chunks on the same link
+#define SENDER_MIN_GAP_US 2000
+#define SENDER_MAX_GAP_US 1000000
+
+/// chunks kept to be sent again, a NACK for an older one is ignored
+#ifndef SENDER_HISTORY
+#define SENDER_HISTORY 128
+#endif
+
+/// control messages waiting for the next tick, the rest is dropped
+#define SENDER_CONTROL_QUEUE 4
+
+/// frames sent at the same time, their chunks interleaved
+#ifndef SENDER_INTERLEAVE
+#define SENDER_INTERLEAVE 4
+#endif
+
+/// destinations that can have their own limit
+#ifndef SENDER_MAX_CLIENTS
+#define SENDER_MAX_CLIENTS 8
+#endif
+
+/**
+ * The rate limits, one per line, reloaded on SIGHUP:
+ *   link <number of the mote> <bytes per second> [<burst in bytes>]
+ *   client <mote address> <bytes per second> [<burst in bytes>]
+ * A rate of 0 removes the limit, lines starting with '#' are ignored.
+ */
+#ifndef SENDER_LIMITS_FILE
+#define SENDER_LIMITS_FILE "limits.conf"
+#endif
+
+/// burst of a limit given without one, in seconds of its rate
+#define SENDER_DEFAULT_BURST 0.1
+
+/**
+ * Set up the sender.
+ *
+ * @param g the glue object the timer is registered with
+ * @param mcomm the first link
+ * @param interval_us initial time between two chunks on the same link in micro seconds
+ * @param frame_sent called every time a frame has been sent completely
+ */
+void init_sender(fdglue_t* g, motecomm_t* mcomm, unsigned interval_us, void (*frame_sent)(void));
+
+/**
+ * Tell the sender new frames may be ready (@see next_ready_frame).
+ * Starts the timer if it is not already running.
+ */
+void sender_kick(void);
+
+/**
+ * Send over one more mote.
+ *
+ * @param mcomm the new link
+ */
+void sender_add_link(motecomm_t* mcomm);
+
+/**
+ * A mote told how its radio queue is doing, adapt the pace of its link.
+ *
+ * @param mcomm the link of the mote
+ * @param queue_len messages waiting in the radio queue
+ * @param queue_size capacity of the radio queue
+ * @param dropped counter of the messages the mote dropped
+ */
+void sender_mote_status(motecomm_t* mcomm, unsigned queue_len, unsigned queue_size, uint8_t dropped);
+
+/**
+ * The other end is missing chunks of a packet, send them again if we still have them.
+ *
+ * @param seq_no the packet
+ * @param ord_nos the chunks
+ * @param count how many
+ */
+void sender_resend(seq_no_t seq_no, uint8_t const* ord_nos, unsigned count);
+
+/**
+ * Send a control message at the next tick.
+ *
+ * @param msg the message, copied
+ */
+void sender_send_control(payload_t const msg);
+
+/**
+ * Hold a link to a rate.
+ *
+ * @param link number of the link, the first mote is 0
+ * @param bytes_per_s the rate, 0 for no limit
+ * @param burst bytes that may go at once, at least a chunk
+ */
+void sender_set_link_limit(unsigned link, unsigned bytes_per_s, unsigned burst);
+
+/**
+ * Hold the chunks sent to a destination to a rate, over all the links.
+ * Control messages are never held back.
+ *
+ * @param address the address of the mote of the client
+ * @param bytes_per_s the rate, 0 for no limit
+ * @param burst bytes that may go at once, at least a chunk
+ */
+void sender_set_client_limit(uint16_t address, unsigned bytes_per_s, unsigned burst);
+
+/**
+ * Drop all the limits and set the ones of a file (@see SENDER_LIMITS_FILE).
+ *
+ * @param path the file
+ *
+ * @return false if it could not be read, no limit is left then
+ */
+bool sender_load_limits(char const* path);
+
+#endif /* SENDER_H */
@@ -1,6 +1,8 @@
 /**
  * Fake serial implementation for simulation/debugging purposes.
- * XXX Currently not supported by the main application.
+ * The messages are written with a two byte length in front of them, so any
+ * stream will do: pipes, FIFOs, socketpairs. Used for the loopback of
+ * client and gateway, see the usage of both.
  *
  * @date september 2010
  * @author Oscar Dustmann
@@ -10,8 +12,12 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 
 #include "util.h"
+#include "pool.h"
 
 
 typedef struct {
@@ -19,8 +25,16 @@ typedef struct {
     int out;
     // from which fd is the data to be read
     int in;
+    // what was read and not given out yet
+    stream_t buf[SERIALFAKE_READ_BUFFER];
+    unsigned pos, used;
 } serialfake_fd_t;
 
+// every message is preceded by its length, big endian
+#define SERIALFAKE_LEN_SIZE 2
+
+#define FAKE(this) ((serialfake_fd_t*)((this)->source))
+
 // the following implementation is only suited for the pc side, but must be different on the mote side
 #if INCLUDE_SERIAL_FORWARD_IMPLEMENTATION
 
@@ -29,7 +43,20 @@ typedef struct {
  */
 int _serialfakeif_t_fd(serialif_t* this) {
     assert(this);
-    return ((serialfake_fd_t*)(this->source))->in;
+    return FAKE(this)->in;
+}
+
+/**
+ * @return true if a complete message is waiting in our buffer
+ */
+bool _serialfakeif_t_pending(serialif_t* this) {
+    assert(this);
+    serialfake_fd_t* fds = FAKE(this);
+    if (fds->used - fds->pos < SERIALFAKE_LEN_SIZE) {
+        return false;
+    }
+    unsigned len = (fds->buf[fds->pos] << 8) | fds->buf[fds->pos + 1];
+    return fds->used - fds->pos >= SERIALFAKE_LEN_SIZE + len;
 }
 
 /**
@@ -40,7 +67,8 @@ void _serialfakeif_t_ditch(serialif_t* this, payload_t* const payload) {
     assert(this);
     assert(payload);
     if (payload->stream) {
-        free((void*)(payload->stream));
+        // we gave out the slab just past the header
+        this->pool->put(this->pool, payload->stream - sizeof(struct message_header_mine_t));
         payload->stream = NULL;
     }
     payload->len = 0;
@@ -49,35 +77,51 @@ void _serialfakeif_t_ditch(serialif_t* this, payload_t* const payload) {
 /**
  * Implementation of serialif_t::send - do not call explicitly.
  *
- * @param payload What we are supposed to send. We promise not to change it.
+ * @param payload What we are supposed to send. We promise not to change it,
+ *                but we may use its headroom.
  */
 int _serialfakeif_t_send(serialif_t* this, payload_t const payload) {
     assert(this);
-    payload_t buf;
-    {
+    if (DEBUG) {
         unsigned hash = 0;
         for (unsigned i = 0; i < payload.len; i++) {
             hash+=payload.stream[i];
         }
         LOG_DEBUG("Writing to stdout: %u bytes, hash: %u",payload.len,hash);
     }
-    buf.len = sizeof(struct message_header_mine_t)+payload.len*sizeof(stream_t);
-    buf.stream = malloc(buf.len);
-    memset((void*)buf.stream,0,sizeof(struct message_header_mine_t));
-    struct message_header_mine_t* mh = (struct message_header_mine_t*)(buf.stream);
-    mh->destaddr = 0xFFFF;
-    mh->handlerid = 0;
-    mh->groupid = 0;
-    mh->amid = 0;
-    mh->msglen = payload.len;
-    memcpy((void*)(buf.stream + sizeof(struct message_header_mine_t)),payload.stream,payload.len*sizeof(stream_t));
-    int result = write(((serialfake_fd_t*)(this->source))->out,buf.stream,buf.len);
-    free((void*)(buf.stream));
-    return result;
+    payload_t buf = add_message_header(payload);
+    stream_t len[SERIALFAKE_LEN_SIZE] = {buf.len >> 8, buf.len & 0xFF};
+    struct iovec iov[2] = {
+        {.iov_base = len, .iov_len = SERIALFAKE_LEN_SIZE},
+        {.iov_base = (void*)buf.stream, .iov_len = buf.len}
+    };
+    // a socket may take only part of it
+    unsigned left = SERIALFAKE_LEN_SIZE + buf.len;
+    struct iovec* next = iov;
+    while (left) {
+        ssize_t written = writev(FAKE(this)->out, next, iov + 2 - next);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        left -= written;
+        while (written && (size_t)written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+        }
+        if (written) {
+            next->iov_base = (stream_t*)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    return buf.len;
 }
 
 /**
  * Implementation of serialif_t::read - not to call explicitly.
+ * Reads as much as there is at once, the messages are then given out one by one.
  *
  * @param payload A pointer to the variable WE ARE SUPPOSED TO PUT THE PAYLOAD.
  *                When you are done with it, please call serialif_t::ditch.
@@ -85,25 +129,39 @@ int _serialfakeif_t_send(serialif_t* this, payload_t const payload) {
  */
 void _serialfakeif_t_read(serialif_t* this, payload_t* const payload) {
     assert(this);
-    static unsigned char readbuffer[TOSH_DATA_LENGTH];
-    payload_t buf = {.stream = readbuffer, .len = TOSH_DATA_LENGTH};
-    do {
-        buf.len = read(((serialfake_fd_t*)(this->source))->in,(void*)buf.stream,buf.len);
-    } while(!buf.len);
-    if (!buf.stream != !buf.len || buf.len < 8) {
-        buf.stream = NULL;
-        buf.len = 0;
+    serialfake_fd_t* fds = FAKE(this);
+    payload->len = 0;
+    payload->stream = NULL;
+
+    while (!_serialfakeif_t_pending(this)) {
+        // make room behind what is left
+        memmove(fds->buf, fds->buf + fds->pos, fds->used - fds->pos);
+        fds->used -= fds->pos;
+        fds->pos = 0;
+        ssize_t got = read(fds->in, fds->buf + fds->used, SERIALFAKE_READ_BUFFER - fds->used);
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (got <= 0) {
+            LOG_ERROR("the other end of the fake connection went away");
+            exit(1);
+        }
+        fds->used += got;
     }
-    payload->len = buf.len - 8;
-    payload->stream = (void*)(malloc(buf.len-8));
-    if (buf.stream) {
-        memcpy((void*)(payload->stream),(void*)(buf.stream+8),buf.len - 8);
-    } else {
-        free((void*)(payload->stream));
-        payload->len = 0;
-        payload->stream = NULL;
+
+    unsigned len = (fds->buf[fds->pos] << 8) | fds->buf[fds->pos + 1];
+    stream_t const* msg = fds->buf + fds->pos + SERIALFAKE_LEN_SIZE;
+    fds->pos += SERIALFAKE_LEN_SIZE + len;
+    if (len < sizeof(struct message_header_mine_t) || len > this->pool->slab_size) {
+        LOG_WARNING("dropping a fake message of %u bytes", len);
+        return;
     }
-    {
+    // the buffer is reused by the next read, the pool slab lives until ditch
+    stream_t* slab = this->pool->get(this->pool);
+    memcpy(slab, msg, len);
+    payload->len = len - sizeof(struct message_header_mine_t);
+    payload->stream = slab + sizeof(struct message_header_mine_t);
+    if (DEBUG) {
         unsigned hash = 0;
         for (unsigned i = 0; i < payload->len; i++) {
             hash+=payload->stream[i];
@@ -111,7 +169,6 @@ void _serialfakeif_t_read(serialif_t* this, payload_t* const payload) {
         LOG_DEBUG("Reading from stdin: %u bytes, hash: %u",payload->len,hash);
     }
 }
-
 /**
  * Custom destructor for serialif_t.
  * Will close the sf connection.
@@ -122,6 +179,9 @@ void _serialfakeif_t_dtor(serialif_t* this) {
     if (this->source) {
         free(this->source);
     }
+    if (this->pool) {
+        DTOR(this->pool);
+    }
 }
 
 /**
@@ -139,7 +199,14 @@ void _serialfakeif_t_open(serialif_t* this, char const* dev, char* const platfor
     serialfake_fd_t* fds = (serialfake_fd_t*)malloc(sizeof(serialfake_fd_t));
     fds->in = STDIN_FILENO;
     fds->out = STDOUT_FILENO;
+    fds->pos = fds->used = 0;
+#if !SERIAL_READER_THREAD
+    // the main loop must not wait for the rest of a message
+    fcntl(fds->in, F_SETFL, fcntl(fds->in, F_GETFL) | O_NONBLOCK);
+#endif
     this->source = (serial_source)fds;
+    // big enough for the message header and a full chunk
+    this->pool = pool(NULL, sizeof(struct message_header_mine_t) + TOSH_DATA_LENGTH, SERIAL_POOL_SLABS);
 }
 
 #endif 
@@ -3,4 +3,9 @@
 
 #include "serialif.h"
 
+/// bytes read at once, many messages fit in it
+#ifndef SERIALFAKE_READ_BUFFER
+#define SERIALFAKE_READ_BUFFER 65536
+#endif
+
 #endif
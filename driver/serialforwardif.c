@@ -1,22 +1,232 @@
 #include "serialforwardif.h"
 #include "motecomm.h"
 
-#include <sfsource.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "util.h"
+#include "pool.h"
 
 
 // the following implementation is only suited for the pc side, but must be different on the mote side
 #if INCLUDE_SERIAL_FORWARD_IMPLEMENTATION
 
+// a frame of the serial forwarder protocol: one length byte, then the message
+#define SF_MAX_FRAME 0xFF
+
+typedef struct {
+    // stays the same for the whole life of the interface, the connections are dup2'ed onto it
+    int fd;
+    bool connected;
+    // where the forwarder is, looked up once when opening
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    // the socket being connected while a timer stands in for fd, -1 if none
+    int pending;
+    bool version_sent;
+    unsigned steps;
+    // what came from the socket and was not given out yet
+    stream_t buf[SF_READ_BUFFER];
+    unsigned pos, used;
+} sf_source_t;
+
+#define SF(this) ((sf_source_t*)((this)->source))
+
+/**
+ * Wait for an fd with a timeout.
+ *
+ * @return true if the fd is ready
+ */
+bool _serialforwardif_t_wait(int fd, short events, int timeout_ms) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+    return poll(&pfd, 1, timeout_ms) == 1 && !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL));
+}
+
+/**
+ * Look up the forwarder.
+ *
+ * @return false if the host is not found
+ */
+bool _serialforwardif_t_resolve(sf_source_t* sf, char const* host, int port) {
+    struct addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &addrs)) {
+        LOG_WARNING("sf host '%s' not found", host);
+        return false;
+    }
+    memcpy(&sf->addr, addrs->ai_addr, addrs->ai_addrlen);
+    sf->addr_len = addrs->ai_addrlen;
+    freeaddrinfo(addrs);
+    return true;
+}
+
+/**
+ * Start connecting to the forwarder, without waiting for it.
+ *
+ * @return the socket, or -1
+ */
+int _serialforwardif_t_start(sf_source_t const* sf) {
+    int fd = socket(sf->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr const*)&sf->addr, sf->addr_len) && errno != EINPROGRESS) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * One step of a connection: first the socket gets connected and the protocol
+ * version is sent, then the version of the forwarder comes.
+ *
+ * @param version_sent whether the first step is done, updated
+ * @param timeout_ms how long to wait for the step
+ *
+ * @return 1 once connected, 0 if the step is not done yet, -1 if it failed
+ */
+int _serialforwardif_t_step(int fd, bool* version_sent, int timeout_ms) {
+    struct pollfd pfd = {.fd = fd, .events = *version_sent ? POLLIN : POLLOUT};
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (!ready) {
+        return 0;
+    }
+    if (ready < 0 || (pfd.revents & (POLLERR | POLLNVAL))) {
+        return -1;
+    }
+    if (!*version_sent) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) || error || write(fd, "U ", 2) != 2) {
+            return -1;
+        }
+        *version_sent = true;
+        return 0;
+    }
+    stream_t version[2];
+    if (read(fd, version, 2) != 2 || version[0] != 'U') {
+        return -1;
+    }
+    // we send a chunk at a time and want it to leave right away
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // reads do not block, sends do
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return 1;
+}
+
+/**
+ * Connect to the forwarder and exchange the protocol version, waiting at most timeout_ms for each step.
+ *
+ * @return the socket, or -1
+ */
+int _serialforwardif_t_connect(sf_source_t const* sf, int timeout_ms) {
+    int fd = _serialforwardif_t_start(sf);
+    if (fd < 0) {
+        return -1;
+    }
+    bool version_sent = false;
+    if (_serialforwardif_t_step(fd, &version_sent, timeout_ms) < 0 || !version_sent
+        || _serialforwardif_t_step(fd, &version_sent, timeout_ms) != 1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Arm a timer, once or every ms milliseconds.
+ */
+void _serialforwardif_t_arm(int timer, int ms, bool periodic) {
+    struct itimerspec when;
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = ms / 1000;
+    when.it_value.tv_nsec = (ms % 1000) * 1000000;
+    if (periodic) {
+        when.it_interval = when.it_value;
+    }
+    timerfd_settime(timer, 0, &when, NULL);
+}
+
+/**
+ * The forwarder went away. A timer takes the place of the socket, when it fires read tries to reconnect.
+ */
+void _serialforwardif_t_disconnected(sf_source_t* sf) {
+    if (sf->connected) {
+        LOG_WARNING("lost the connection to the serial forwarder, retrying every %d ms", SF_RECONNECT_INTERVAL_MS);
+    }
+    __atomic_store_n(&sf->connected, false, __ATOMIC_RELEASE);
+    sf->pos = sf->used = 0;
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    _serialforwardif_t_arm(timer, SF_RECONNECT_INTERVAL_MS, false);
+    dup2(timer, sf->fd);
+    close(timer);
+}
+
+/**
+ * Called when the timer set by _serialforwardif_t_disconnected fired.
+ * Nothing here waits, the timer ticks every SF_CONNECT_STEP_MS until the
+ * new connection is done or SF_CONNECT_TIMEOUT_MS passed.
+ */
+void _serialforwardif_t_reconnect(sf_source_t* sf) {
+    uint64_t expirations;
+    if (read(sf->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    if (sf->pending < 0) {
+        sf->pending = _serialforwardif_t_start(sf);
+        if (sf->pending < 0) {
+            _serialforwardif_t_disconnected(sf);
+            return;
+        }
+        sf->version_sent = false;
+        sf->steps = 0;
+        _serialforwardif_t_arm(sf->fd, SF_CONNECT_STEP_MS, true);
+    }
+    int state = _serialforwardif_t_step(sf->pending, &sf->version_sent, 0);
+    if (!state && ++sf->steps * SF_CONNECT_STEP_MS < SF_CONNECT_TIMEOUT_MS) {
+        return;
+    }
+    int fd = sf->pending;
+    sf->pending = -1;
+    if (state != 1) {
+        close(fd);
+        _serialforwardif_t_disconnected(sf);
+        return;
+    }
+    dup2(fd, sf->fd);
+    close(fd);
+    __atomic_store_n(&sf->connected, true, __ATOMIC_RELEASE);
+    LOG_NOTE("reconnected to the serial forwarder");
+}
+
 /**
  * @return The used file descriptor
  */
 int _serialforwardif_t_fd(serialif_t* this) {
     assert(this);
-    return this->source->fd;
+    return SF(this)->fd;
+}
+
+/**
+ * @return true if a complete frame is waiting in our buffer
+ */
+bool _serialforwardif_t_pending(serialif_t* this) {
+    assert(this);
+    sf_source_t* sf = SF(this);
+    return sf->used > sf->pos && sf->used - sf->pos > sf->buf[sf->pos];
 }
 
 /**
@@ -27,7 +237,8 @@ void _serialforwardif_t_ditch(serialif_t* this, payload_t* const payload) {
     assert(this);
     assert(payload);
     if (payload->stream) {
-        free((void*)(payload->stream));
+        // we gave out the slab just past the header
+        this->pool->put(this->pool, payload->stream - sizeof(struct message_header_mine_t));
         payload->stream = NULL;
     }
     payload->len = 0;
@@ -36,29 +247,40 @@ void _serialforwardif_t_ditch(serialif_t* this, payload_t* const payload) {
 /**
  * Implementation of serialif_t::send - do not call explicitly.
  *
- * @param payload What we are supposed to send. We promise not to change it.
+ * @param payload What we are supposed to send. We promise not to change it,
+ *                but we may use its headroom.
  */
 int _serialforwardif_t_send(serialif_t* this, payload_t const payload) {
     assert(this);
-    payload_t buf;
-    buf.len = sizeof(struct message_header_mine_t)+payload.len*sizeof(stream_t);
-    buf.stream = malloc(buf.len);
-    memset((void*)buf.stream,0,sizeof(struct message_header_mine_t));
-    struct message_header_mine_t* mh = (struct message_header_mine_t*)(buf.stream);
-    mh->destaddr = 0xFFFF;
-    mh->handlerid = 0;
-    mh->groupid = 0;
-    mh->amid = 0;
-    mh->msglen = payload.len;
-    memcpy((void*)(buf.stream + sizeof(struct message_header_mine_t)),payload.stream,payload.len*sizeof(stream_t));
-    // call the sf library for the dirty work
-    int result = write_sf_packet(this->source->fd,buf.stream,buf.len);
-    free((void*)(buf.stream));
-    return result;
+    sf_source_t* sf = SF(this);
+    if (!__atomic_load_n(&sf->connected, __ATOMIC_ACQUIRE)) {
+        LOG_DEBUG("not connected to the serial forwarder, dropping %u bytes", payload.len);
+        return -1;
+    }
+    payload_t buf = add_message_header(payload);
+    assert(buf.len <= SF_MAX_FRAME);
+    // length and message in one go
+    stream_t len = buf.len;
+    struct iovec iov[2] = {
+        {.iov_base = &len, .iov_len = 1},
+        {.iov_base = (void*)buf.stream, .iov_len = buf.len}
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    // a forwarder gone away must not kill us with a SIGPIPE
+    ssize_t written = sendmsg(sf->fd, &msg, MSG_NOSIGNAL);
+    if (written != (ssize_t)(buf.len + 1)) {
+        LOG_WARNING("could not write to the serial forwarder");
+        if (written < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+            _serialforwardif_t_disconnected(sf);
+        }
+        return -1;
+    }
+    return 0;
 }
 
 /**
  * Implementation of serialif_t::read - to not call explicitly.
+ * Every recv gets as much as there is, the frames are then given out one by one.
  *
  * @param payload A pointer to the variable WE ARE SUPPOSED TO PUT THE PAYLOAD.
  *                When you are done with it, please call serialif_t::ditch.
@@ -66,25 +288,51 @@ int _serialforwardif_t_send(serialif_t* this, payload_t const payload) {
  */
 void _serialforwardif_t_read(serialif_t* this, payload_t* const payload) {
     assert(this);
-    payload_t buf = {.stream = NULL, .len = 0};
-    buf.stream = read_sf_packet(this->source->fd,(int*)&(buf.len));
-    if (!buf.stream != !buf.len || buf.len < 8) {
-        if (buf.stream) {
-            free((void*)(buf.stream));
+    sf_source_t* sf = SF(this);
+    payload->len = 0;
+    payload->stream = NULL;
+
+    if (!sf->connected) {
+#if SERIAL_READER_THREAD
+        _serialforwardif_t_wait(sf->fd, POLLIN, -1);
+#endif
+        _serialforwardif_t_reconnect(sf);
+        return;
+    }
+
+    while (!_serialforwardif_t_pending(this)) {
+        // make room behind what is left
+        memmove(sf->buf, sf->buf + sf->pos, sf->used - sf->pos);
+        sf->used -= sf->pos;
+        sf->pos = 0;
+#if SERIAL_READER_THREAD
+        int flags = 0;
+#else
+        // the main loop must not wait for the rest of a frame
+        int flags = MSG_DONTWAIT;
+#endif
+        ssize_t got = recv(sf->fd, sf->buf + sf->used, SF_READ_BUFFER - sf->used, flags);
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
         }
-        buf.stream = NULL;
-        buf.len = 0;
-    }
-    payload->len = buf.len - 8;
-    payload->stream = (void*)(malloc(buf.len-8));
-    if (buf.stream) {
-        memcpy((void*)(payload->stream),(void*)(buf.stream+8),buf.len - 8);
-        free((void*)buf.stream);
-    } else {
-        payload->len = 0;
-        free((void*)(payload->stream));
-        payload->stream = NULL;
+        if (got <= 0) {
+            _serialforwardif_t_disconnected(sf);
+            return;
+        }
+        sf->used += got;
     }
+
+    unsigned len = sf->buf[sf->pos];
+    stream_t const* frame = sf->buf + sf->pos + 1;
+    sf->pos += 1 + len;
+    if (len < sizeof(struct message_header_mine_t)) {
+        return;
+    }
+    // the buffer is reused by the next recv, the pool slab lives until ditch
+    stream_t* slab = this->pool->get(this->pool);
+    memcpy(slab, frame, len);
+    payload->len = len - sizeof(struct message_header_mine_t);
+    payload->stream = slab + sizeof(struct message_header_mine_t);
 }
 
 /**
@@ -95,9 +343,15 @@ void _serialforwardif_t_read(serialif_t* this, payload_t* const payload) {
 void _serialforwardif_t_dtor(serialif_t* this) {
     assert(this);
     if (this->source) {
-        close(this->source->fd);
+        close(SF(this)->fd);
+        if (SF(this)->pending >= 0) {
+            close(SF(this)->pending);
+        }
         free(this->source);
     }
+    if (this->pool) {
+        DTOR(this->pool);
+    }
 }
 
 /**
@@ -112,17 +366,23 @@ void _serialforwardif_t_open(serialif_t* this, char const* dev, char* const plat
     assert((!this->source) && "source already created or uninitialised!");
     char const* const host = dev;
     LOG_NOTE("Using host: '%s' at port: '%d'",host,port);
-    int fd = open_sf_source(host,port);
+    sf_source_t* sf = malloc(sizeof(sf_source_t));
+    int fd = _serialforwardif_t_resolve(sf, host, port) ? _serialforwardif_t_connect(sf, SF_CONNECT_TIMEOUT_MS) : -1;
     if (ssm) {
         *(int*)ssm = fd >= 0;
     }
     if (fd >= 0) {
-        this->source = malloc(sizeof(struct serial_source_t)); // hack
-        this->source->fd = fd;
+        sf->fd = fd;
+        sf->connected = true;
+        sf->pending = -1;
+        sf->pos = sf->used = 0;
+        this->source = (serial_source)sf; // hack
+        this->pool = pool(NULL, SF_MAX_FRAME, SERIAL_POOL_SLABS);
     } else {
+        free(sf);
         LOG_ERROR("sf could not be opened");
         exit(1);
     }
 }
 
-#endif 
+#endif
@@ -8,4 +8,24 @@
 
 #include "serialif.h"
 
+/// bytes read from the forwarder at once, several frames fit in it
+#ifndef SF_READ_BUFFER
+#define SF_READ_BUFFER 4096
+#endif
+
+/// how long connecting to the forwarder may take
+#ifndef SF_CONNECT_TIMEOUT_MS
+#define SF_CONNECT_TIMEOUT_MS 200
+#endif
+
+/// how often a reconnection is looked after, it never waits on the main loop
+#ifndef SF_CONNECT_STEP_MS
+#define SF_CONNECT_STEP_MS 10
+#endif
+
+/// time between two attempts to reconnect when the forwarder went away
+#ifndef SF_RECONNECT_INTERVAL_MS
+#define SF_RECONNECT_INTERVAL_MS 1000
+#endif
+
 #endif
@@ -4,18 +4,61 @@
 #include <serialsource.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include "util.h"
+#include "pool.h"
+#include "hdlc.h"
 
 // the following implementation is only suited for the pc side, but must be different on the mote side
 #if INCLUDE_SERIAL_IMPLEMENTATION
 
-void _serialif_t_open_message(serial_source_msg problem);
+// msglen is only one byte, so this is enough for everything we can send
+#define SERIAL_MAX_MESSAGE (sizeof(struct message_header_mine_t) + 0xFF)
+
+// a frame on the wire waiting for its ack
+typedef struct {
+    stream_t frame[HDLC_ENCODED_SIZE(SERIAL_MAX_MESSAGE)];
+    unsigned len;
+    uint8_t seqno;
+    unsigned tries;
+    struct timespec sent;
+    // acknowledged, or given up on, it leaves when the ones before it are done too
+    bool done;
+} serial_unacked_t;
+
+typedef struct {
+    int fd;
+    // the reader thread and the main loop both read and write the device
+    pthread_mutex_t lock;
+    hdlc_decoder_t decoder;
+    stream_t buf[SERIAL_READ_BUFFER];
+    // sliding window, oldest frame first
+    serial_unacked_t window[SERIAL_WINDOW];
+    unsigned first, in_flight;
+    uint8_t next_seqno;
+    // messages received and not read yet, in pool slabs
+    pool_t* pool;
+    struct {
+        stream_t* slab;
+        unsigned len;
+    } received[SERIAL_RECEIVE_QUEUE];
+    unsigned rx_first, rx_count;
+} serial_link_t;
+
+#define LINK(this) ((serial_link_t*)((this)->source))
 
 /**
  * @return The used file descriptor
  */
 int _serialif_t_fd(serialif_t* this) {
     assert(this);
-    return this->source->fd;
+    return LINK(this)->fd;
 }
 
 /**
@@ -26,56 +69,236 @@ void _serialif_t_ditch(serialif_t* this, payload_t* const payload) {
     assert(this);
     assert(payload);
     if (payload->stream) {
-        free((void*)(payload->stream));
+        // we gave out a slab, just past the header
+        this->pool->put(this->pool, payload->stream - sizeof(struct message_header_mine_t));
         payload->stream = NULL;
     }
     payload->len = 0;
 }
 
-// allow asynchronous checking of the result of the serial_source library
-serial_source_msg* _serialif_t_open_message_target = NULL;
+payload_t add_message_header(payload_t const payload) {
+    static stream_t fallback[SERIAL_MAX_MESSAGE];
+    assert(payload.len <= 0xFF);
+    payload_t buf = {
+        .len = sizeof(struct message_header_mine_t) + payload.len*sizeof(stream_t)
+    };
+    if (payload.headroom >= sizeof(struct message_header_mine_t)) {
+        // the bytes in front of the payload are ours
+        buf.stream = payload.stream - sizeof(struct message_header_mine_t);
+    } else {
+        buf.stream = fallback;
+        memcpy(fallback + sizeof(struct message_header_mine_t), payload.stream, payload.len*sizeof(stream_t));
+    }
+    struct message_header_mine_t* mh = (struct message_header_mine_t*)(buf.stream);
+    mh->amid = 0;
+    mh->destaddr = 0xFFFF;
+    mh->sourceaddr = 0;
+    mh->msglen = payload.len;
+    mh->groupid = 0;
+    mh->handlerid = 0;
+    return buf;
+}
 
 /**
- * This handler is required by the serial_source library.
+ * Write everything, the device is non blocking.
  *
- * @param problem Will be set to the status of the serial open instruction
+ * @return false if the device is gone
+ */
+bool _serialif_t_write(serial_link_t* link, stream_t const* data, unsigned len) {
+    while (len) {
+        int done = write(link->fd, data, len);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return false;
+            }
+            struct pollfd pfd = {.fd = link->fd, .events = POLLOUT};
+            poll(&pfd, 1, SERIAL_ACK_TIMEOUT_MS);
+            continue;
+        }
+        data += done;
+        len -= done;
+    }
+    return true;
+}
+
+/**
+ * Move the window past the frames at its start that are done.
+ */
+void _serialif_t_slide(serial_link_t* link) {
+    while (link->in_flight && link->window[link->first].done) {
+        link->first = (link->first + 1) % SERIAL_WINDOW;
+        link->in_flight--;
+    }
+}
+
+/**
+ * The mote got the frame with that seqno. The mote acks every frame on its
+ * own, so the frames before it may still be lost and wait for their timeout.
+ */
+void _serialif_t_acked(serial_link_t* link, uint8_t seqno) {
+    for (unsigned i = 0; i < link->in_flight; i++) {
+        serial_unacked_t* u = &link->window[(link->first + i) % SERIAL_WINDOW];
+        if (u->seqno == seqno) {
+            u->done = true;
+            break;
+        }
+    }
+    // otherwise an ack we already had, or for a frame we gave up on
+    _serialif_t_slide(link);
+}
+
+/**
+ * Keep a message until serialif_t::read is called.
+ */
+void _serialif_t_received(serial_link_t* link, stream_t const* message, unsigned len) {
+    if (len < sizeof(struct message_header_mine_t) || len > SERIAL_MAX_MESSAGE) {
+        LOG_DEBUG("dropping a serial message of %u bytes", len);
+        return;
+    }
+    if (link->rx_count == SERIAL_RECEIVE_QUEUE) {
+        LOG_WARNING("serial receive queue full, dropping a message");
+        return;
+    }
+    stream_t* slab = link->pool->get(link->pool);
+    memcpy(slab, message, len);
+    unsigned last = (link->rx_first + link->rx_count++) % SERIAL_RECEIVE_QUEUE;
+    link->received[last].slab = slab;
+    link->received[last].len = len;
+}
+
+/**
+ * Handler of the frames found by the decoder.
+ */
+void _serialif_t_frame(void* p, uint8_t protocol, stream_t const* frame, unsigned len) {
+    serial_link_t* link = p;
+    switch (protocol) {
+    case HDLC_P_ACK:
+        if (len >= 1) {
+            _serialif_t_acked(link, frame[0]);
+        }
+        break;
+    case HDLC_P_PACKET_ACK:
+        if (len < 1) {
+            break;
+        } else {
+            stream_t ack[HDLC_ENCODED_SIZE(0)];
+            _serialif_t_write(link, ack, hdlc_encode(ack, HDLC_P_ACK, frame[0], NULL, 0));
+            _serialif_t_received(link, frame + 1, len - 1);
+        }
+        break;
+    case HDLC_P_PACKET_NO_ACK:
+        _serialif_t_received(link, frame, len);
+        break;
+    default:
+        LOG_DEBUG("unknown serial protocol %02X", protocol);
+    }
+}
+
+/**
+ * Take in whatever the device has, acks included. Call it with the lock held.
+ */
+void _serialif_t_pump(serial_link_t* link) {
+    int got;
+    while ((got = read(link->fd, link->buf, sizeof(link->buf))) > 0) {
+        hdlc_decode(&link->decoder, link->buf, got, _serialif_t_frame, link);
+    }
+}
+
+/**
+ * @return milliseconds since a point in time
+ */
+long _serialif_t_ms_since(struct timespec const* then) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/**
+ * Selective repeat: every frame not acknowledged in time is sent again, the
+ * ones acknowledged after it are not. Call it with the lock held.
  */
-void _serialif_t_open_message(serial_source_msg problem) {
-    if (_serialif_t_open_message_target) {
-        *_serialif_t_open_message_target = problem;
+void _serialif_t_retransmit(serial_link_t* link) {
+    for (unsigned i = 0; i < link->in_flight; i++) {
+        serial_unacked_t* u = &link->window[(link->first + i) % SERIAL_WINDOW];
+        if (u->done || _serialif_t_ms_since(&u->sent) < SERIAL_ACK_TIMEOUT_MS) {
+            continue;
+        }
+        if (u->tries >= SERIAL_MAX_TRIES) {
+            LOG_WARNING("no ack for serial frame %u, giving up on it", u->seqno);
+            u->done = true;
+            continue;
+        }
+        _serialif_t_write(link, u->frame, u->len);
+        clock_gettime(CLOCK_MONOTONIC, &u->sent);
+        u->tries++;
     }
+    _serialif_t_slide(link);
+}
+
+/**
+ * Wait a little for the device without holding the lock, then take in what came.
+ */
+void _serialif_t_wait(serial_link_t* link, int timeout_ms) {
+    pthread_mutex_unlock(&link->lock);
+    struct pollfd pfd = {.fd = link->fd, .events = POLLIN};
+    poll(&pfd, 1, timeout_ms);
+    pthread_mutex_lock(&link->lock);
+    _serialif_t_pump(link);
+    _serialif_t_retransmit(link);
 }
 
 /**
  * Implementation of serialif_t::send - do not call explicitly.
+ * Returns as soon as the frame is on the wire, only waits when the window is full.
  *
- * @param payload What we are supposed to send. We promise not to change it.
+ * @param payload What we are supposed to send. We promise not to change it,
+ *                but we may use its headroom.
  */
 int _serialif_t_send(serialif_t* this, payload_t const payload) {
     assert(this);
-    payload_t buf;
-    if (payload.stream) {
-        buf.len = sizeof(struct message_header_mine_t)+payload.len*sizeof(stream_t);
-        buf.stream = malloc(buf.len);
-        memset((void*)buf.stream,0,sizeof(struct message_header_mine_t));
-        struct message_header_mine_t* mh = (struct message_header_mine_t*)(buf.stream);
-        mh->destaddr = 0xFFFF;
-        mh->handlerid = 0;
-        mh->groupid = 0;
-        mh->amid = 0;
-        mh->msglen = payload.len;
-        memcpy((void*)(buf.stream + sizeof(struct message_header_mine_t)),payload.stream,payload.len*sizeof(stream_t));
-        // call the serial_source library for the dirty work
-        int result = write_serial_packet(this->source,buf.stream,buf.len);
-        free((void*)(buf.stream));
-        return result;
-    }
-    
-    return 0;
+    if (!payload.stream) {
+        return 0;
+    }
+    payload_t buf = add_message_header(payload);
+    serial_link_t* link = LINK(this);
+    pthread_mutex_lock(&link->lock);
+    _serialif_t_pump(link);
+    _serialif_t_retransmit(link);
+    while (link->in_flight == SERIAL_WINDOW) {
+        _serialif_t_wait(link, SERIAL_ACK_TIMEOUT_MS);
+    }
+
+    serial_unacked_t* u = &link->window[(link->first + link->in_flight++) % SERIAL_WINDOW];
+    u->seqno = link->next_seqno++;
+    u->len = hdlc_encode(u->frame, HDLC_P_PACKET_ACK, u->seqno, buf.stream, buf.len);
+    u->tries = 1;
+    u->done = false;
+    clock_gettime(CLOCK_MONOTONIC, &u->sent);
+    bool written = _serialif_t_write(link, u->frame, u->len);
+    pthread_mutex_unlock(&link->lock);
+    return written ? (int)buf.len : -1;
+}
+
+/**
+ * Implementation of serialif_t::pending - do not call explicitly.
+ *
+ * @return true if messages were received and not read yet
+ */
+bool _serialif_t_pending(serialif_t* this) {
+    serial_link_t* link = LINK(this);
+    pthread_mutex_lock(&link->lock);
+    bool pending = link->rx_count > 0;
+    pthread_mutex_unlock(&link->lock);
+    return pending;
 }
 
 /**
  * Implementation of serialif_t::read - to not call explicitly.
+ * Without the reader thread it does not wait, so it gives nothing back
+ * when only acks or a piece of a frame were there.
  *
  * @param payload A pointer to the variable WE ARE SUPPOSED TO PUT THE PAYLOAD.
  *                When you are done with it, please call serialif_t::ditch.
@@ -83,24 +306,28 @@ int _serialif_t_send(serialif_t* this, payload_t const payload) {
  */
 void _serialif_t_read(serialif_t* this, payload_t* const payload) {
     assert(this);
-    payload_t buf = {.stream = NULL, .len = 0};
-    buf.stream = read_serial_packet(this->source,(int*)&(buf.len));
-    if (!buf.stream != !buf.len || buf.len < 8) {
-        if (buf.stream) {
-            free((void*)(buf.stream));
-        }
-        buf.stream = NULL;
-        buf.len = 0;
-    }
-    payload->len = buf.len - 8;
-    payload->stream = (void*)(malloc(buf.len-8));
-    if (buf.stream) {
-        memcpy((void*)(payload->stream),(void*)(buf.stream+8),buf.len - 8);
-        free((void*)buf.stream);
-    } else {
+    serial_link_t* link = LINK(this);
+    pthread_mutex_lock(&link->lock);
+    _serialif_t_pump(link);
+    _serialif_t_retransmit(link);
+#if SERIAL_READER_THREAD
+    // this also runs the retransmissions when the main loop has nothing to send
+    while (!link->rx_count) {
+        _serialif_t_wait(link, SERIAL_READER_POLL_MS);
+    }
+#endif
+    if (!link->rx_count) {
+        pthread_mutex_unlock(&link->lock);
         payload->len = 0;
         payload->stream = NULL;
+        return;
     }
+    // no need to copy, the payload just starts after the header
+    payload->len = link->received[link->rx_first].len - sizeof(struct message_header_mine_t);
+    payload->stream = link->received[link->rx_first].slab + sizeof(struct message_header_mine_t);
+    link->rx_first = (link->rx_first + 1) % SERIAL_RECEIVE_QUEUE;
+    link->rx_count--;
+    pthread_mutex_unlock(&link->lock);
 }
 
 /**
@@ -111,26 +338,86 @@ void _serialif_t_read(serialif_t* this, payload_t* const payload) {
 void _serialif_t_dtor(serialif_t* this) {
     assert(this);
     if (this->source) {
-        close_serial_source(this->source);
+        serial_link_t* link = LINK(this);
+        close(link->fd);
+        pthread_mutex_destroy(&link->lock);
+        free(link);
+        this->source = NULL;
+    }
+    if (this->pool) {
+        DTOR(this->pool);
+        this->pool = NULL;
     }
 }
 
+/**
+ * @return the termios speed of a baud rate, B0 if there is none
+ */
+speed_t _serialif_t_speed(int baud) {
+    static struct {
+        int baud;
+        speed_t speed;
+    } const speeds[] = {
+        {9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600},
+        {115200, B115200}, {230400, B230400}, {460800, B460800}, {921600, B921600}
+    };
+    for (unsigned i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+        if (speeds[i].baud == baud) {
+            return speeds[i].speed;
+        }
+    }
+    return B0;
+}
+
 /**
  * Implementation of serialif_t::open - do not call it explicitly.
+ * The device is put in raw mode, the framing is done by us.
  *
  * @param dev Used hardware device (e.g. /dev/ttyUSB0)
  * @param platform Used mote hardware (e.g. telosb)
  * @param ssm Optional pointer to a variable to hold errors thay may be produced. Set to NULL if you don't care.
  */
 void _serialif_t_open(serialif_t* this, char const* dev, char* const platform, serial_source_msg* ssm) {
-    serial_source_msg _ssm = 128;
-    _serialif_t_open_message_target = &_ssm;
-    this->source = open_serial_source(dev,platform_baud_rate(platform),READ_NON_BLOCKING,_serialif_t_open_message);
-    _serialif_t_open_message_target = NULL;
-    this->msg = _ssm;
+    this->msg = msg_unix_error;
+    if (ssm) {
+        *ssm = this->msg;
+    }
+    speed_t speed = _serialif_t_speed(platform_baud_rate(platform));
+    if (speed == B0) {
+        LOG_ERROR("unknown baud rate for platform %s", platform);
+        return;
+    }
+    int fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        return;
+    }
+    struct termios tio;
+    if (tcgetattr(fd, &tio)) {
+        close(fd);
+        return;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if (tcsetattr(fd, TCSANOW, &tio)) {
+        close(fd);
+        return;
+    }
+    tcflush(fd, TCIOFLUSH);
+
+    serial_link_t* link = malloc(sizeof(serial_link_t));
+    memset(link, 0, sizeof(serial_link_t));
+    link->fd = fd;
+    pthread_mutex_init(&link->lock, NULL);
+    hdlc_decoder_init(&link->decoder);
+    this->pool = pool(NULL, SERIAL_MAX_MESSAGE, SERIAL_POOL_SLABS);
+    link->pool = this->pool;
+    this->source = (serial_source)link; // hack, like the other interfaces
+    this->msg = 0;
     if (ssm) {
-        *ssm = _ssm;
+        *ssm = this->msg;
     }
 }
 
-#endif 
+#endif
@@ -10,42 +10,37 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#ifndef SERIAL_FORCE_ACK_SLEEP_US
-#define SERIAL_FORCE_ACK_SLEEP_US 500
+/// receive buffers kept by the interfaces that use a pool
+#ifndef SERIAL_POOL_SLABS
+#define SERIAL_POOL_SLABS 16
 #endif
 
-// note: the serialif_t type is defined in motecomm.h for historical and not so obvious reasons
+/// frames that can be on the wire without being acknowledged, 1 is stop and wait
+#ifndef SERIAL_WINDOW
+#define SERIAL_WINDOW 4
+#endif
+
+/// time after which the frames not acknowledged are sent again
+#ifndef SERIAL_ACK_TIMEOUT_MS
+#define SERIAL_ACK_TIMEOUT_MS 100
+#endif
+
+/// times a frame is sent before giving up on it
+#ifndef SERIAL_MAX_TRIES
+#define SERIAL_MAX_TRIES 5
+#endif
+
+/// bytes taken from the device at once, one read can carry many frames
+#ifndef SERIAL_READ_BUFFER
+#define SERIAL_READ_BUFFER 16384
+#endif
 
-/****** copied from serialsource.c ******/
-/****** DO NOT MODIFY! ******/
-#define BUFSIZE 256
-#define MTU 256
-struct serial_source_t {
-#ifndef LOSE32
-  int fd;
-#else
-  HANDLE h_comm;
+/// messages received and not read yet, the rest is dropped
+#ifndef SERIAL_RECEIVE_QUEUE
+#define SERIAL_RECEIVE_QUEUE SERIAL_POOL_SLABS
 #endif
-  bool non_blocking;
-  void (*message)(serial_source_msg problem);
-
-  /* Receive state */
-  struct {
-    uint8_t buffer[BUFSIZE];
-    int bufpos, bufused;
-    uint8_t packet[MTU];
-    bool in_sync, escaped;
-    int count;
-    struct packet_list *queue[256]; // indexed by protocol
-  } recv;
-  struct {
-    uint8_t seqno;
-    uint8_t *escaped;
-    int escapeptr;
-    uint16_t crc;
-  } send;
-};
-/****** END (serialsource.c) ******/
+
+// note: the serialif_t type is defined in motecomm.h for historical and not so obvious reasons
 
 // local recreation of the message_t header
 // XXX this is some sort of hack, and we should probably just include message.h
@@ -59,4 +54,17 @@ struct message_header_mine_t {
     uint8_t handlerid;
 }  __attribute__((packed));
 
+#include "structs.h"
+
+/**
+ * Put the message header in front of a payload. The header is written into
+ * the headroom of the payload if there is enough, so nothing is copied.
+ * Otherwise the message is built in a static buffer, valid until the next call.
+ *
+ * @param payload what is to be sent
+ *
+ * @return the complete message
+ */
+payload_t add_message_header(payload_t const payload);
+
 #endif
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/signalfd.h>
 
 #include "motecomm.h"
 #include "chunker.h"
@@ -13,18 +14,22 @@
 #include "glue.h"
 #include "setup.h"
 #include "compress.h"
-
-char* tun_active;
+#include "headercomp.h"
+#include "workers.h"
+#include "sender.h"
+#include "flow.h"
+#include "reader.h"
+#include "bundle.h"
+#include "control.h"
+#include "qos.h"
+#include "mss.h"
 
 serialif_t* sif_used;
 
-void serial_buffer_full(void) {
-    *tun_active = 0;
-}
-
-void serial_buffer_empty(void) {
-    *tun_active = 1;
-}
+// the motes after the first one, which is the one of the mcp
+static motecomm_t* extra_links[SENDER_MAX_LINKS - 1];
+static unsigned num_extra_links = 0;
+static int limits_signal_fd = -1;
 
 void _close_everything(int param) {
     LOG_DEBUG("closing all open file descriptors");
@@ -36,10 +41,60 @@ void _close_everything(int param) {
     exit(EXIT_SUCCESS);
 }
 
+/**
+ * Listen to what comes from a mote.
+ */
+void _init_link(fdglue_t* g, motecomm_t* mc) {
+#if SERIAL_READER_THREAD
+    init_reader(g, mc);
+#else
+    fdglue_handler_t hand_sif = {
+        .p = mc,
+        .handle = serial_receive
+    };
+    g->set_handler(g, mc->serialif.fd(&mc->serialif), FDGHT_READ, hand_sif, FDGHR_APPEND, NULL);
+#endif
+}
+
+/**
+ * Invoked by the glue module on SIGHUP, reads the rate limits again.
+ */
+void _reload_limits(fdglue_handler_t* that) {
+    (void)that;
+    struct signalfd_siginfo info;
+    if (read(limits_signal_fd, &info, sizeof(info)) != sizeof(info)) {
+        return;
+    }
+    LOG_NOTE("reloading the rate limits from %s", SENDER_LIMITS_FILE);
+    if (!sender_load_limits(SENDER_LIMITS_FILE)) {
+        LOG_WARNING("could not read %s, nothing is limited", SENDER_LIMITS_FILE);
+    }
+}
+
+/**
+ * SIGHUP is read from the glue loop instead of interrupting it.
+ * Must be done before any thread is started, they inherit the blocked signal.
+ */
+void _init_limits_signal(fdglue_t* g) {
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigprocmask(SIG_BLOCK, &hup, NULL);
+    limits_signal_fd = signalfd(-1, &hup, SFD_NONBLOCK);
+    if (limits_signal_fd == -1) {
+        LOG_ERROR("could not create the signalfd for the rate limits");
+        exit(1);
+    }
+    fdglue_handler_t hand_hup = {
+        .p = NULL,
+        .handle = _reload_limits
+    };
+    g->set_handler(g, limits_signal_fd, FDGHT_READ, hand_hup, FDGHR_APPEND, NULL);
+}
+
 void init_glue(fdglue_t* g, serialif_t* sif, mcp_t* mcp, int client_no) {
-    tun_active = NULL;
-    
     fdglue(g);
+    _init_limits_signal(g);
 
     // structures for the handlers, it's an event driven program
     // so we need to setup handlers
@@ -47,17 +102,32 @@ void init_glue(fdglue_t* g, serialif_t* sif, mcp_t* mcp, int client_no) {
     thi->client_no = client_no;
     thi->mcomm = mcp->get_comm(mcp);
 
-    fdglue_handler_t hand_sif = {
-        .p = mcp,
-        .handle = serial_receive
-    };
     fdglue_handler_t hand_thi = {
         .p = thi,
         .handle = tun_receive
     };
+    // the tun is always read, the packets wait in the priority queues
+    g->set_handler(g, get_fd(client_no), FDGHT_READ, hand_thi, FDGHR_APPEND, NULL);
+    init_qos();
+
+    // compression happens in the workers, the chunks are then sent at the pace of the timer
+    init_workers(g, sender_kick);
+    init_sender(g, thi->mcomm, SERIAL_INTERVAL_US, tun_feed);
+    // missing chunks are asked for again, the NACKs go out with the chunks
+    init_feedback(g, sender_send_control);
+#if BUNDLING_ENABLED
+    init_bundling(g, tun_feed);
+#endif
 
-    g->set_handler(g, sif->fd(sif), FDGHT_READ, hand_sif, FDGHR_APPEND,NULL);
-    g->set_handler(g, get_fd(client_no), FDGHT_READ, hand_thi, FDGHR_APPEND, &tun_active);
+    _init_link(g, thi->mcomm);
+    for (unsigned i = 0; i < num_extra_links; i++) {
+        _init_link(g, extra_links[i]);
+        sender_add_link(extra_links[i]);
+    }
+    // now that all the links are there
+    if (!sender_load_limits(SENDER_LIMITS_FILE)) {
+        LOG_INFO("no %s, the rate is not limited", SENDER_LIMITS_FILE);
+    }
 
     sif_used = sif;
 }
@@ -67,6 +137,8 @@ void main_loop(fdglue_t *fdg) {
     signal(SIGINT, _close_everything);
     LOG_DEBUG("Initialize the compression module");
     init_compression();
+    init_header_compression();
+    init_flows();
 
     unsigned lcount = 0;
     (void)lcount;
@@ -74,6 +146,7 @@ void main_loop(fdglue_t *fdg) {
     for (;;) {
         LOG_INFO("listening %d ...",lcount++);
         print_statistics();
+        qos_print_statistics();
         // NOTE: this is just an arbitrary sleep interval
         // if we wait for 5 minutes and did not receive a single packet,
         // this loop will just reiterate (printing stats and so on)
@@ -81,16 +154,19 @@ void main_loop(fdglue_t *fdg) {
     }
 }
 
-// a wrapper for mcp::receive that will be understood by the fdglue module
+// a wrapper for motecomm_t::read that will be understood by the fdglue module
 void serial_receive(fdglue_handler_t* that) {
-    mcp_t* this = (mcp_t*)(that->p);
-    this->get_comm(this)->read(this->get_comm(this));
+    motecomm_t* this = (motecomm_t*)(that->p);
+    this->read(this);
 }
 
 // function to overwrite the handler and process data from serial 
+// p of the handler is the motecomm_t it belongs to
 void serial_process(struct motecomm_handler_t *that, payload_t const payload) {
-    (void)that;
-    //LOG_DEBUG("hey I got something from the mote! p is %p",that->p);
+    if (is_control(payload)) {
+        handle_control((motecomm_t*)that->p, payload);
+        return;
+    }
     add_chunk(payload);
 }
 
@@ -118,18 +194,42 @@ void reconstruct_done(payload_t complete) {
     static unsigned recv_count = 0;
     LOG_NOTE(" => Checksum of RECV %u packet is %08X", recv_count++, sum);
 
+#if HEADER_COMPRESSION_ENABLED
+    // restore the headers stripped by the other side
+    static stream_t restored_data[MAX_FRAME_SIZE];
+    payload_t restored = {
+        .len = MAX_FRAME_SIZE,
+        .stream = restored_data
+    };
+    if (!header_decompress(complete, &restored)) {
+        LOG_WARNING("dropping packet, its header compression context is unknown");
+        return;
+    }
+    complete = restored;
+#endif
+
+    // the SYNs coming from the other side are clamped as well
+    mss_clamp((stream_t*)complete.stream, complete.len);
     tun_write(DEFAULT_CLIENT_NO, complete);
 }
 
-serialif_t *create_serial_connection(char const *dev, mcp_t **mcp) {
+serialif_t *create_serial_connection(char const *devs, mcp_t **mcp) {
     char mote[] = "telosb";
     serialif_t *sif = NULL;
 
+    // several motes are separated by commas, the first one is the main one
+    char dev[strlen(devs) + 1];
+    strcpy(dev, devs);
+    char* more = strchr(dev, ',');
+    if (more) {
+        *more++ = 0;
+    }
+
     *mcp = open_mcp_connection(dev, mote, &sif);
     // XXX HACK:
     motecomm_t* mc = (*mcp)->get_comm(*mcp);
     mc->set_handler(mc,(motecomm_handler_t) {
-            .p = 0,
+            .p = mc,
                 .receive = serial_process
                 });
 
@@ -141,6 +241,29 @@ serialif_t *create_serial_connection(char const *dev, mcp_t **mcp) {
         LOG_ERROR("There was an error opening the connection to %s over device %s.", mote, dev);
         exit(1);
     }
+
+    for (char* next = more; next && *next; next = more) {
+        more = strchr(next, ',');
+        if (more) {
+            *more++ = 0;
+        }
+        if (num_extra_links == SENDER_MAX_LINKS - 1) {
+            LOG_ERROR("Too many devices, at most %d can be used.", SENDER_MAX_LINKS);
+            exit(1);
+        }
+        serialif_t* extra = serialif(NULL, next, mote, NULL);
+        if (!extra) {
+            LOG_ERROR("There was an error opening the connection to %s over device %s.", mote, next);
+            exit(1);
+        }
+        motecomm_t* link = motecomm(NULL, extra);
+        link->set_handler(link,(motecomm_handler_t) {
+                .p = link,
+                    .receive = serial_process
+                    });
+        extra_links[num_extra_links++] = link;
+        LOG_INFO("Connection to %s over device %s opened as link %u.", mote, next, num_extra_links);
+    }
     return sif;
 }
 
@@ -153,7 +276,7 @@ serialif_t *create_sf_connection(char const* host, char const* port, mcp_t **_mc
     motecomm_t* mc = motecomm(NULL,sif);
     *_mcp = mcp(NULL, mc);
     mc->set_handler(mc,(motecomm_handler_t) {
-            .p = 0,
+            .p = mc,
                 .receive = serial_process
                 });
 
@@ -176,7 +299,7 @@ serialif_t* create_fifo_connection(mcp_t** _mcp) {
     *_mcp = mcp(NULL, mc);
 
     mc->set_handler(mc,(motecomm_handler_t) {
-            .p = 0,
+            .p = mc,
                 .receive = serial_process
                 });
 
@@ -194,72 +317,128 @@ serialif_t* create_fifo_connection(mcp_t** _mcp) {
 // receiving data from the tunnel device
 void tun_receive(fdglue_handler_t* that) {
     struct Tun_handler_info* this = (struct Tun_handler_info*)(that->p);
+
     // allocated only once and always reused!!
     static stream_t buf[MAX_FRAME_SIZE];
-    memset(buf, 0, MAX_FRAME_SIZE);
-    int size = tun_read(this->client_no, (char*)buf,MAX_FRAME_SIZE);
-    assert(size);
-    static seq_no_t seqno = 0;
-    ++seqno;
+    int size = tun_read(this->client_no, (char*)buf, MAX_FRAME_SIZE);
+    if (!size) {
+        return;
+    }
+    mss_clamp(buf, size);
     payload_t payload = {
         .stream = buf,
-        .len = size,
-        .is_compressed = false
+        .len = size
     };
+    qos_enqueue(payload);
+    tun_feed();
+}
 
+/**
+ * Set the flow related fields of a frame the packet starts.
+ */
+void _tun_set_flow(frame_t* frame, payload_t const payload) {
+    frame->has_flow = flow_parse(payload, &frame->flow);
 #if COMPRESSION_ENABLED
-    // replace the payload with another payload
-    static stream_t compr_data[MAX_FRAME_SIZE];
-    payload_t compressed = {
-        .len = MAX_FRAME_SIZE,
-        .stream = compr_data,
+    // don't waste time deflating flows which never got smaller
+    frame->compress = !frame->has_flow || flow_should_compress(&frame->flow);
+    if (!frame->compress) {
+        LOG_DEBUG("not compressing, the flow of the packet is not compressible");
+    }
+#else
+    // the sender still wants to know the flow
+    frame->compress = false;
+#endif
+}
+
+/**
+ * Write the packet into the frame, header compressed if that is enabled.
+ *
+ * @param offset where the packet goes in frame->raw
+ *
+ * @return the length written, 0 if the packet does not fit
+ */
+streamlen_t _tun_write_packet(frame_t* frame, streamlen_t offset, payload_t const payload) {
+#if HEADER_COMPRESSION_ENABLED
+    // small packets are mostly headers, so get rid of them first
+    // this has to happen here and not in the workers, the contexts depend on the order of the packets
+    payload_t stripped = {
+        .len = MAX_FRAME_SIZE - offset,
+        .stream = frame->raw + offset
     };
-    
-    // we'll overwrite it when done
-    payload_compress(payload, &compressed);
-    // overwrite the current value ONLY if has to be compressed
-    if (compressed.len < payload.len) {
-        LOG_DEBUG("enabling compression");
-        print_gained(payload.len, compressed.len);
-        // should we alloc - memcpy - free instead?
-        copy_payload(&compressed, &payload);
-        size = payload.len;
-        payload.is_compressed = true;
-    } else {
-        LOG_DEBUG("compression disabled, non compressible data");
+    if (!header_compress(payload, &stripped)) {
+        return 0;
+    }
+    LOG_DEBUG("header compression: %u -> %u bytes", payload.len, stripped.len);
+    return stripped.len;
+#else
+    if (payload.len > MAX_FRAME_SIZE - offset) {
+        return 0;
     }
-            
+    memcpy(frame->raw + offset, payload.stream, payload.len);
+    return payload.len;
+#endif
+}
+
+/**
+ * Compress the headers of a packet and add it to the frame,
+ * which is submitted unless it is a bundle waiting for more packets.
+ */
+void _tun_to_frame(frame_t* frame, payload_t const payload) {
+#if BUNDLING_ENABLED
+    // if a bundle is open, the packet goes behind the ones already in it
+    streamlen_t offset = bundle_offset();
+#else
+    streamlen_t offset = 0;
 #endif
-    {
-        unsigned sum = 0;
-        if (DEBUG) {
-            for (stream_t* p = buf; p - buf < size; p++) {
-                sum += *p;
-            }
+
+    if (!offset) {
+        _tun_set_flow(frame, payload);
+    }
+    streamlen_t len = _tun_write_packet(frame, offset, payload);
+
+#if BUNDLING_ENABLED
+    if (!len && offset) {
+        // no room left behind the bundle, it goes now and the packet gets a frame of its own
+        submit_frame(bundle_flush());
+        frame = get_free_frame();
+        if (!frame) {
+            LOG_WARNING("no free frame left after closing the bundle, packet of %u bytes dropped", payload.len);
+            return;
         }
-        static unsigned sent_count = 0;
-        LOG_NOTE("<= Checksum of SENT packet %u is %08X",sent_count++,sum);
+        _tun_set_flow(frame, payload);
+        len = _tun_write_packet(frame, 0, payload);
+    }
+#endif
+    if (!len) {
+        LOG_WARNING("packet of %u bytes does not fit in a frame, dropped", payload.len);
+        return;
     }
 
-    my_packet pkt;
-    unsigned sendsize = 0;
-    int no_chunks = needed_chunks(size);
-    char chunks_left;
-
-    // generate all the subchunks and send them out
-    do {
-        usleep(SERIAL_INTERVAL_US);
-        chunks_left = gen_packet(&payload, &pkt, &sendsize, seqno, no_chunks);
-        assert(sendsize);
-        LOG_DEBUG("Sending ord_no: %u (seq_no: %u)",(unsigned)pkt.packet_header.ord_no, (unsigned)pkt.packet_header.seq_no);
-        
-        payload_t to_send = {
-            .stream = (stream_t*)&pkt,
-            .len = sendsize
-        };
+#if BUNDLING_ENABLED
+    if (!bundle_append(frame, len)) {
+        // waiting for more small packets
+        return;
+    }
+#else
+    frame->len = len;
+#endif
 
-        this->mcomm->send(this->mcomm, to_send);
-        sendsize = 0;
+    submit_frame(frame);
+}
 
-    } while (chunks_left);
+void tun_feed(void) {
+    static stream_t buf[MAX_FRAME_SIZE];
+    frame_t* frame;
+    // the queues are left as late as possible, so that the urgent packets can still go first
+    while (qos_queued() && pending_frames() < QOS_PIPELINE_DEPTH && (frame = get_free_frame())) {
+        payload_t payload = {
+            .stream = buf,
+            .len = MAX_FRAME_SIZE
+        };
+        if (!qos_dequeue(&payload)) {
+            // everything left was dropped by codel
+            break;
+        }
+        _tun_to_frame(frame, payload);
+    }
 }
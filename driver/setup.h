@@ -6,9 +6,9 @@
 #include "glue.h"
 #include "motecomm.h"
 
-// interval between two transmissions in micro seconds
-// this value was roughly determined by testing smaller values may work
-// this value may depend on the topology.
+// interval between two transmissions in micro seconds, to start with
+// this value was roughly determined by testing, the sender then adapts it
+// to the radio queue reported by every mote (see sender.h)
 #define SERIAL_INTERVAL_US 40000
 
 /**
@@ -36,6 +36,17 @@ void la_set(laep_handler_t* this, la_t const address);
  */
 void tun_receive(fdglue_handler_t* that);
 
+/**
+ * Move the packets waiting in the priority queues into the pipeline, as long
+ * as it is short. To be called whenever a frame left it.
+ */
+void tun_feed(void);
+
+/**
+ * Write a packet the reconstruction completed to the tun.
+ */
+void reconstruct_done(payload_t complete);
+
 /**
  * Invoked by the glue module when something comes in from the serial fd.
  */
@@ -62,7 +73,8 @@ void call_script(char *script_cmd, char *success, char *err, int is_fatal);
 void init_glue(fdglue_t* g, serialif_t* sif, mcp_t* mcp, int client_no);
 
 /// helper functions to set up different serial connections
-serialif_t *create_serial_connection(char const *dev, mcp_t **mcp);
+/// create_serial_connection takes a list of devices separated by commas, the chunks are spread over all of them
+serialif_t *create_serial_connection(char const *devs, mcp_t **mcp);
 serialif_t *create_sf_connection(char const* host, char const* port, mcp_t **mcp);
 serialif_t *create_fifo_connection(mcp_t** _mcp);
 
@@ -57,7 +57,7 @@ my_packet_header *get_header(my_packet *packet) {
 }
 
 bool is_compressed(my_packet *packet) {
-    return get_header(packet)->is_compressed;
+    return (get_header(packet)->flags & CHUNK_COMPRESSED) != 0;
 }
 
 bool is_last(my_packet *packet) {
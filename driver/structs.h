@@ -5,6 +5,9 @@
 #ifndef STRUCTS_H
 #define STRUCTS_H
 
+// IFF_TUN and IFF_TAP
+#include <linux/if_tun.h>
+
 // For the usage of additional headers MAX_CARRIED has to be smaller
 #define MAX_CARRIED (TOSH_DATA_LENGTH - sizeof(my_packet_header))
 #define TOT_PACKET_SIZE(payload_len) (sizeof(my_packet_header) + payload_len)
@@ -17,14 +20,20 @@
  */
 #define TUNTAP_INTERFACE IFF_TUN
 
-#if TUNTAP_INTERFACE == IFF_TAP
-#define MAX_FRAME_SIZE 2048
-#elif TUNTAP_INTERFACE == IFF_TUN
-#define MAX_FRAME_SIZE 65536
-#else
+#if TUNTAP_INTERFACE != IFF_TAP && TUNTAP_INTERFACE != IFF_TUN
 #error "Unsupported tun/tap interface."
 #endif
 
+/// the reconstruction keeps track of the chunks of a frame in a bitmask of a long
+#define MAX_FRAME_CHUNKS 64
+
+/**
+ * The biggest packet read from the tun/tap and the biggest frame sent.
+ * Bigger than the default MTU (1500) or an ethernet frame, with what the
+ * header compression and the bundling add to it.
+ */
+#define MAX_FRAME_SIZE (MAX_FRAME_CHUNKS * MAX_CARRIED)
+
 /// how many clients can the gateway manage
 #define MAX_CLIENTS 10
 
@@ -42,11 +51,14 @@ typedef unsigned int streamlen_t;
 
 /**
  * Heavily used structure, carrying a pointer to a stream (aka payload) and its length.
+ * If headroom is set, that many bytes in front of stream may be overwritten
+ * by the lower layers to put their headers, so they don't need to copy.
  */
 typedef struct {
     stream_t const* stream;
     streamlen_t len;
     bool is_compressed;
+    streamlen_t headroom;
 } payload_t;
 
 typedef uint8_t seq_no_t;
@@ -58,17 +70,37 @@ typedef struct my_packet_header {
     am_addr_t destination;
     seq_no_t seq_no;
     uint8_t ord_no;
-    // tells if the payload is compressed or not
-    bool is_compressed;
+    // CHUNK_* bits
+    uint8_t flags;
     // how many chunks in total
     uint8_t parts;
 } __attribute__((__packed__)) my_packet_header;
 
+/// the payload is compressed
+#define CHUNK_COMPRESSED 0x01
+/// a parity chunk, and computed with the Reed-Solomon code (@see fec.h)
+#define CHUNK_PARITY 0x02
+#define CHUNK_RS 0x04
+/// the high bits count how often a message was sent again, so the motes do not drop it as a duplicate
+#define CHUNK_TRY_SHIFT 4
+#define CHUNK_TRY_MASK 0xF0
+
 typedef struct my_packet {
     my_packet_header packet_header;
     stream_t payload[MAX_CARRIED];
 } __attribute__((__packed__)) my_packet;
 
+/// room left in front of outgoing chunks, enough for the message header of the serial interfaces
+#define CHUNK_HEADROOM 8
+
+/**
+ * A chunk as it is kept before sending, with some room in front of it.
+ */
+typedef struct chunk_t {
+    stream_t headroom[CHUNK_HEADROOM];
+    my_packet packet;
+} __attribute__((__packed__)) chunk_t;
+
 // XXX dummy message type used to communicate with the serial forwarder, NOT USED ANYWHERE
 struct dummy {
   char bla[102];
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "util.h"
+#include "glue.h"
+#include "workers.h"
+#include "bundle.h"
+
+static fdglue_t g;
+static bool submitted;
+static unsigned unbundled;
+// the packet numbers to find in a bundle
+static unsigned expected[8];
+
+void frames_ready(void) {
+    frame_t* frame;
+    while ((frame = next_ready_frame())) {
+        release_frame(frame);
+    }
+}
+
+void bundle_submitted(void) {
+    submitted = true;
+}
+
+/// the packet number i is i + 1 bytes of i
+void fill(stream_t* data, unsigned i) {
+    memset(data, i, i + 1);
+}
+
+void check_packet(payload_t packet) {
+    unsigned n = expected[unbundled++];
+    assert(packet.len == n + 1);
+    for (unsigned i = 0; i < packet.len; i++) {
+        assert(packet.stream[i] == (stream_t)n);
+    }
+}
+
+/// append the packet number i, @return what bundle_append says
+bool append(frame_t* frame, unsigned i) {
+    fill(frame->raw + bundle_offset(), i);
+    return bundle_append(frame, i + 1);
+}
+
+int main() {
+    fdglue(&g);
+    init_workers(&g, frames_ready);
+    init_bundling(&g, bundle_submitted);
+
+    // a few small packets wait for the timer
+    frame_t* frame = get_free_frame();
+    bool closed;
+    frame->compress = true;
+    frame->has_flow = false;
+    for (unsigned i = 0; i < 5; i++) {
+        expected[i] = i;
+        closed = append(frame, i);
+        assert(!closed);
+        assert(get_free_frame() == frame);
+    }
+    while (!submitted) {
+        g.listen(&g, 1, 0);
+    }
+    payload_t bundle = {.stream = frame->raw, .len = frame->len};
+    assert(is_bundle(bundle));
+    unbundled = 0;
+    unbundle(bundle, check_packet);
+    assert(unbundled == 5);
+
+    // a single one is sent as it is
+    submitted = false;
+    frame = get_free_frame();
+    closed = append(frame, 40);
+    assert(!closed);
+    while (!submitted) {
+        g.listen(&g, 1, 0);
+    }
+    assert(frame->len == 41 && frame->raw[0] == 40 && frame->raw[40] == 40);
+    assert(!is_bundle((payload_t){.stream = frame->raw, .len = frame->len}));
+
+    // a big packet is not bundled, but closes the open bundle
+    frame = get_free_frame();
+    closed = append(frame, MAX_CARRIED + 10);
+    assert(closed);
+    assert(frame->len == MAX_CARRIED + 11);
+    submit_frame(frame);
+    frame = get_free_frame();
+    closed = append(frame, 0);
+    assert(!closed);
+    closed = append(frame, 1);
+    assert(!closed);
+    closed = append(frame, 2 * MAX_CARRIED);
+    assert(closed);
+    expected[2] = 2 * MAX_CARRIED;
+    bundle = (payload_t){.stream = frame->raw, .len = frame->len};
+    assert(is_bundle(bundle));
+    unbundled = 0;
+    unbundle(bundle, check_packet);
+    assert(unbundled == 2 + 1);
+    submit_frame(frame);
+
+    // a bundle is closed when it's full
+    frame = get_free_frame();
+    unsigned i = 0;
+    while (!append(frame, i)) {
+        i = (i + 1) % MAX_CARRIED;
+    }
+    assert(frame->len >= BUNDLE_MAX_SIZE);
+    submit_frame(frame);
+
+    // or closed early, when the next packet does not fit
+    frame = get_free_frame();
+    closed = append(frame, 3);
+    frame_t* flushed = bundle_flush();
+    assert(!closed && flushed == frame);
+    assert(frame->len == 4 && !bundle_offset());
+    flushed = bundle_flush();
+    assert(!flushed);
+    submit_frame(frame);
+
+    close_workers();
+    return 0;
+}
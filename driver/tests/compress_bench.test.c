@@ -0,0 +1,275 @@
+/**
+ * Replays a capture through every codec we could use on the serial link and
+ * reports speed, ratio and the resulting number of chunks per traffic class.
+ *
+ * By default tests/corpus/traffic.pcap is used (see make_corpus.py there),
+ * any capture of raw ip or ethernet frames can be given as first argument.
+ * The debug output slows down the header compression a lot, build with
+ * LOG_LEVEL='(1|2)' before trusting the MB/s column.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "structs.h"
+#include "chunker.h"
+#include "headercomp.h"
+
+#define DEFAULT_CORPUS "tests/corpus/traffic.pcap"
+#define MAX_PACKETS 4096
+// more passes give more stable timings
+#define PASSES 3
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+
+typedef enum {
+    CLASS_DNS = 0,
+    CLASS_HTTP,
+    CLASS_TLS,
+    CLASS_SSH,
+    CLASS_ICMP,
+    CLASS_ACK,
+    CLASS_OTHER,
+    CLASS_SIZE
+} traffic_class_t;
+
+const char *class_names[CLASS_SIZE] = {"dns", "http", "tls", "ssh", "icmp", "tcp ack", "other"};
+
+typedef struct {
+    const char *name;
+    // -1 means no deflate
+    int level;
+    // negative for raw deflate (no zlib header and checksum)
+    int window_bits;
+    bool header_compression;
+} codec_t;
+
+const codec_t codecs[] = {
+    {"none", -1, 0, false},
+    {"hc", -1, 0, true},
+    {"zlib-1", 1, 15, false},
+    {"zlib-6", 6, 15, false},
+    {"zlib-9", 9, 15, false},
+    {"deflate-6", 6, -15, false},
+    {"deflate-9", 9, -15, false},
+    {"hc+zlib-9", 9, 15, true},
+    {"hc+deflate-6", 6, -15, true},
+};
+#define CODECS (sizeof(codecs) / sizeof(codec_t))
+
+typedef struct {
+    unsigned packets;
+    unsigned long in, out;
+    unsigned long chunks;
+    double seconds;
+} result_t;
+
+payload_t packets[MAX_PACKETS];
+traffic_class_t classes[MAX_PACKETS];
+unsigned num_packets = 0;
+
+/**
+ * Load all the ip packets of a capture.
+ */
+void load_pcap(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    struct {
+        uint32_t magic;
+        uint16_t major, minor;
+        int32_t zone;
+        uint32_t sigfigs, snaplen, linktype;
+    } hdr;
+    size_t read = fread(&hdr, sizeof(hdr), 1, f);
+    assert(read == 1);
+    assert(hdr.magic == PCAP_MAGIC);
+    unsigned skip = (hdr.linktype == LINKTYPE_ETHERNET) ? 14 : 0;
+    assert(skip || hdr.linktype == LINKTYPE_RAW);
+
+    struct {
+        uint32_t sec, usec, caplen, len;
+    } rec;
+    while (num_packets < MAX_PACKETS && fread(&rec, sizeof(rec), 1, f) == 1) {
+        stream_t *data = malloc(rec.caplen);
+        read = fread(data, rec.caplen, 1, f);
+        assert(read == 1);
+        if (rec.caplen <= skip || rec.caplen != rec.len) {
+            free(data);
+            continue;
+        }
+        packets[num_packets].stream = data + skip;
+        packets[num_packets].len = rec.caplen - skip;
+        num_packets++;
+    }
+    fclose(f);
+}
+
+/**
+ * Guess the traffic class from the ip header and the ports.
+ */
+traffic_class_t classify(payload_t pkt) {
+    stream_t const *p = pkt.stream;
+    if ((p[0] >> 4) != 4) {
+        return CLASS_OTHER;
+    }
+    unsigned ihl = (p[0] & 0x0F) * 4;
+    unsigned sport = (p[ihl] << 8) | p[ihl + 1];
+    unsigned dport = (p[ihl + 2] << 8) | p[ihl + 3];
+    unsigned port = (sport < dport) ? sport : dport;
+    switch (p[9]) {
+    case 1:
+        return CLASS_ICMP;
+    case 17:
+        return (port == 53) ? CLASS_DNS : CLASS_OTHER;
+    case 6:
+        if (pkt.len == ihl + (p[ihl + 12] >> 4) * 4) {
+            return CLASS_ACK;
+        }
+        switch (port) {
+        case 80:
+            return CLASS_HTTP;
+        case 443:
+            return CLASS_TLS;
+        case 22:
+            return CLASS_SSH;
+        }
+    }
+    return CLASS_OTHER;
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Run the whole capture through a codec, checking that everything can be restored.
+ */
+void run_codec(const codec_t *codec, result_t *results) {
+    z_stream defl, infl;
+    memset(&defl, 0, sizeof(defl));
+    memset(&infl, 0, sizeof(infl));
+    if (codec->level >= 0) {
+        assert(deflateInit2(&defl, codec->level, Z_DEFLATED, codec->window_bits, 9, Z_DEFAULT_STRATEGY) == Z_OK);
+        assert(inflateInit2(&infl, codec->window_bits) == Z_OK);
+    }
+    memset(results, 0, sizeof(result_t) * CLASS_SIZE);
+
+    for (int pass = 0; pass < PASSES; pass++) {
+        init_header_compression();
+        for (unsigned i = 0; i < num_packets; i++) {
+            static stream_t hc_data[MAX_FRAME_SIZE], compr_data[MAX_FRAME_SIZE];
+            static stream_t infl_data[MAX_FRAME_SIZE], restored_data[MAX_FRAME_SIZE];
+            result_t *r = &results[classes[i]];
+            payload_t data = packets[i];
+            bool deflated = false;
+
+            double start = now();
+            if (codec->header_compression) {
+                payload_t stripped = {.stream = hc_data, .len = MAX_FRAME_SIZE};
+                bool compressed = header_compress(data, &stripped);
+                assert(compressed);
+                data = stripped;
+            }
+            if (codec->level >= 0 && data.len > 1) {
+                // same as the driver: give up as soon as it's not smaller
+                defl.next_in = (stream_t *)data.stream;
+                defl.avail_in = data.len;
+                defl.next_out = compr_data;
+                defl.avail_out = data.len - 1;
+                if (deflate(&defl, Z_FINISH) == Z_STREAM_END) {
+                    data.stream = compr_data;
+                    data.len = data.len - 1 - defl.avail_out;
+                    deflated = true;
+                }
+                deflateReset(&defl);
+            }
+            r->seconds += now() - start;
+
+            if (pass) {
+                continue;
+            }
+            r->packets++;
+            r->in += packets[i].len;
+            r->out += data.len;
+            r->chunks += needed_chunks(data.len);
+
+            // and back
+            if (deflated) {
+                infl.next_in = (stream_t *)data.stream;
+                infl.avail_in = data.len;
+                infl.next_out = infl_data;
+                infl.avail_out = MAX_FRAME_SIZE;
+                int status = inflate(&infl, Z_FINISH);
+                assert(status == Z_STREAM_END);
+                data.stream = infl_data;
+                data.len = MAX_FRAME_SIZE - infl.avail_out;
+                inflateReset(&infl);
+            }
+            if (codec->header_compression) {
+                payload_t restored = {.stream = restored_data, .len = MAX_FRAME_SIZE};
+                bool decompressed = header_decompress(data, &restored);
+                assert(decompressed);
+                data = restored;
+            }
+            assert(payload_equals(data, packets[i]));
+        }
+    }
+
+    if (codec->level >= 0) {
+        deflateEnd(&defl);
+        inflateEnd(&infl);
+    }
+}
+
+void print_row(const char *codec, const char *class, result_t *r, unsigned long chunks_before) {
+    printf("%-13s %-8s %6u %9lu %8.1f %8.1f%% %7lu %+7.1f%%\n", codec, class, r->packets, r->in,
+           r->seconds ? r->in * PASSES / r->seconds / 1e6 : 0.0,
+           100.0 * r->out / r->in, r->chunks, 100.0 * ((double)r->chunks - chunks_before) / chunks_before);
+}
+
+int main(int argc, char **argv) {
+    load_pcap(argc > 1 ? argv[1] : DEFAULT_CORPUS);
+    assert(num_packets);
+    for (unsigned i = 0; i < num_packets; i++) {
+        classes[i] = classify(packets[i]);
+    }
+
+    result_t results[CODECS][CLASS_SIZE];
+    for (unsigned c = 0; c < CODECS; c++) {
+        run_codec(&codecs[c], results[c]);
+    }
+
+    printf("%u packets, %d bytes per chunk\n\n", num_packets, (int)MAX_CARRIED);
+    printf("%-13s %-8s %6s %9s %8s %9s %7s %8s\n", "codec", "class", "pkts", "bytes", "MB/s", "ratio", "chunks", "vs none");
+    for (unsigned c = 0; c < CODECS; c++) {
+        result_t total;
+        memset(&total, 0, sizeof(total));
+        unsigned long chunks_before = 0;
+        for (int k = 0; k < CLASS_SIZE; k++) {
+            result_t *r = &results[c][k];
+            if (!r->packets) {
+                continue;
+            }
+            print_row(codecs[c].name, class_names[k], r, results[0][k].chunks);
+            total.packets += r->packets;
+            total.in += r->in;
+            total.out += r->out;
+            total.chunks += r->chunks;
+            total.seconds += r->seconds;
+            chunks_before += results[0][k].chunks;
+        }
+        print_row(codecs[c].name, "total", &total, chunks_before);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,199 @@
+#!/usr/bin/env python3
+"""
+Generate traffic.pcap, the corpus used by tests/compress_bench.test.c
+
+The packets mimic what goes through the tunnel when browsing and working on
+a remote shell: dns lookups, plain http, tls, ssh, pings and the pure tcp acks
+going back. Headers (options, ttl, ids, windows, timestamps) are the ones a
+linux host sends, the payloads are real text for the plain protocols and
+random bytes for the encrypted ones.
+
+The output is deterministic, run it again only if you change this file.
+"""
+import random
+import struct
+import sys
+
+LINKTYPE_RAW = 101
+
+CLIENT = bytes([10, 0, 0, 1])
+DNS_SERVER = bytes([8, 8, 8, 8])
+WEB_SERVER = bytes([93, 184, 216, 34])
+TLS_SERVER = bytes([142, 250, 184, 100])
+SSH_SERVER = bytes([192, 168, 1, 10])
+
+rnd = random.Random(2010)
+
+WORDS = """the of and to in is for that with on as are this by be from at or
+network mote sensor packet radio serial tunnel gateway client chunk compress
+header data frame interface address route stack buffer queue message device
+node link layer protocol wireless power energy channel signal""".split()
+
+DOMAINS = ["www.google.com", "mail.google.com", "en.wikipedia.org",
+           "www.tinyos.net", "github.com", "www.kernel.org", "news.ycombinator.com",
+           "www.python.org", "docs.python.org", "www.debian.org", "lwn.net",
+           "www.rwth-aachen.de", "stackoverflow.com", "www.gnu.org"]
+
+
+def checksum(data):
+    if len(data) % 2:
+        data += b"\0"
+    s = sum(struct.unpack("!%dH" % (len(data) // 2), data))
+    while s >> 16:
+        s = (s & 0xFFFF) + (s >> 16)
+    return ~s & 0xFFFF
+
+
+class Flow(object):
+    """one direction of a conversation, keeps ip id, seq and timestamps"""
+    def __init__(self, src, dst, proto, sport, dport):
+        self.src, self.dst, self.proto = src, dst, proto
+        self.sport, self.dport = sport, dport
+        self.ipid = rnd.randrange(0x10000)
+        self.seq = rnd.randrange(1 << 32)
+        self.ack = 0
+        self.tsval = rnd.randrange(1 << 24)
+        self.tsecr = 0
+        self.ttl = 64 if src == CLIENT else 54
+
+    def ip(self, payload):
+        self.ipid = (self.ipid + 1) & 0xFFFF
+        hdr = struct.pack("!BBHHHBBH4s4s", 0x45, 0, 20 + len(payload), self.ipid,
+                          0x4000, self.ttl, self.proto, 0, self.src, self.dst)
+        hdr = hdr[:10] + struct.pack("!H", checksum(hdr)) + hdr[12:]
+        return hdr + payload
+
+    def transport_checksum(self, segment):
+        pseudo = self.src + self.dst + struct.pack("!BBH", 0, self.proto, len(segment))
+        return checksum(pseudo + segment)
+
+    def tcp(self, data=b"", flags=0x18, window=502):
+        self.tsval += rnd.randrange(1, 4)
+        opts = struct.pack("!BBBBII", 1, 1, 8, 10, self.tsval, self.tsecr)
+        seg = struct.pack("!HHIIBBHHH", self.sport, self.dport, self.seq, self.ack,
+                          (20 + len(opts)) << 2, flags, window, 0, 0) + opts + data
+        seg = seg[:16] + struct.pack("!H", self.transport_checksum(seg)) + seg[18:]
+        self.seq = (self.seq + len(data)) & 0xFFFFFFFF
+        return self.ip(seg)
+
+    def udp(self, data):
+        seg = struct.pack("!HHHH", self.sport, self.dport, 8 + len(data), 0) + data
+        seg = seg[:6] + struct.pack("!H", self.transport_checksum(seg) or 0xFFFF) + seg[8:]
+        return self.ip(seg)
+
+
+def connection(server, dport):
+    sport = rnd.randrange(32768, 61000)
+    up = Flow(CLIENT, server, 6, sport, dport)
+    down = Flow(server, CLIENT, 6, dport, sport)
+    return up, down
+
+
+def exchange(packets, sender, receiver, data, mss=1388):
+    """send data segmented in mss, the receiver acks every second segment"""
+    segments = [data[i:i + mss] for i in range(0, len(data), mss)]
+    for i, seg in enumerate(segments):
+        packets.append(sender.tcp(seg))
+        receiver.ack = sender.seq
+        receiver.tsecr = sender.tsval
+        if i % 2 == 1 or i == len(segments) - 1:
+            packets.append(receiver.tcp(flags=0x10))
+            sender.tsecr = receiver.tsval
+
+
+def text(words):
+    return " ".join(rnd.choice(WORDS) for _ in range(words))
+
+
+def dns(packets):
+    for name in DOMAINS:
+        up = Flow(CLIENT, DNS_SERVER, 17, rnd.randrange(32768, 61000), 53)
+        down = Flow(DNS_SERVER, CLIENT, 17, 53, up.sport)
+        ident = rnd.randrange(0x10000)
+        qname = b"".join(bytes([len(l)]) + l.encode() for l in name.split(".")) + b"\0"
+        for qtype in (1, 28):
+            question = qname + struct.pack("!HH", qtype, 1)
+            packets.append(up.udp(struct.pack("!HHHHHH", ident, 0x0100, 1, 0, 0, 0) + question))
+            answers = b""
+            count = rnd.randrange(1, 4)
+            for _ in range(count):
+                rdata = bytes(rnd.randrange(256) for _ in range(4 if qtype == 1 else 16))
+                answers += struct.pack("!HHHIH", 0xC00C, qtype, 1, rnd.randrange(60, 3600), len(rdata)) + rdata
+            packets.append(down.udp(struct.pack("!HHHHHH", ident, 0x8180, 1, count, 0, 0) + question + answers))
+            ident = (ident + 1) & 0xFFFF
+
+
+def http(packets):
+    for page in range(6):
+        up, down = connection(WEB_SERVER, 80)
+        path = "/%s/%s.html" % (rnd.choice(WORDS), rnd.choice(WORDS))
+        request = ("GET %s HTTP/1.1\r\nHost: www.example.com\r\n"
+                   "User-Agent: Mozilla/5.0 (X11; Linux i686; rv:1.9.2.8) Gecko/20100723 Ubuntu/10.04 Firefox/3.6.8\r\n"
+                   "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+                   "Accept-Language: en-us,en;q=0.5\r\nAccept-Encoding: identity\r\n"
+                   "Accept-Charset: ISO-8859-1,utf-8;q=0.7,*;q=0.7\r\nKeep-Alive: 115\r\n"
+                   "Connection: keep-alive\r\n\r\n" % path).encode()
+        exchange(packets, up, down, request)
+        body = "<html>\n<head><title>%s</title></head>\n<body>\n" % text(4)
+        for _ in range(rnd.randrange(10, 30)):
+            body += '<div class="section"><h2>%s</h2>\n<p>%s</p>\n<a href="/%s.html">%s</a></div>\n' % (
+                text(3), text(rnd.randrange(40, 120)), rnd.choice(WORDS), text(2))
+        body += "</body>\n</html>\n"
+        response = ("HTTP/1.1 200 OK\r\nDate: Mon, 06 Sep 2010 10:%02d:00 GMT\r\nServer: Apache/2.2.14 (Ubuntu)\r\n"
+                    "Content-Type: text/html; charset=UTF-8\r\nContent-Length: %d\r\n\r\n" % (page, len(body))).encode()
+        exchange(packets, down, up, response + body.encode())
+
+
+def tls(packets):
+    for _ in range(4):
+        up, down = connection(TLS_SERVER, 443)
+        hello = bytes([0x16, 0x03, 0x01, 0x00, 0xb3, 0x01, 0x00, 0x00, 0xaf, 0x03, 0x01]) + \
+            bytes(rnd.randrange(256) for _ in range(32)) + bytes(140)
+        exchange(packets, up, down, hello)
+        exchange(packets, down, up, bytes([0x16, 0x03, 0x01, 0x0b, 0xc0]) + bytes(rnd.randrange(256) for _ in range(3000)))
+        for _ in range(3):
+            record = bytes(rnd.randrange(256) for _ in range(rnd.randrange(300, 600)))
+            exchange(packets, up, down, bytes([0x17, 0x03, 0x01]) + struct.pack("!H", len(record)) + record)
+            record = bytes(rnd.randrange(256) for _ in range(rnd.randrange(2000, 6000)))
+            exchange(packets, down, up, bytes([0x17, 0x03, 0x01]) + struct.pack("!H", len(record)) + record)
+
+
+def ssh(packets):
+    up, down = connection(SSH_SERVER, 22)
+    exchange(packets, down, up, b"SSH-2.0-OpenSSH_5.3p1 Debian-3ubuntu4\r\n")
+    exchange(packets, up, down, b"SSH-2.0-OpenSSH_5.3p1 Debian-3ubuntu4\r\n")
+    # interactive session: a keystroke and its echo
+    for _ in range(60):
+        exchange(packets, up, down, bytes(rnd.randrange(256) for _ in range(48)))
+        exchange(packets, down, up, bytes(rnd.randrange(256) for _ in range(48)))
+    # and the output of a command
+    exchange(packets, down, up, bytes(rnd.randrange(256) for _ in range(8000)))
+
+
+def icmp(packets):
+    up = Flow(CLIENT, WEB_SERVER, 1, 0, 0)
+    down = Flow(WEB_SERVER, CLIENT, 1, 0, 0)
+    ident = rnd.randrange(0x10000)
+    for seq in range(1, 41):
+        # linux ping: a timeval followed by 0x10, 0x11, ...
+        data = struct.pack("<II", 1283767200 + seq, rnd.randrange(1000000)) + bytes(range(0x10, 0x38))
+        for kind, flow in ((8, up), (0, down)):
+            msg = struct.pack("!BBHHH", kind, 0, 0, ident, seq) + data
+            msg = msg[:2] + struct.pack("!H", checksum(msg)) + msg[4:]
+            packets.append(flow.ip(msg))
+
+
+def main():
+    packets = []
+    for generate in (dns, http, tls, ssh, icmp):
+        generate(packets)
+    out = open(sys.argv[1] if len(sys.argv) > 1 else "traffic.pcap", "wb")
+    out.write(struct.pack("<IHHiIII", 0xa1b2c3d4, 2, 4, 0, 0, 65535, LINKTYPE_RAW))
+    for i, pkt in enumerate(packets):
+        out.write(struct.pack("<IIII", 1283767200 + i // 100, (i % 100) * 10000, len(pkt), len(pkt)))
+        out.write(pkt)
+    out.close()
+
+
+if __name__ == "__main__":
+    main()
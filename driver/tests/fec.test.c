@@ -0,0 +1,165 @@
+/**
+ * Parity chunks: any k missing data chunks come back from k parity chunks,
+ * and reconstruct.c completes a packet with them without waiting.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "util.h"
+#include "structs.h"
+#include "chunker.h"
+#include "reconstruct.h"
+#include "fec.h"
+
+#define ROUNDS 200
+
+static stream_t original[FEC_MAX_PARTS * MAX_CARRIED];
+static unsigned original_len;
+static unsigned completed = 0;
+
+void random_data(unsigned len) {
+    for (unsigned i = 0; i < len; i++) {
+        original[i] = rand();
+    }
+    // an ip packet, not a bundle
+    original[0] = 0x45;
+    original_len = len;
+}
+
+/// missing bitmask with count distinct chunks out of parts
+uint64_t random_missing(unsigned parts, unsigned count) {
+    uint64_t missing = 0;
+    while ((unsigned)__builtin_popcountll(missing) < count) {
+        missing |= 1ull << (rand() % parts);
+    }
+    return missing;
+}
+
+void check_round_trip(unsigned parts, unsigned parity, unsigned lost) {
+    static stream_t chunks[FEC_MAX_PARTS][MAX_CARRIED];
+    static stream_t parity_data[FEC_MAX_PARITY][MAX_CARRIED];
+    stream_t* data[FEC_MAX_PARTS];
+    stream_t* out[FEC_MAX_PARITY];
+    stream_t const* received[FEC_MAX_PARITY] = {NULL};
+
+    unsigned last_len = 1 + rand() % MAX_CARRIED;
+    random_data((parts - 1) * MAX_CARRIED + last_len);
+    for (unsigned j = 0; j < parts; j++) {
+        memcpy(chunks[j], original + j * MAX_CARRIED, (j == parts - 1) ? last_len : MAX_CARRIED);
+        data[j] = chunks[j];
+    }
+    for (unsigned i = 0; i < parity; i++) {
+        out[i] = parity_data[i];
+    }
+    fec_encode((stream_t const* const*)data, parts, last_len, parity, out);
+
+    // lose some data chunks, and the parity chunks not needed for them
+    uint64_t missing = random_missing(parts, lost);
+    for (unsigned j = 0; j < parts; j++) {
+        if (missing & (1ull << j)) {
+            memset(chunks[j], 0xAA, MAX_CARRIED);
+        }
+    }
+    unsigned kept = 0;
+    for (unsigned i = parity; i-- > 0 && kept < lost; ) {
+        if (rand() % 2 || i + 1 <= lost - kept) {
+            received[i] = parity_data[i];
+            kept++;
+        }
+    }
+    assert(kept == lost);
+
+    bool decoded = fec_decode(data, parts, last_len, missing, received, parity > 1);
+    assert(decoded);
+    for (unsigned j = 0; j < parts; j++) {
+        assert(!memcmp(chunks[j], original + j * MAX_CARRIED, (j == parts - 1) ? last_len : MAX_CARRIED));
+    }
+    if (lost) {
+        // one parity chunk short
+        for (unsigned i = 0; i < FEC_MAX_PARITY; i++) {
+            if (received[i]) {
+                received[i] = NULL;
+                break;
+            }
+        }
+        assert(!fec_decode(data, parts, last_len, missing, received, parity > 1));
+    }
+}
+
+void packet_done(payload_t complete) {
+    assert(complete.len == original_len);
+    assert(!memcmp(complete.stream, original, original_len));
+    completed++;
+}
+
+/// a whole packet through reconstruct.c, without the chunks in lost
+void check_reconstruct(seq_no_t seq_no, unsigned len, unsigned parity, uint64_t lost) {
+    static chunk_t chunks[FEC_MAX_PARTS + FEC_MAX_PARITY];
+    random_data(len);
+    payload_t payload = {.stream = original, .len = len};
+    unsigned parts = split_payload(payload, chunks);
+    set_chunk_headers(chunks, parts, seq_no, false);
+
+    stream_t const* data[FEC_MAX_PARTS];
+    stream_t* out[FEC_MAX_PARITY];
+    for (unsigned j = 0; j < parts; j++) {
+        data[j] = chunks[j].packet.payload;
+    }
+    for (unsigned i = 0; i < parity; i++) {
+        out[i] = chunks[parts + i].packet.payload;
+    }
+    fec_encode(data, parts, len - (parts - 1) * MAX_CARRIED, parity, out);
+    fec_set_headers(chunks, parts, parity, len);
+
+    unsigned before = completed;
+    for (unsigned n = 0; n < parts + parity; n++) {
+        if (n < parts && (lost & (1ull << n))) {
+            continue;
+        }
+        payload_t chunk = {
+            .stream = (stream_t*)&chunks[n].packet,
+            .len = (n < parts) ? chunk_size(len, n) : fec_chunk_size(parts, len)
+        };
+        add_chunk(chunk);
+    }
+    assert(completed == before + 1);
+}
+
+int main() {
+    for (unsigned r = 0; r < ROUNDS; r++) {
+        unsigned parity = 1 + rand() % FEC_MAX_PARITY;
+        unsigned parts = 1 + rand() % FEC_MAX_PARTS;
+        unsigned lost = rand() % (1 + (parity < parts ? parity : parts));
+        check_round_trip(parts, parity, lost);
+    }
+
+    // no loss, no parity, and more of it with more loss
+    assert(fec_parity_count(10) == 0);
+    unsigned last = 0;
+    for (unsigned report = 0; report < 20; report++) {
+        fec_report_loss(100, 10);
+        unsigned now = fec_parity_count(10);
+        assert(now >= last && now <= FEC_MAX_PARITY);
+        last = now;
+    }
+    assert(last > 0);
+    assert(fec_parity_count(FEC_MAX_PARTS + 1) == 0);
+    // bigger packets need more of it
+    assert(fec_parity_count(2) <= fec_parity_count(40));
+    printf("parity chunks at 10%% loss: %u for 2 chunks, %u for 10, %u for 40\n",
+           fec_parity_count(2), fec_parity_count(10), fec_parity_count(40));
+
+    init_reconstruction(packet_done);
+    // a single chunk with xor, the parity coming before what it restores
+    check_reconstruct(1, 50, 1, 1);
+    check_reconstruct(2, 3 * MAX_CARRIED + 20, 1, 1 << 3);
+    check_reconstruct(3, 20 * MAX_CARRIED, 3, (1 << 0) | (1 << 7) | (1 << 19));
+    check_reconstruct(4, 64 * MAX_CARRIED, 4, (1ull << 63) | (1ull << 1) | (1ull << 30) | (1ull << 31));
+    // nothing lost, the parity that follows is ignored
+    check_reconstruct(5, 5 * MAX_CARRIED, 2, 0);
+    // at most one completion per packet
+    assert(completed == 5);
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "flow.h"
+
+/**
+ * A tcp segment from 10.0.0.1:port to 192.168.1.10:443.
+ */
+void make_segment(stream_t *buf, int port) {
+    memset(buf, 0, 40);
+    buf[0] = 0x45;
+    buf[3] = 40;
+    buf[9] = 6;
+    buf[12] = 10;
+    buf[15] = 1;
+    buf[16] = 192;
+    buf[17] = 168;
+    buf[18] = 1;
+    buf[19] = 10;
+    buf[20] = port >> 8;
+    buf[21] = port;
+    buf[22] = 443 >> 8;
+    buf[23] = 443 & 0xFF;
+}
+
+int main() {
+    stream_t buf[40];
+    payload_t pkt = {.stream = buf, .len = sizeof(buf)};
+    flow_key_t tls, other;
+
+    init_flows();
+    make_segment(buf, 40000);
+    bool parsed = flow_parse(pkt, &tls);
+    assert(parsed);
+    assert(tls.proto == 6 && tls.sport == 40000 && tls.dport == 443);
+    make_segment(buf, 40001);
+    parsed = flow_parse(pkt, &other);
+    assert(parsed);
+
+    // the flow is compressed until it failed often enough
+    for (int i = 0; i < FLOW_SKIP_AFTER; i++) {
+        bool compress = flow_should_compress(&tls);
+        assert(compress);
+        flow_record(&tls, false);
+    }
+    int probes = 0;
+    for (int i = 0; i < FLOW_REPROBE_INTERVAL * 4; i++) {
+        if (flow_should_compress(&tls)) {
+            probes++;
+            flow_record(&tls, false);
+        }
+        // other flows are not affected
+        bool compress = flow_should_compress(&other);
+        assert(compress);
+        flow_record(&other, true);
+    }
+    printf("%d probes in %d packets of an incompressible flow\n", probes, FLOW_REPROBE_INTERVAL * 4);
+    assert(probes == 4);
+
+    // once a probe succeeds the flow is compressed again
+    while (!flow_should_compress(&tls));
+    flow_record(&tls, true);
+    bool compress = flow_should_compress(&tls);
+    assert(compress);
+
+    // many new flows push the old ones out, the table does not grow
+    for (int i = 0; i < FLOW_TABLE_SIZE * 4; i++) {
+        make_segment(buf, i);
+        flow_key_t key;
+        parsed = flow_parse(pkt, &key);
+        compress = flow_should_compress(&key);
+        assert(parsed && compress);
+    }
+
+    memset(buf, 0, sizeof(buf));
+    parsed = flow_parse(pkt, &other);
+    assert(!parsed);
+    return 0;
+}
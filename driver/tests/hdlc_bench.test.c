@@ -0,0 +1,206 @@
+/**
+ * Checks the serial framing against a byte at a time version, the same
+ * algorithm as serialsource.c in the TinyOS SDK, and reports the speed of both.
+ *
+ * The frames are chunk sized with random bytes, so about one byte in 128 has
+ * to be escaped. The debug output slows the decoder down when frames are
+ * dropped, none is in the timed runs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "structs.h"
+#include "hdlc.h"
+
+#define FRAMES 20000
+#define FRAME_LEN 110
+// what one read from the device gives
+#define READ_SIZE 4096
+
+/**** the byte at a time version ****/
+
+uint16_t ref_crc_byte(uint16_t crc, uint8_t b) {
+    crc = (uint8_t)(crc >> 8) | (crc << 8);
+    crc ^= b;
+    crc ^= (uint8_t)(crc & 0xff) >> 4;
+    crc ^= crc << 12;
+    crc ^= (crc & 0xff) << 5;
+    return crc;
+}
+
+uint16_t ref_crc(stream_t const* data, unsigned len) {
+    uint16_t crc = 0;
+    for (unsigned i = 0; i < len; i++) {
+        crc = ref_crc_byte(crc, data[i]);
+    }
+    return crc;
+}
+
+stream_t* ref_put(stream_t* out, uint8_t b) {
+    if (b == HDLC_FLAG || b == HDLC_ESCAPE) {
+        *out++ = HDLC_ESCAPE;
+        b ^= HDLC_ESCAPE_XOR;
+    }
+    *out++ = b;
+    return out;
+}
+
+unsigned ref_encode(stream_t* out, uint8_t protocol, uint8_t seqno, stream_t const* data, unsigned len) {
+    stream_t* start = out;
+    *out++ = HDLC_FLAG;
+    uint16_t crc = ref_crc_byte(ref_crc_byte(0, protocol), seqno);
+    out = ref_put(out, protocol);
+    out = ref_put(out, seqno);
+    for (unsigned i = 0; i < len; i++) {
+        crc = ref_crc_byte(crc, data[i]);
+        out = ref_put(out, data[i]);
+    }
+    out = ref_put(out, crc & 0xFF);
+    out = ref_put(out, crc >> 8);
+    *out++ = HDLC_FLAG;
+    return out - start;
+}
+
+void ref_decode(hdlc_decoder_t* dec, stream_t const* in, unsigned len, hdlc_frame_handler_t handler, void* p) {
+    for (unsigned i = 0; i < len; i++) {
+        uint8_t b = in[i];
+        if (b == HDLC_FLAG) {
+            if (dec->in_sync && dec->count >= 3 && !dec->escaped) {
+                unsigned flen = dec->count - 2;
+                if (ref_crc(dec->frame, flen) == (dec->frame[flen] | (dec->frame[flen + 1] << 8))) {
+                    handler(p, dec->frame[0], dec->frame + 1, flen - 1);
+                }
+            }
+            dec->in_sync = true;
+            dec->count = 0;
+            dec->escaped = false;
+        } else if (!dec->in_sync) {
+            continue;
+        } else if (b == HDLC_ESCAPE) {
+            dec->escaped = true;
+        } else {
+            if (dec->escaped) {
+                b ^= HDLC_ESCAPE_XOR;
+                dec->escaped = false;
+            }
+            if (dec->count == HDLC_MTU) {
+                dec->in_sync = false;
+                continue;
+            }
+            dec->frame[dec->count++] = b;
+        }
+    }
+}
+
+/**** the test ****/
+
+static stream_t data[FRAMES + 1][FRAME_LEN];
+static stream_t wire[FRAMES * HDLC_ENCODED_SIZE(FRAME_LEN)];
+static unsigned wire_len;
+static unsigned decoded;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void check_frame(void* p, uint8_t protocol, stream_t const* frame, unsigned len) {
+    (void)p;
+    assert(protocol == HDLC_P_PACKET_ACK);
+    assert(len == 1 + FRAME_LEN);
+    assert(frame[0] == (uint8_t)decoded);
+    assert(!memcmp(frame + 1, data[decoded], FRAME_LEN));
+    decoded++;
+}
+
+void report(char const* what, double ref, double fast) {
+    double mb = (double)FRAMES * FRAME_LEN / 1e6;
+    printf("%-8s byte at a time %7.1f MB/s, driver %7.1f MB/s, x%.1f\n", what, mb / ref, mb / fast, ref / fast);
+}
+
+int main() {
+    for (unsigned f = 0; f <= FRAMES; f++) {
+        for (unsigned i = 0; i < FRAME_LEN; i++) {
+            data[f][i] = rand();
+        }
+    }
+    // every length, every alignment
+    for (unsigned len = 0; len < 64; len++) {
+        assert(hdlc_crc(0, data[1] + len % 8, len) == ref_crc(data[1] + len % 8, len));
+    }
+
+    // crc
+    uint16_t sum = 0;
+    double start = now();
+    for (unsigned f = 0; f < FRAMES; f++) {
+        sum ^= ref_crc(data[f], FRAME_LEN);
+    }
+    double ref_time = now() - start;
+    start = now();
+    for (unsigned f = 0; f < FRAMES; f++) {
+        sum ^= hdlc_crc(0, data[f], FRAME_LEN);
+    }
+    double fast_time = now() - start;
+    assert(sum == 0);
+    report("crc", ref_time, fast_time);
+
+    // encoding, both must give the same bytes
+    static stream_t ref_wire[sizeof(wire)];
+    unsigned ref_len = 0;
+    start = now();
+    for (unsigned f = 0; f < FRAMES; f++) {
+        ref_len += ref_encode(ref_wire + ref_len, HDLC_P_PACKET_ACK, f, data[f], FRAME_LEN);
+    }
+    ref_time = now() - start;
+    wire_len = 0;
+    start = now();
+    for (unsigned f = 0; f < FRAMES; f++) {
+        wire_len += hdlc_encode(wire + wire_len, HDLC_P_PACKET_ACK, (uint8_t)f, data[f], FRAME_LEN);
+    }
+    fast_time = now() - start;
+    assert(wire_len == ref_len && !memcmp(wire, ref_wire, wire_len));
+    report("encode", ref_time, fast_time);
+
+    // decoding, in reads of a few kilobytes
+    hdlc_decoder_t dec;
+    hdlc_decoder_init(&dec);
+    decoded = 0;
+    start = now();
+    for (unsigned i = 0; i < wire_len; i += READ_SIZE) {
+        ref_decode(&dec, wire + i, (wire_len - i < READ_SIZE) ? wire_len - i : READ_SIZE, check_frame, NULL);
+    }
+    ref_time = now() - start;
+    assert(decoded == FRAMES);
+    hdlc_decoder_init(&dec);
+    decoded = 0;
+    start = now();
+    for (unsigned i = 0; i < wire_len; i += READ_SIZE) {
+        hdlc_decode(&dec, wire + i, (wire_len - i < READ_SIZE) ? wire_len - i : READ_SIZE, check_frame, NULL);
+    }
+    fast_time = now() - start;
+    assert(decoded == FRAMES);
+    report("decode", ref_time, fast_time);
+
+    // frames cut anywhere, and some garbage between them
+    hdlc_decoder_init(&dec);
+    decoded = 0;
+    for (unsigned i = 0; i < wire_len; ) {
+        unsigned piece = 1 + rand() % 300;
+        if (piece > wire_len - i) {
+            piece = wire_len - i;
+        }
+        hdlc_decode(&dec, wire + i, piece, check_frame, NULL);
+        i += piece;
+    }
+    assert(decoded == FRAMES);
+    stream_t garbage[] = {0x12, HDLC_ESCAPE, 0x34, 0x56, HDLC_FLAG, HDLC_ESCAPE, HDLC_FLAG};
+    hdlc_decode(&dec, garbage, sizeof(garbage), check_frame, NULL);
+    stream_t frame[HDLC_ENCODED_SIZE(FRAME_LEN)];
+    hdlc_decode(&dec, frame, hdlc_encode(frame, HDLC_P_PACKET_ACK, decoded, data[decoded], FRAME_LEN), check_frame, NULL);
+    assert(decoded == FRAMES + 1);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * The MSS of the SYNs is lowered to fill whole chunks, with a valid checksum.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "util.h"
+#include "mss.h"
+#include "chunker.h"
+
+static stream_t pkt[128];
+
+/// a tcp SYN with a NOP, so the MSS option sits at an odd offset, and an odd length
+unsigned syn(bool v6, uint8_t flags, uint16_t mss) {
+    unsigned transport = v6 ? 40 : 20;
+    unsigned len = transport + 28 + 1;
+    memset(pkt, 0, sizeof(pkt));
+    if (v6) {
+        pkt[0] = 0x60;
+        pkt[5] = len - 40;
+        pkt[6] = 6;
+        for (unsigned i = 8; i < 40; i++) {
+            pkt[i] = i * 7;
+        }
+    } else {
+        pkt[0] = 0x45;
+        pkt[3] = len;
+        pkt[9] = 6;
+        for (unsigned i = 12; i < 20; i++) {
+            pkt[i] = i * 7;
+        }
+    }
+    stream_t* tcp = pkt + transport;
+    tcp[0] = 0x12;
+    tcp[12] = (28 / 4) << 4;
+    tcp[13] = flags;
+    tcp[20] = 1;
+    tcp[21] = 2;
+    tcp[22] = 4;
+    tcp[23] = mss >> 8;
+    tcp[24] = mss & 0xFF;
+    tcp[25] = tcp[26] = tcp[27] = 1;
+    tcp[28] = 0xAB;
+    return len;
+}
+
+uint16_t mss_of(bool v6) {
+    stream_t* tcp = pkt + (v6 ? 40 : 20);
+    return (tcp[23] << 8) | tcp[24];
+}
+
+/// the sum over the segment and the pseudo header, 0xFFFF when the checksum is right
+uint16_t verify(bool v6, unsigned len) {
+    unsigned transport = v6 ? 40 : 20;
+    uint32_t sum = 6 + len - transport;
+    for (unsigned i = v6 ? 8 : 12; i < transport; i += 2) {
+        sum += (pkt[i] << 8) | pkt[i + 1];
+    }
+    for (unsigned i = transport; i < len; i += 2) {
+        sum += (pkt[i] << 8) | ((i + 1 < len) ? pkt[i + 1] : 0);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return sum;
+}
+
+int main() {
+    unsigned mss = mss_value();
+    printf("mtu %u, mss %u, frames of up to %u chunks\n", mss_mtu(), mss, needed_chunks(mss_mtu() + MSS_FRAME_GROWTH));
+#if TUN_MSS == MSS_CHUNK_ALIGNED
+    // the biggest frame fills the chunks up to the last byte
+    unsigned frame = mss_mtu() + MSS_FRAME_GROWTH;
+    assert(frame % MAX_CARRIED == 0 && mss_mtu() <= MSS_MAX_MTU);
+    assert(mss_mtu() + MAX_CARRIED > MSS_MAX_MTU);
+#endif
+    if (!mss) {
+        return 0;
+    }
+
+    for (unsigned v6 = 0; v6 < 2; v6++) {
+        unsigned expected = v6 ? mss - 20 : mss;
+        // a SYN and a SYN-ACK asking for too much
+        unsigned len = syn(v6, 0x02, 1460);
+        bool clamped = mss_clamp(pkt, len);
+        assert(clamped && mss_of(v6) == expected && verify(v6, len) == 0xFFFF);
+        len = syn(v6, 0x12, 1460);
+        clamped = mss_clamp(pkt, len);
+        assert(clamped && mss_of(v6) == expected && verify(v6, len) == 0xFFFF);
+        // a smaller MSS is kept
+        len = syn(v6, 0x02, 500);
+        clamped = mss_clamp(pkt, len);
+        assert(!clamped && mss_of(v6) == 500);
+        // not a SYN
+        len = syn(v6, 0x10, 1460);
+        clamped = mss_clamp(pkt, len);
+        assert(!clamped && mss_of(v6) == 1460);
+        // truncated
+        len = syn(v6, 0x02, 1460);
+        clamped = mss_clamp(pkt, len - 10);
+        assert(!clamped && mss_of(v6) == 1460);
+    }
+    return 0;
+}
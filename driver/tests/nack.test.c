@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "util.h"
+#include "glue.h"
+#include "motecomm.h"
+#include "workers.h"
+#include "sender.h"
+#include "reconstruct.h"
+#include "control.h"
+#include "chunker.h"
+
+#define FRAMES 10
+#define FRAME_LEN 300
+/// a packet whose chunks come slowly, after the others
+#define SLOW FRAMES
+
+static fdglue_t g;
+static stream_t originals[FRAMES + 1][FRAME_LEN];
+static bool completed[FRAMES + 1];
+static unsigned num_completed = 0;
+static unsigned nacks = 0, resent = 0;
+
+/// chunks lost the first time they are sent
+bool lost(my_packet_header const* hdr) {
+    return (hdr->seq_no == 3 && hdr->ord_no == 1) || (hdr->seq_no == 5 && (hdr->ord_no == 0 || hdr->ord_no == 2));
+}
+
+/// the link leads straight back to us, as if we were the other end
+int loopback(serialif_t* this, payload_t const payload) {
+    (void)this;
+    my_packet_header const* hdr = (my_packet_header const*)payload.stream;
+    if (is_control(payload)) {
+        if (hdr->ord_no == CONTROL_NACK) {
+            nacks++;
+        }
+        handle_control(NULL, payload);
+        return 0;
+    }
+    if (hdr->flags & CHUNK_TRY_MASK) {
+        // only what was lost comes again
+        assert(lost(hdr));
+        resent++;
+    } else if (lost(hdr)) {
+        return 0;
+    }
+    add_chunk(payload);
+    return 0;
+}
+
+void packet_done(payload_t complete) {
+    assert(complete.len == FRAME_LEN);
+    unsigned n = complete.stream[1];
+    assert(n <= SLOW && !completed[n]);
+    assert(!memcmp(complete.stream, originals[n], FRAME_LEN));
+    completed[n] = true;
+    num_completed++;
+}
+
+void frame_sent(void) {
+}
+
+/// keep the timers going for that many milliseconds
+void wait_ms(long ms) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        g.listen(&g, 0, 10000);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < ms);
+}
+
+int main() {
+    serialif_t link;
+    memset(&link, 0, sizeof(link));
+    link.send = loopback;
+
+    fdglue(&g);
+    init_workers(&g, sender_kick);
+    init_sender(&g, motecomm(NULL, &link), 2000, frame_sent);
+    init_reconstruction(packet_done);
+    init_feedback(&g, sender_send_control);
+
+    for (unsigned n = 0; n < FRAMES; n++) {
+        frame_t* frame;
+        while (!(frame = get_free_frame())) {
+            g.listen(&g, 1, 0);
+        }
+        for (unsigned i = 0; i < FRAME_LEN; i++) {
+            originals[n][i] = rand();
+        }
+        // an ip packet, not a bundle
+        originals[n][0] = 0x45;
+        originals[n][1] = n;
+        memcpy(frame->raw, originals[n], FRAME_LEN);
+        frame->len = FRAME_LEN;
+        frame->compress = false;
+        frame->has_flow = false;
+        submit_frame(frame);
+    }
+
+    for (unsigned wait = 0; num_completed < FRAMES && wait < 50; wait++) {
+        g.listen(&g, 0, 100000);
+    }
+    printf("%u packets completed, %u NACKs, %u chunks sent again\n", num_completed, nacks, resent);
+    assert(num_completed == FRAMES);
+    // packet 3 needs one, packet 5 two chunks, each asked for once
+    assert(nacks == 2);
+    assert(resent == 3);
+
+    // a slow link: the chunks come 200 ms apart, a pause longer than RECONSTRUCT_GAP_MS
+    // but short for such a link is no reason for a NACK
+    for (unsigned i = 0; i < FRAME_LEN; i++) {
+        originals[SLOW][i] = rand();
+    }
+    originals[SLOW][0] = 0x45;
+    originals[SLOW][1] = SLOW;
+    payload_t slow = {.stream = originals[SLOW], .len = FRAME_LEN};
+    chunk_t chunks[MAX_FRAME_CHUNKS];
+    unsigned parts = split_payload(slow, chunks);
+    set_chunk_headers(chunks, parts, 20, false);
+    assert(parts == 4);
+    for (unsigned ord_no = 0; ord_no < parts; ord_no++) {
+        wait_ms(ord_no < parts - 1 ? 200 : RECONSTRUCT_GAP_MS + 200);
+        add_chunk((payload_t){.stream = (stream_t*)&chunks[ord_no].packet, .len = chunk_size(FRAME_LEN, ord_no)});
+    }
+    printf("slow packet completed: %d, %u NACKs\n", completed[SLOW], nacks);
+    assert(completed[SLOW] && nacks == 2);
+    close_workers();
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "util.h"
+#include "pool.h"
+
+#define SLAB 110
+#define COUNT 4
+
+int main() {
+    pool_t* p = pool(NULL, SLAB, COUNT);
+    stream_t* bufs[COUNT + 2];
+
+    // more than there is, the last ones come from malloc
+    for (int i = 0; i < COUNT + 2; i++) {
+        bufs[i] = p->get(p);
+        assert(bufs[i]);
+        memset(bufs[i], i, SLAB);
+    }
+    for (int i = 0; i < COUNT; i++) {
+        for (int j = 0; j < i; j++) {
+            assert(bufs[i] != bufs[j]);
+        }
+    }
+    assert(p->free_count == 0);
+
+    // the malloced ones must be freed too
+    for (int i = 0; i < COUNT + 2; i++) {
+        p->put(p, bufs[i]);
+    }
+    assert(p->free_count == COUNT);
+
+    // recycled, not allocated again
+    stream_t* again = p->get(p);
+    assert(again >= p->slabs && again < p->slabs + SLAB * COUNT);
+    p->put(p, again);
+
+    DTOR(p);
+    return 0;
+}
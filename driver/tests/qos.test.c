@@ -0,0 +1,317 @@
+/**
+ * The classes of some typical packets, the order they leave the queues in
+ * and the share every flow gets.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "qos.h"
+
+#define BIG 1400
+
+static stream_t pkt[MAX_FRAME_SIZE];
+
+/// an ipv4 packet of that size, the transport header following
+payload_t ipv4(unsigned len, uint8_t tos, uint8_t proto) {
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = 0x45;
+    pkt[1] = tos;
+    pkt[2] = len >> 8;
+    pkt[3] = len & 0xFF;
+    pkt[9] = proto;
+    return (payload_t){.stream = pkt, .len = len};
+}
+
+payload_t tcp(unsigned len, uint16_t dport, uint8_t flags) {
+    payload_t p = ipv4(len, 0, 6);
+    pkt[22] = dport >> 8;
+    pkt[23] = dport & 0xFF;
+    pkt[32] = 5 << 4;
+    pkt[33] = flags;
+    return p;
+}
+
+/// the first byte after the headers tells the packets apart
+payload_t numbered(unsigned len, uint8_t tos, unsigned n) {
+    payload_t p = ipv4(len, tos, 17);
+    pkt[40] = n;
+    return p;
+}
+
+/// a udp packet of the flow with that source port
+payload_t of_flow(unsigned len, uint16_t sport, unsigned n) {
+    payload_t p = numbered(len, 0, n);
+    pkt[20] = sport >> 8;
+    pkt[21] = sport & 0xFF;
+    return p;
+}
+
+/// a pure ack, with a sack block if sack_end is not 0
+payload_t tcp_ack(uint16_t dport, uint32_t ack, uint8_t flags, uint32_t sack_start, uint32_t sack_end) {
+    unsigned options = sack_end ? 12 : 0;
+    payload_t p = tcp(40 + options, dport, 0x10 | flags);
+    pkt[32] = ((20 + options) / 4) << 4;
+    for (unsigned i = 0; i < 4; i++) {
+        pkt[28 + i] = ack >> (24 - 8 * i);
+    }
+    if (sack_end) {
+        pkt[40] = pkt[41] = 1;
+        pkt[42] = 5;
+        pkt[43] = 10;
+        for (unsigned i = 0; i < 4; i++) {
+            pkt[44 + i] = sack_start >> (24 - 8 * i);
+            pkt[48 + i] = sack_end >> (24 - 8 * i);
+        }
+    }
+    return p;
+}
+
+/// the ack numbers waiting, in the order they come out
+unsigned drain_acks(uint32_t* acks) {
+    stream_t out[MAX_FRAME_SIZE];
+    payload_t got = {.stream = out, .len = sizeof(out)};
+    unsigned n = 0;
+    while (qos_dequeue(&got)) {
+        acks[n++] = (out[28] << 24) | (out[29] << 16) | (out[30] << 8) | out[31];
+        got.len = sizeof(out);
+    }
+    return n;
+}
+
+void check_ack_filter(void) {
+    uint32_t acks[16];
+    qos_stats_t stats;
+    init_qos();
+
+    // only the newest cumulative ack is left, even across the wrap around
+    qos_enqueue(tcp_ack(5000, 0xFFFFFF00, 0, 0, 0));
+    qos_enqueue(tcp_ack(5000, 0xFFFFFFF0, 0, 0, 0));
+    qos_enqueue(tcp_ack(5000, 0x10, 0, 0, 0));
+    // another flow is left alone
+    qos_enqueue(tcp_ack(5001, 0x05, 0, 0, 0));
+    assert(drain_acks(acks) == 2 && acks[0] == 0x10 && acks[1] == 0x05);
+    qos_get_stats(QOS_INTERACTIVE, &stats);
+    assert(stats.acks_filtered == 2);
+
+    // duplicate acks are what triggers a fast retransmit
+    qos_enqueue(tcp_ack(5000, 100, 0, 0, 0));
+    qos_enqueue(tcp_ack(5000, 100, 0, 0, 0));
+    qos_enqueue(tcp_ack(5000, 100, 0, 0, 0));
+    assert(drain_acks(acks) == 3);
+
+    // a sack block the newer ack does not cover is kept
+    qos_enqueue(tcp_ack(5000, 100, 0, 200, 300));
+    qos_enqueue(tcp_ack(5000, 150, 0, 0, 0));
+    assert(drain_acks(acks) == 2);
+    qos_enqueue(tcp_ack(5000, 100, 0, 200, 300));
+    qos_enqueue(tcp_ack(5000, 150, 0, 200, 400));
+    assert(drain_acks(acks) == 1 && acks[0] == 150);
+    qos_enqueue(tcp_ack(5000, 100, 0, 200, 300));
+    qos_enqueue(tcp_ack(5000, 300, 0, 0, 0));
+    assert(drain_acks(acks) == 1 && acks[0] == 300);
+
+    // so is an ECN echo
+    qos_enqueue(tcp_ack(5000, 100, 0x40, 0, 0));
+    qos_enqueue(tcp_ack(5000, 200, 0, 0, 0));
+    assert(drain_acks(acks) == 2);
+
+    // and anything carrying data or another flag
+    qos_enqueue(tcp(60, 5000, 0x18));
+    qos_enqueue(tcp_ack(5000, 100, 0x01, 0, 0));
+    qos_enqueue(tcp_ack(5000, 200, 0, 0, 0));
+    assert(drain_acks(acks) == 3);
+}
+
+int main() {
+    bool ok;
+    init_qos();
+
+    // small, whatever it is
+    assert(qos_classify(ipv4(60, 0, 17)) == QOS_INTERACTIVE);
+    // but the short tail of a tcp transfer stays behind the rest of its flow
+    assert(qos_classify(tcp(60, 80, 0x18)) == QOS_NORMAL);
+    // a big download
+    assert(qos_classify(tcp(BIG, 80, 0x18)) == QOS_NORMAL);
+    // an ack with a lot of sack options, no data
+    payload_t ack = tcp(160, 80, 0x10);
+    pkt[32] = 15 << 4;
+    pkt[2] = 0;
+    pkt[3] = 20 + 60;
+    assert(qos_classify(ack) == QOS_INTERACTIVE);
+    // a big syn is not an ack
+    assert(qos_classify(tcp(BIG, 80, 0x02)) == QOS_NORMAL);
+    // dns, also over tcp
+    assert(qos_classify(tcp(BIG, 53, 0x18)) == QOS_INTERACTIVE);
+    // icmp
+    assert(qos_classify(ipv4(BIG, 0, 1)) == QOS_INTERACTIVE);
+    // dscp EF and CS1
+    assert(qos_classify(ipv4(BIG, 46 << 2, 17)) == QOS_INTERACTIVE);
+    assert(qos_classify(ipv4(BIG, 8 << 2, 17)) == QOS_BULK);
+    // ipv6 with EF in the traffic class
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = 0x60 | (46 >> 2);
+    pkt[1] = (46 & 0x03) << 6;
+    pkt[4] = (BIG - 40) >> 8;
+    pkt[5] = (BIG - 40) & 0xFF;
+    pkt[6] = 17;
+    assert(qos_classify((payload_t){.stream = pkt, .len = BIG}) == QOS_INTERACTIVE);
+
+    // the segments of a transfer leave in order, its short tail too
+    stream_t out[MAX_FRAME_SIZE];
+    for (unsigned i = 0; i < 3; i++) {
+        payload_t segment = tcp(i < 2 ? BIG : 60, 80, 0x18);
+        pkt[40] = i;
+        ok = qos_enqueue(segment);
+        assert(ok);
+    }
+    for (unsigned i = 0; i < 3; i++) {
+        payload_t got = {.stream = out, .len = sizeof(out)};
+        ok = qos_dequeue(&got);
+        assert(ok && out[40] == i);
+    }
+
+    // a bulk and a normal packet queued first, the interactive one overtakes them
+    ok = qos_enqueue(numbered(BIG, 8 << 2, 1));
+    assert(ok);
+    ok = qos_enqueue(numbered(BIG, 0, 2));
+    assert(ok);
+    ok = qos_enqueue(numbered(BIG, 46 << 2, 3));
+    assert(ok);
+    assert(qos_queued() == 3);
+    unsigned expected[] = {3, 2, 1};
+    for (unsigned i = 0; i < 3; i++) {
+        payload_t got = {.stream = out, .len = sizeof(out)};
+        ok = qos_dequeue(&got);
+        assert(ok);
+        assert(got.len == BIG && out[40] == expected[i]);
+    }
+    payload_t none = {.stream = out, .len = sizeof(out)};
+    ok = qos_dequeue(&none);
+    assert(!ok);
+
+    // a flood of interactive packets does not starve the rest
+    ok = qos_enqueue(numbered(BIG, 0, 0xFF));
+    assert(ok);
+    for (unsigned n = 0; n < QOS_QUEUE_LEN; n++) {
+        ok = qos_enqueue(numbered(BIG, 46 << 2, n));
+        assert(ok);
+    }
+    // the queue is full, dropped
+    ok = qos_enqueue(numbered(BIG, 46 << 2, 0));
+    assert(!ok);
+    unsigned position = 0;
+    for (unsigned i = 0; i <= QOS_QUEUE_LEN; i++) {
+        payload_t got = {.stream = out, .len = sizeof(out)};
+        ok = qos_dequeue(&got);
+        assert(ok);
+        if (out[40] == 0xFF) {
+            position = i;
+        }
+    }
+    printf("the normal packet left after %u interactive ones\n", position);
+    assert(position == QOS_MAX_SKIPS);
+    assert(qos_queued() == 0);
+
+    // a download and a smaller transfer get the same share of chunks
+    for (unsigned n = 0; n < 20; n++) {
+        ok = qos_enqueue(of_flow(BIG, 1000, n));
+        assert(ok);
+        ok = qos_enqueue(of_flow(300, 2000, n));
+        assert(ok);
+    }
+    unsigned chunks[2] = {0, 0}, next[2] = {0, 0};
+    for (unsigned i = 0; i < 20; i++) {
+        payload_t got = {.stream = out, .len = sizeof(out)};
+        ok = qos_dequeue(&got);
+        assert(ok);
+        unsigned f = (got.len == BIG) ? 0 : 1;
+        // in order within a flow
+        assert(out[40] == next[f]++);
+        chunks[f] += (got.len + MAX_CARRIED - 1) / MAX_CARRIED;
+    }
+    printf("chunks of the download %u, of the other flow %u\n", chunks[0], chunks[1]);
+    assert(chunks[0] <= chunks[1] + 16 && chunks[1] <= chunks[0] + 16);
+    init_qos();
+    assert(qos_queued() == 0);
+
+    // a full class drops from its longest flow, a new flow still gets in
+    for (unsigned n = 0; n < QOS_QUEUE_LEN; n++) {
+        ok = qos_enqueue(of_flow(BIG, 1000, n));
+        assert(ok);
+    }
+    ok = qos_enqueue(of_flow(300, 2000, 0));
+    assert(!ok);
+    assert(qos_queued() == QOS_QUEUE_LEN);
+    bool other = false;
+    for (unsigned i = 0; i < QOS_QUEUE_LEN; i++) {
+        payload_t got = {.stream = out, .len = sizeof(out)};
+        ok = qos_dequeue(&got);
+        assert(ok);
+        if (got.len == BIG) {
+            // the oldest one is gone
+            assert(out[40] != 0);
+        } else {
+            other = true;
+        }
+    }
+    assert(other);
+
+    // many more flows than slots share them, nothing gets lost
+    for (unsigned n = 0; n < QOS_QUEUE_LEN; n++) {
+        ok = qos_enqueue(of_flow(300, 3000 + n, n));
+        assert(ok);
+    }
+    for (unsigned n = 0; n < QOS_QUEUE_LEN; n++) {
+        payload_t got = {.stream = out, .len = sizeof(out)};
+        ok = qos_dequeue(&got);
+        assert(ok);
+    }
+    assert(qos_queued() == 0);
+
+    // bigger than the buffers of the pool
+    ok = qos_enqueue(numbered(QOS_SLAB_SIZE * 2, 0, 7));
+    assert(ok);
+    payload_t got = {.stream = out, .len = sizeof(out)};
+    ok = qos_dequeue(&got);
+    assert(ok && got.len == QOS_SLAB_SIZE * 2 && out[40] == 7);
+
+    // nothing waited long so far
+    qos_stats_t stats;
+    qos_get_stats(QOS_NORMAL, &stats);
+    assert(stats.dropped_late == 0 && stats.sent > 0);
+
+    // a queue drained slower than it fills: codel drops some, in order and never the last one
+    init_qos();
+    qos_codel_params(20, 100);
+    for (unsigned n = 0; n < 40; n++) {
+        ok = qos_enqueue(of_flow(BIG, 1000, n));
+        assert(ok);
+    }
+    unsigned sent = 0, last = 0;
+    for (;;) {
+        usleep(10000);
+        got = (payload_t){.stream = out, .len = sizeof(out)};
+        if (!qos_dequeue(&got)) {
+            break;
+        }
+        assert(!sent || out[40] > last);
+        last = out[40];
+        sent++;
+    }
+    assert(last == 39);
+    qos_get_stats(QOS_NORMAL, &stats);
+    printf("codel: %lu sent, %lu dropped, delay %.0f ms, worst %lu ms\n",
+           stats.sent, stats.dropped_late, stats.delay_ms, stats.max_delay_ms);
+    assert(stats.sent == sent && stats.sent + stats.dropped_late == 40);
+    assert(stats.dropped_late > 0 && stats.queued == 0);
+    qos_print_statistics();
+
+#if QOS_ACK_FILTER
+    qos_codel_params(QOS_CODEL_TARGET_MS, QOS_CODEL_INTERVAL_MS);
+    check_ack_filter();
+#endif
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "glue.h"
+#include "motecomm.h"
+#include "serialif.h"
+#include "reader.h"
+
+#define MESSAGES 200
+
+static unsigned received = 0;
+
+void check_message(motecomm_handler_t* that, payload_t const payload) {
+    (void)that;
+    assert(payload.len == 1 + received % 50);
+    for (unsigned i = 0; i < payload.len; i++) {
+        assert(payload.stream[i] == (stream_t)(received + i));
+    }
+    received++;
+}
+
+int main() {
+    // the fake interface reads from stdin
+    int fds[2];
+    assert(!pipe(fds));
+    assert(dup2(fds[0], STDIN_FILENO) == STDIN_FILENO);
+
+    serialif_t* sif = serialfakeif(NULL);
+    assert(sif);
+    motecomm_t* mc = motecomm(NULL, sif);
+    mc->set_handler(mc, (motecomm_handler_t) {
+            .p = NULL,
+            .receive = check_message
+        });
+
+    fdglue_t g;
+    fdglue(&g);
+    init_reader(&g, mc);
+
+    // all at once, with the length of every message in front of it
+    for (unsigned m = 0; m < MESSAGES; m++) {
+        stream_t data[50];
+        payload_t payload = {.stream = data, .len = 1 + m % 50, .headroom = 0};
+        for (unsigned i = 0; i < payload.len; i++) {
+            data[i] = m + i;
+        }
+        payload_t msg = add_message_header(payload);
+        stream_t len[2] = {msg.len >> 8, msg.len & 0xFF};
+        assert(write(fds[1], len, 2) == 2);
+        assert(write(fds[1], msg.stream, msg.len) == (int)msg.len);
+    }
+    while (received < MESSAGES) {
+        g.listen(&g, 1, 0);
+    }
+    assert(received == MESSAGES);
+    return 0;
+}
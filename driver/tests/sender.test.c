@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "util.h"
+#include "glue.h"
+#include "motecomm.h"
+#include "workers.h"
+#include "sender.h"
+#include "fec.h"
+
+#define FRAMES 20
+#define FRAME_LEN 1000
+
+static fdglue_t g;
+static unsigned frames_sent = 0;
+// chunks seen per link and per sequence number
+static unsigned link_chunks[2];
+static unsigned seq_chunks[256];
+static unsigned long bytes_sent = 0;
+// the sequence number of every chunk, in the order they were sent
+static uint8_t order[1024];
+static unsigned order_len = 0;
+// new chunks sent, each of them went into the history
+static unsigned remembered = 0;
+// the last chunk sent again
+static stream_t resent[sizeof(my_packet)];
+static unsigned resent_len = 0;
+
+extern uint16_t destination_address;
+
+// the second mote stopped taking chunks
+static bool slow_fails = false;
+
+/// the slow mote takes four times as long to take a chunk, which says nothing about its radio
+int send_on(unsigned link, payload_t const payload) {
+    my_packet_header const* hdr = (my_packet_header const*)payload.stream;
+    assert((hdr->flags & CHUNK_PARITY) || hdr->ord_no < hdr->parts);
+    seq_chunks[hdr->seq_no]++;
+    if (hdr->flags & CHUNK_TRY_MASK) {
+        memcpy(resent, payload.stream, payload.len);
+        resent_len = payload.len;
+    } else {
+        remembered++;
+    }
+    link_chunks[link]++;
+    bytes_sent += payload.len;
+    if (order_len < sizeof(order)) {
+        order[order_len++] = hdr->seq_no;
+    }
+    usleep(link ? 2000 : 500);
+    return (link && slow_fails) ? -1 : 0;
+}
+
+int send_fast(serialif_t* this, payload_t const payload) {
+    (void)this;
+    return send_on(0, payload);
+}
+
+int send_slow(serialif_t* this, payload_t const payload) {
+    (void)this;
+    return send_on(1, payload);
+}
+
+void frame_sent(void) {
+    frames_sent++;
+}
+
+static motecomm_t* fast_comm;
+
+void write_limits(char const* path, char const* limits) {
+    FILE* file = fopen(path, "w");
+    assert(file);
+    fputs(limits, file);
+    fclose(file);
+}
+
+double now_s(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void send_frames(void) {
+    unsigned submitted = 0;
+    frames_sent = 0;
+    while (frames_sent < FRAMES) {
+        frame_t* frame;
+        while (submitted < FRAMES && (frame = get_free_frame())) {
+            // random data, not compressed
+            for (unsigned i = 0; i < FRAME_LEN; i++) {
+                frame->raw[i] = rand();
+            }
+            frame->len = FRAME_LEN;
+            frame->compress = false;
+            frame->has_flow = false;
+            submit_frame(frame);
+            submitted++;
+        }
+        g.listen(&g, 1, 0);
+    }
+}
+
+/**
+ * Send a frame of random data and wait until it is done.
+ */
+void send_frame(stream_t* data, unsigned len) {
+    frame_t* frame = get_free_frame();
+    assert(frame);
+    for (unsigned i = 0; i < len; i++) {
+        data[i] = rand();
+    }
+    memcpy(frame->raw, data, len);
+    frame->len = len;
+    frame->compress = false;
+    frame->has_flow = false;
+    submit_frame(frame);
+    frames_sent = 0;
+    order_len = 0;
+    while (frames_sent < 1) {
+        g.listen(&g, 1, 0);
+    }
+}
+
+/**
+ * A long frame and a short one right after it.
+ *
+ * @return true if the short one was done first
+ */
+bool short_done_first(uint16_t long_port, uint16_t short_port) {
+    unsigned lens[2] = {FRAME_LEN, 100};
+    uint16_t ports[2] = {long_port, short_port};
+    for (unsigned f = 0; f < 2; f++) {
+        frame_t* frame = get_free_frame();
+        assert(frame);
+        for (unsigned i = 0; i < lens[f]; i++) {
+            frame->raw[i] = rand();
+        }
+        frame->len = lens[f];
+        frame->compress = false;
+        frame->has_flow = true;
+        memset(&frame->flow, 0, sizeof(frame->flow));
+        frame->flow.proto = 6;
+        frame->flow.sport = ports[f];
+        submit_frame(frame);
+    }
+    frames_sent = 0;
+    order_len = 0;
+    while (frames_sent < 2) {
+        g.listen(&g, 1, 0);
+    }
+    // the long one went first, the short one has the next number
+    uint8_t long_seq = order[0];
+    unsigned long_last = 0, short_last = 0;
+    for (unsigned i = 0; i < order_len; i++) {
+        if (order[i] == long_seq) {
+            long_last = i;
+        } else {
+            assert(order[i] == (uint8_t)(long_seq + 1));
+            short_last = i;
+        }
+    }
+    printf("%u chunks, the long frame done after %u, the short one after %u\n", order_len, long_last + 1, short_last + 1);
+    return short_last < long_last;
+}
+
+int main() {
+    serialif_t fast, slow;
+    memset(&fast, 0, sizeof(fast));
+    memset(&slow, 0, sizeof(slow));
+    fast.send = send_fast;
+    slow.send = send_slow;
+
+    fdglue(&g);
+    init_workers(&g, sender_kick);
+    fast_comm = motecomm(NULL, &fast);
+    init_sender(&g, fast_comm, 200, frame_sent);
+    motecomm_t* slow_comm = motecomm(NULL, &slow);
+    sender_add_link(slow_comm);
+
+    unsigned parts = (FRAME_LEN + MAX_CARRIED - 1) / MAX_CARRIED;
+    send_frames();
+
+    // every chunk went out once, over one of the links
+    for (unsigned seq = 1; seq <= FRAMES; seq++) {
+        assert(seq_chunks[seq] == parts);
+    }
+    assert(link_chunks[0] + link_chunks[1] == FRAMES * parts);
+    // no mote reported anything, the links are as good as each other
+    printf("fast link: %u chunks, slow link: %u chunks\n", link_chunks[0], link_chunks[1]);
+    assert(link_chunks[0] * 2 > link_chunks[1] && link_chunks[1] * 2 > link_chunks[0]);
+
+    // the slow mote says its radio can't keep up
+    for (int i = 0; i < 3; i++) {
+        sender_mote_status(slow_comm, 10, 10, 0);
+    }
+    link_chunks[0] = link_chunks[1] = 0;
+    send_frames();
+    printf("after the slow mote got full - fast link: %u chunks, slow link: %u chunks\n", link_chunks[0], link_chunks[1]);
+    assert(link_chunks[1] > 0);
+    assert(link_chunks[0] > 2 * link_chunks[1]);
+
+    // then the fast one, even more
+    for (int i = 0; i < 5; i++) {
+        sender_mote_status(fast_comm, 10, 10, 0);
+    }
+    link_chunks[0] = link_chunks[1] = 0;
+    send_frames();
+    printf("after the fast mote got full - fast link: %u chunks, slow link: %u chunks\n", link_chunks[0], link_chunks[1]);
+    assert(link_chunks[1] > 2 * link_chunks[0]);
+
+    // a mote whose serial fails is hardly used anymore
+    slow_fails = true;
+    link_chunks[0] = link_chunks[1] = 0;
+    send_frames();
+    slow_fails = false;
+    printf("slow link failing - fast link: %u chunks, slow link: %u chunks\n", link_chunks[0], link_chunks[1]);
+    assert(link_chunks[1] * 10 < link_chunks[0]);
+
+    // the slow link is now the better one, until it gets a low limit
+    char limits[] = "/tmp/sender_test_limits.XXXXXX";
+    close(mkstemp(limits));
+    write_limits(limits, "# the radio of the second mote is poor\nlink 1 3000 200\n");
+    bool loaded = sender_load_limits(limits);
+    assert(loaded);
+    link_chunks[0] = link_chunks[1] = 0;
+    send_frames();
+    printf("slow link limited - fast link: %u chunks, slow link: %u chunks\n", link_chunks[0], link_chunks[1]);
+    assert(link_chunks[0] > link_chunks[1]);
+
+    // a destination held to a rate over both links
+    destination_address = 7;
+    write_limits(limits, "client 7 40000 500\n");
+    loaded = sender_load_limits(limits);
+    assert(loaded);
+    bytes_sent = 0;
+    double start = now_s();
+    send_frames();
+    double elapsed = now_s() - start;
+    printf("%lu bytes to the limited client in %.2f s\n", bytes_sent, elapsed);
+    assert(elapsed >= (bytes_sent - 500) / 40000.0 * 0.9);
+
+    // no file, no limits
+    unlink(limits);
+    loaded = sender_load_limits(limits);
+    assert(!loaded);
+
+    // the chunks of a short packet go in between the ones of a long packet
+    assert(short_done_first(1, 2));
+    // unless they are of the same flow, the other end needs them in order
+    assert(!short_done_first(1, 1));
+
+    // a NACK for the last data chunk of a frame with parity gets that chunk, also when the
+    // history wraps between it and the first parity chunk, which has the same ord_no
+    stream_t data[FRAME_LEN];
+    unsigned const fec_parts = 4, fec_len = 3 * MAX_CARRIED + 10;
+    while ((remembered + fec_parts) % SENDER_HISTORY) {
+        send_frame(data, 10);
+    }
+    fec_report_loss(1, 1);
+    assert(fec_parity_count(fec_parts) > 0);
+    send_frame(data, fec_len);
+    uint8_t fec_seq = order[0];
+    uint8_t const last[] = {fec_parts - 1};
+    resent_len = 0;
+    sender_resend(fec_seq, last, 1);
+    while (!resent_len) {
+        g.listen(&g, 1, 0);
+    }
+    my_packet const* again = (my_packet const*)resent;
+    printf("NACK for chunk %u of a frame with parity, sent again: ord_no %u, flags %02X, %u bytes\n",
+           fec_parts - 1, again->packet_header.ord_no, again->packet_header.flags, resent_len);
+    assert(!(again->packet_header.flags & CHUNK_PARITY) && again->packet_header.ord_no == fec_parts - 1);
+    assert(resent_len == sizeof(my_packet_header) + 10);
+    assert(!memcmp(again->payload, data + (fec_parts - 1) * MAX_CARRIED, 10));
+    // no more parity for the rest
+    while (fec_parity_count(FEC_MAX_PARTS)) {
+        fec_report_loss(1, 0);
+    }
+
+    // a chunk asked for again, held by the limit of its client, does not hold back the others
+    destination_address = 7;
+    order_len = 0;
+    frame_t* frame = get_free_frame();
+    assert(frame);
+    frame->len = 100;
+    frame->compress = false;
+    frame->has_flow = false;
+    submit_frame(frame);
+    frames_sent = 0;
+    while (frames_sent < 1) {
+        g.listen(&g, 1, 0);
+    }
+    uint8_t held_seq = order[0];
+    // a client out of the range of the addresses is not limited, not even truncated
+    write_limits(limits, "client 7 1\nclient 70000 1\n");
+    loaded = sender_load_limits(limits);
+    assert(loaded);
+    uint8_t const ord_nos[] = {0, 1};
+    sender_resend(held_seq, ord_nos, 2);
+    destination_address = 70000 & 0xFFFF;
+    alarm(60);
+    send_frames();
+    alarm(0);
+    // one of them fit in the burst, the other still waits
+    printf("chunks of the held packet sent: %u\n", seq_chunks[held_seq]);
+    assert(seq_chunks[held_seq] == 3);
+    unlink(limits);
+
+    // nor does a frame held by the limit of its client, client 7 is still limited to 1 byte/s
+    uint16_t const clients[2] = {7, 8};
+    order_len = 0;
+    frames_sent = 0;
+    alarm(60);
+    for (unsigned c = 0; c < 2; c++) {
+        destination_address = clients[c];
+        frame = get_free_frame();
+        assert(frame);
+        frame->len = FRAME_LEN;
+        frame->compress = false;
+        frame->has_flow = true;
+        memset(&frame->flow, 0, sizeof(frame->flow));
+        frame->flow.proto = 6;
+        frame->flow.sport = 100 + c;
+        submit_frame(frame);
+        // the frame to client 7 is taken by the sender before the other one is there
+        for (unsigned wait = 0; wait < 10; wait++) {
+            g.listen(&g, 0, 10000);
+        }
+    }
+    while (frames_sent < 1) {
+        g.listen(&g, 1, 0);
+    }
+    alarm(0);
+    // only the chunks of the frame to client 8 went
+    printf("client 8 done after %u chunks\n", order_len);
+    assert(order_len == parts);
+    for (unsigned i = 0; i < order_len; i++) {
+        assert(order[i] == order[0]);
+    }
+
+    close_workers();
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "motecomm.h"
+#include "serialif.h"
+
+#define MESSAGES 1000
+
+static int peer;
+
+/// sends back everything, in pieces of random size
+void* echo(void* arg) {
+    (void)arg;
+    stream_t buf[4096];
+    for (;;) {
+        int got = read(peer, buf, 1 + rand() % sizeof(buf));
+        if (got <= 0) {
+            break;
+        }
+        for (int done = 0; done < got; ) {
+            int piece = 1 + rand() % (got - done);
+            assert(write(peer, buf + done, piece) == piece);
+            done += piece;
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    // the fake interface talks over stdin and stdout, here both are a socket
+    int sv[2];
+    assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    assert(dup2(sv[0], STDIN_FILENO) == STDIN_FILENO);
+    assert(dup2(sv[0], STDOUT_FILENO) == STDOUT_FILENO);
+    peer = sv[1];
+    pthread_t thread;
+    pthread_create(&thread, NULL, echo, NULL);
+
+    serialif_t* sif = serialfakeif(NULL);
+    assert(sif);
+
+    unsigned received = 0;
+    for (unsigned m = 0; m < MESSAGES; m++) {
+        stream_t data[CHUNK_HEADROOM + 100];
+        payload_t out = {.stream = data + CHUNK_HEADROOM, .len = 1 + m % 100, .headroom = CHUNK_HEADROOM};
+        memset(data + CHUNK_HEADROOM, m, out.len);
+        assert(sif->send(sif, out) == (int)(out.len + sizeof(struct message_header_mine_t)));
+
+        // keep a few in flight
+        while (received + 10 < m || (m == MESSAGES - 1 && received < MESSAGES)) {
+            payload_t in;
+            sif->read(sif, &in);
+            if (!in.stream) {
+                continue;
+            }
+            assert(in.len == 1 + received % 100);
+            for (unsigned i = 0; i < in.len; i++) {
+                assert(in.stream[i] == (stream_t)received);
+            }
+            sif->ditch(sif, &in);
+            received++;
+        }
+    }
+    assert(received == MESSAGES);
+    return 0;
+}
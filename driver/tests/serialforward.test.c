@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "motecomm.h"
+#include "serialif.h"
+#include "serialforwardif.h"
+
+#define BURST 5
+
+static int listener;
+
+/// a message as the forwarder sends it: length, header and i + 1 bytes of i
+unsigned make_frame(stream_t* out, unsigned i) {
+    unsigned len = sizeof(struct message_header_mine_t) + i + 1;
+    out[0] = len;
+    memset(out + 1, 0, sizeof(struct message_header_mine_t));
+    memset(out + 1 + sizeof(struct message_header_mine_t), i, i + 1);
+    return 1 + len;
+}
+
+int accept_client(void) {
+    int fd = accept(listener, NULL, NULL);
+    assert(fd >= 0);
+    stream_t version[2];
+    assert(write(fd, "U ", 2) == 2);
+    assert(read(fd, version, 2) == 2 && version[0] == 'U');
+    return fd;
+}
+
+/// plays the serial forwarder
+void* forwarder(void* arg) {
+    (void)arg;
+    int fd = accept_client();
+
+    // all in one write, the reader has to split them
+    stream_t burst[BURST * 64];
+    unsigned len = 0;
+    for (unsigned i = 0; i < BURST; i++) {
+        len += make_frame(burst + len, i);
+    }
+    assert(write(fd, burst, len) == (int)len);
+
+    // what the driver sends
+    stream_t in[1 + sizeof(struct message_header_mine_t) + 3];
+    unsigned got = 0;
+    while (got < sizeof(in)) {
+        int r = read(fd, in + got, sizeof(in) - got);
+        assert(r > 0);
+        got += r;
+    }
+    assert(in[0] == sizeof(in) - 1);
+    assert(!memcmp(in + 1 + sizeof(struct message_header_mine_t), "abc", 3));
+
+    // going away, the driver has to come back
+    close(fd);
+    fd = accept_client();
+    len = make_frame(burst, 42);
+    assert(write(fd, burst, len) == (int)len);
+    sleep(1);
+    close(fd);
+    return NULL;
+}
+
+/// comes back after the driver found out by sending
+void* forwarder_back(void* arg) {
+    (void)arg;
+    int fd = accept_client();
+    stream_t frame[64];
+    unsigned len = make_frame(frame, 7);
+    assert(write(fd, frame, len) == (int)len);
+    sleep(1);
+    close(fd);
+    return NULL;
+}
+
+void check(payload_t payload, unsigned i) {
+    assert(payload.len == i + 1);
+    for (unsigned j = 0; j < payload.len; j++) {
+        assert(payload.stream[j] == i);
+    }
+}
+
+int main() {
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK), .sin_port = 0};
+    socklen_t addr_len = sizeof(addr);
+    assert(!bind(listener, (struct sockaddr*)&addr, sizeof(addr)));
+    assert(!listen(listener, 1));
+    assert(!getsockname(listener, (struct sockaddr*)&addr, &addr_len));
+    char port[8];
+    snprintf(port, sizeof(port), "%u", ntohs(addr.sin_port));
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, forwarder, NULL);
+    serialif_t* sif = serialforwardif(NULL, "127.0.0.1", port);
+    assert(sif);
+
+    payload_t payload;
+    for (unsigned i = 0; i < BURST; i++) {
+        do {
+            sif->read(sif, &payload);
+        } while (!payload.stream);
+        check(payload, i);
+        sif->ditch(sif, &payload);
+    }
+    assert(!sif->pending(sif));
+
+    stream_t abc[CHUNK_HEADROOM + 3];
+    memcpy(abc + CHUNK_HEADROOM, "abc", 3);
+    payload_t out = {.stream = abc + CHUNK_HEADROOM, .len = 3, .headroom = CHUNK_HEADROOM};
+    assert(sif->send(sif, out) == 0);
+
+    // the connection is lost and comes back
+    do {
+        sif->read(sif, &payload);
+    } while (!payload.stream);
+    check(payload, 42);
+    sif->ditch(sif, &payload);
+
+    pthread_join(thread, NULL);
+
+    // sending to the closed connection fails, without a SIGPIPE, and the driver reconnects
+    int sent = 0;
+    for (unsigned i = 0; i < 3 && sent == 0; i++) {
+        sent = sif->send(sif, out);
+        usleep(10000);
+    }
+    assert(sent == -1);
+    pthread_create(&thread, NULL, forwarder_back, NULL);
+    do {
+        sif->read(sif, &payload);
+    } while (!payload.stream);
+    check(payload, 7);
+    sif->ditch(sif, &payload);
+    pthread_join(thread, NULL);
+
+    DTOR(sif);
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "motecomm.h"
+#include "serialif.h"
+#include "hdlc.h"
+
+#define MESSAGES 500
+
+// the mote side of a pty
+static int mote;
+static unsigned frames_seen = 0;
+// how often every message got to the mote, it comes twice when its ack is lost
+static unsigned delivered[MESSAGES];
+static unsigned delivered_count = 0;
+
+void mote_write(stream_t const* data, unsigned len) {
+    while (len) {
+        int done = write(mote, data, len);
+        assert(done > 0);
+        data += done;
+        len -= done;
+    }
+}
+
+/// the message number m: its number in the first two bytes, 2 + m % 100 bytes long
+unsigned message_number(stream_t const* data, unsigned len) {
+    unsigned m = (data[0] << 8) | data[1];
+    assert(m < MESSAGES && len == 2 + m % 100);
+    for (unsigned i = 2; i < len; i++) {
+        assert(data[i] == (stream_t)m);
+    }
+    return m;
+}
+
+/// like the serial stack of TinyOS: every frame that arrives is taken and acknowledged
+/// on its own, whatever happened to the ones before; some frames and some acks get lost
+void mote_frame(void* p, uint8_t protocol, stream_t const* frame, unsigned len) {
+    (void)p;
+    assert(protocol == HDLC_P_PACKET_ACK);
+    frames_seen++;
+    if (rand() % 20 == 0) {
+        return;
+    }
+    if (rand() % 20) {
+        stream_t ack[HDLC_ENCODED_SIZE(0)];
+        mote_write(ack, hdlc_encode(ack, HDLC_P_ACK, frame[0], NULL, 0));
+    }
+
+    // check the message and echo it back as a plain packet
+    struct message_header_mine_t const* mh = (struct message_header_mine_t const*)(frame + 1);
+    assert(len == 1 + sizeof(struct message_header_mine_t) + mh->msglen);
+    unsigned m = message_number(frame + 1 + sizeof(struct message_header_mine_t), mh->msglen);
+    if (!delivered[m]++) {
+        delivered_count++;
+    }
+    stream_t echo[HDLC_ENCODED_SIZE(HDLC_MTU)];
+    mote_write(echo, hdlc_encode(echo, HDLC_P_PACKET_NO_ACK, -1, frame + 1, len - 1));
+}
+
+void* mote_run(void* arg) {
+    (void)arg;
+    hdlc_decoder_t dec;
+    hdlc_decoder_init(&dec);
+    stream_t buf[512];
+    while (delivered_count < MESSAGES) {
+        struct pollfd pfd = {.fd = mote, .events = POLLIN};
+        if (poll(&pfd, 1, 20) == 0) {
+            continue;
+        }
+        int got = read(mote, buf, sizeof(buf));
+        if (got > 0) {
+            hdlc_decode(&dec, buf, got, mote_frame, NULL);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    mote = posix_openpt(O_RDWR | O_NOCTTY);
+    assert(mote >= 0);
+    assert(!grantpt(mote) && !unlockpt(mote));
+
+    serialif_t* sif = serialif(NULL, ptsname(mote), "telosb", NULL);
+    assert(sif);
+    pthread_t thread;
+    pthread_create(&thread, NULL, mote_run, NULL);
+
+    // a frame given up on is never echoed, the test would wait forever
+    alarm(60);
+    static bool echoed[MESSAGES];
+    unsigned received = 0, duplicates = 0;
+    for (unsigned m = 0; m < MESSAGES; m++) {
+        stream_t data[CHUNK_HEADROOM + 2 + 100];
+        payload_t out = {.stream = data + CHUNK_HEADROOM, .len = 2 + m % 100, .headroom = CHUNK_HEADROOM};
+        memset(data + CHUNK_HEADROOM, m, out.len);
+        data[CHUNK_HEADROOM] = m >> 8;
+        data[CHUNK_HEADROOM + 1] = m & 0xFF;
+        int sent = sif->send(sif, out);
+        assert(sent == (int)(out.len + sizeof(struct message_header_mine_t)));
+
+        // the frames lost before an acknowledged one are sent again as well
+        while (sif->pending(sif) || (m == MESSAGES - 1 && received < MESSAGES)) {
+            payload_t in;
+            sif->read(sif, &in);
+            if (!in.stream) {
+                continue;
+            }
+            unsigned n = message_number(in.stream, in.len);
+            if (echoed[n]) {
+                duplicates++;
+            } else {
+                echoed[n] = true;
+                received++;
+            }
+            sif->ditch(sif, &in);
+        }
+    }
+    pthread_join(thread, NULL);
+    printf("%u messages in %u frames, %u came twice\n", MESSAGES, frames_seen, duplicates);
+    assert(received == MESSAGES);
+    DTOR(sif);
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -14,6 +15,13 @@
 
 static int msg_size;
 static int num_msgs;
+static int completed = 0;
+static unsigned completed_len = 0;
+
+void count_completed(payload_t complete) {
+    completed++;
+    completed_len = complete.len;
+}
 
 /** 
  * Swap two messages at the given positions
@@ -51,6 +59,8 @@ void get_random_msg(payload_t *data, int size) {
     int nread = read(fd, (void *) data->stream, size);
     data->len = size;
     assert(nread == size);
+    // the type of the frame is in the first byte, random data could look like a bundle
+    ((stream_t*)data->stream)[0] = 0x45;
 }
 
 /** 
@@ -91,14 +101,14 @@ int main(int argc, char *argv[]) {
         num_msgs = NUM_MSGS;
     }
     
-    payload_t fixed_payload;
+    payload_t fixed_payload = {.is_compressed = false};
     stream_t buff[msg_size];
     fixed_payload.stream = buff;
     fixed_payload.len = msg_size;
 
     get_random_msg(&fixed_payload, msg_size);
     /* simple_test(fixed_payload); */
-    init_reconstruction(NULL);
+    init_reconstruction(count_completed);
 
     int parts = needed_chunks(msg_size);
     payload_t result[parts * num_msgs];
@@ -115,5 +125,57 @@ int main(int argc, char *argv[]) {
             assert(chunks[i] == buff[i]);
         }
     }
+    assert(completed == num_msgs);
+
+    // every chunk flooded once more: dropped, nothing completed twice
+    chunk_stats_t stats;
+    get_chunk_statistics(&stats);
+    unsigned long duplicates = stats.duplicates;
+    add_random_order(result, parts * num_msgs);
+    get_chunk_statistics(&stats);
+    assert(stats.duplicates == duplicates + parts * num_msgs);
+    assert(completed == num_msgs);
+
+    // a duplicate in the middle of a packet does not change its length
+    stream_t big[MAX_CARRIED * 3 + 10];
+    payload_t big_payload = {.stream = big, .len = sizeof(big), .is_compressed = false};
+    get_random_msg(&big_payload, sizeof(big));
+    int big_parts = needed_chunks(sizeof(big));
+    payload_t chunks_of_big[big_parts];
+    seq_no_t seq = num_msgs + 1;
+    for (int i = 0; i < big_parts; i++) {
+        chunks_of_big[i].stream = malloc(sizeof(my_packet));
+        gen_packet(&big_payload, (my_packet *) chunks_of_big[i].stream, &(chunks_of_big[i].len), seq, big_parts);
+    }
+    add_chunk(chunks_of_big[0]);
+    add_chunk(chunks_of_big[big_parts - 1]);
+    add_chunk(chunks_of_big[0]);
+    add_chunk(chunks_of_big[big_parts - 1]);
+    for (int i = 1; i < big_parts; i++) {
+        add_chunk(chunks_of_big[i]);
+    }
+    assert(completed == num_msgs + 1 && completed_len == sizeof(big));
+    chunks = get_chunks(seq);
+    for (unsigned i = 0; i < sizeof(big); i++) {
+        assert(chunks[i] == big[i]);
+    }
+    get_chunk_statistics(&stats);
+    assert(stats.duplicates == duplicates + parts * num_msgs + 3);
+    assert(stats.invalid == 0);
+
+    // a chunk of no parts or of more than a frame can have is dropped, its slot is left alone
+    int const bad_parts[] = {0, MAX_FRAME_CHUNKS + 1, 255};
+    for (unsigned i = 0; i < sizeof(bad_parts) / sizeof(bad_parts[0]); i++) {
+        my_packet bad;
+        memset(&bad, 0, sizeof(bad));
+        bad.packet_header.seq_no = seq;
+        bad.packet_header.parts = bad_parts[i];
+        add_chunk((payload_t){.stream = (stream_t*)&bad, .len = sizeof(my_packet_header) + MAX_CARRIED});
+    }
+    get_chunk_statistics(&stats);
+    assert(stats.invalid == 3 && completed == num_msgs + 1);
+    chunks = get_chunks(seq);
+    assert(chunks && !memcmp(chunks, big, sizeof(big)));
+    print_statistics();
     return 0;
 }
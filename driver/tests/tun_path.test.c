@@ -0,0 +1,272 @@
+/**
+ * Packets go the way the ones read from the tun go: through tun_receive,
+ * the priority queues and the header compression, up to the workers.
+ * A socket stands in for the tun device, it gives the packets the way the
+ * device opened by tun_open does: the packet information (struct tun_pi)
+ * first, then the ip packet.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/if_tun.h>
+
+#include "util.h"
+#include "glue.h"
+#include "tunnel.h"
+#include "workers.h"
+#include "qos.h"
+#include "flow.h"
+#include "headercomp.h"
+#include "bundle.h"
+#include "setup.h"
+#include "mss.h"
+
+static fdglue_t g;
+static int tun[2];
+static struct Tun_handler_info thi = {.client_no = DEFAULT_CLIENT_NO};
+static fdglue_handler_t hand_tun = {.p = &thi, .handle = tun_receive};
+
+// the frames the workers are done with, kept until released
+static frame_t* ready[WORKER_FRAMES];
+static unsigned ready_count = 0;
+
+static stream_t pkt[MAX_FRAME_SIZE];
+
+void collect(void) {
+    frame_t* frame;
+    while ((frame = next_ready_frame())) {
+        ready[ready_count++] = frame;
+    }
+}
+
+/// wait for the next frame out of the workers
+frame_t* wait_frame(void) {
+    while (!ready_count) {
+        g.listen(&g, 1, 0);
+    }
+    frame_t* frame = ready[0];
+    memmove(ready, ready + 1, --ready_count * sizeof(ready[0]));
+    return frame;
+}
+
+/// the frame was sent, the next packets can go
+void done(frame_t* frame) {
+    release_frame(frame);
+    tun_feed();
+}
+
+/// a tcp segment of that size, ports and flags, random data after the header
+payload_t tcp(unsigned len, uint16_t sport, uint16_t dport, uint8_t flags, uint32_t seq) {
+    memset(pkt, 0, 40);
+    pkt[0] = 0x45;
+    pkt[2] = len >> 8;
+    pkt[3] = len & 0xFF;
+    pkt[8] = 64;
+    pkt[9] = 6;
+    pkt[12] = 10;
+    pkt[15] = 1;
+    pkt[16] = 10;
+    pkt[19] = 2;
+    pkt[20] = sport >> 8;
+    pkt[21] = sport & 0xFF;
+    pkt[22] = dport >> 8;
+    pkt[23] = dport & 0xFF;
+    for (unsigned i = 0; i < 4; i++) {
+        pkt[24 + i] = seq >> (24 - 8 * i);
+    }
+    pkt[32] = 5 << 4;
+    pkt[33] = flags;
+    pkt[34] = 0xFF;
+    for (unsigned i = 40; i < len; i++) {
+        pkt[i] = rand();
+    }
+    return (payload_t){.stream = pkt, .len = len};
+}
+
+/// an udp datagram marked as expedited forwarding
+payload_t udp_ef(unsigned len, uint16_t sport) {
+    payload_t packet = tcp(len, sport, 5060, 0, 0);
+    pkt[1] = 46 << 2;
+    pkt[9] = 17;
+    pkt[24] = (len - 20) >> 8;
+    pkt[25] = (len - 20) & 0xFF;
+    pkt[26] = pkt[27] = 0;
+    return packet;
+}
+
+/// a tcp SYN asking for that MSS
+payload_t syn(uint16_t sport, uint16_t mss) {
+    payload_t packet = tcp(44, sport, 80, 0x02, 1);
+    pkt[32] = (24 / 4) << 4;
+    pkt[40] = 2;
+    pkt[41] = 4;
+    pkt[42] = mss >> 8;
+    pkt[43] = mss & 0xFF;
+    return packet;
+}
+
+uint16_t mss_option(stream_t const* packet) {
+    return (packet[42] << 8) | packet[43];
+}
+
+/// the tun has a packet to read
+void from_tun(payload_t packet) {
+    stream_t framed[sizeof(struct tun_pi) + packet.len];
+    // no flags, ETH_P_IP
+    stream_t const pi[] = {0x00, 0x00, 0x08, 0x00};
+    memcpy(framed, pi, sizeof(pi));
+    memcpy(framed + sizeof(pi), packet.stream, packet.len);
+    assert(write(tun[1], framed, sizeof(framed)) == (int)sizeof(framed));
+    tun_receive(&hand_tun);
+}
+
+int main() {
+    fdglue(&g);
+    init_workers(&g, collect);
+    init_qos();
+    init_header_compression();
+    init_flows();
+#if BUNDLING_ENABLED
+    init_bundling(&g, tun_feed);
+#endif
+    // keeps the boundaries of the packets, like the tun without IFF_NO_PI
+    assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, tun) == 0);
+    set_fd(DEFAULT_CLIENT_NO, tun[0]);
+
+    // a bulk transfer: the headers are sent in full a few times, then compressed
+    for (unsigned i = 0; i < HC_FULL_REPEAT + 2; i++) {
+        from_tun(tcp(1000, 5000, 80, 0x18, 1 + i * 960));
+        frame_t* frame = wait_frame();
+        // the flow is the one of the ip packet, not shifted by the packet information
+        assert(frame->has_flow);
+        assert(frame->flow.proto == 6 && frame->flow.sport == 5000 && frame->flow.dport == 80);
+#if HEADER_COMPRESSION_ENABLED
+        unsigned type = frame->raw[0] >> 4;
+        printf("packet %u: %u bytes, type %X\n", i, frame->len, type);
+        assert(type == ((i < HC_FULL_REPEAT) ? HC_TYPE_REFRESH : HC_TYPE_COMPRESSED));
+        if (type == HC_TYPE_COMPRESSED) {
+            assert(frame->len < 1000);
+        }
+#else
+        assert(frame->len == 1000 && frame->raw[0] == 0x45);
+#endif
+        done(frame);
+    }
+
+    // the pipeline is kept full, so that the next packets wait in the queues
+    frame_t* held[QOS_PIPELINE_DEPTH];
+    for (unsigned i = 0; i < QOS_PIPELINE_DEPTH; i++) {
+        from_tun(tcp(1000, 6000, 80, 0x18, 1 + i * 960));
+        held[i] = wait_frame();
+    }
+    // a bulk flow with a backlog, another flow behind it and a voice packet too big to be small
+    for (unsigned i = 0; i < 4; i++) {
+        from_tun(tcp(1000, 6000, 80, 0x18, 1 + (QOS_PIPELINE_DEPTH + i) * 960));
+    }
+    from_tun(tcp(1000, 6001, 80, 0x18, 1));
+    from_tun(udp_ef(200, 7000));
+    assert(qos_queued() == 6);
+    for (unsigned i = 0; i < QOS_PIPELINE_DEPTH; i++) {
+        done(held[i]);
+    }
+    uint16_t order[6];
+    for (unsigned i = 0; i < 6; i++) {
+        frame_t* frame = wait_frame();
+        assert(frame->has_flow);
+        order[i] = frame->flow.sport;
+        done(frame);
+    }
+    printf("left the queues: %u %u %u %u %u %u\n", order[0], order[1], order[2], order[3], order[4], order[5]);
+    // the class is known from the ip header, not from the packet information
+    qos_stats_t stats;
+    qos_get_stats(QOS_INTERACTIVE, &stats);
+    assert(order[0] == 7000 && stats.sent == 1);
+    // and the flows from the ports, the second one does not wait for the whole backlog
+    assert(order[1] == 6001 || order[2] == 6001);
+
+#if QOS_ACK_FILTER
+    // the acks of a download waiting behind a full pipeline, only the newest one goes
+    for (unsigned i = 0; i < QOS_PIPELINE_DEPTH; i++) {
+        from_tun(tcp(1000, 6000, 80, 0x18, 1 + (8 + i) * 960));
+        held[i] = wait_frame();
+    }
+    for (unsigned i = 0; i < 3; i++) {
+        payload_t ack = tcp(40, 6002, 80, 0x10, 1);
+        pkt[31] = 1 + i;
+        from_tun(ack);
+    }
+    unsigned long filtered = 0;
+    for (qos_class_t c = 0; c < QOS_CLASSES; c++) {
+        qos_get_stats(c, &stats);
+        filtered += stats.acks_filtered;
+    }
+    assert(filtered == 2 && qos_queued() == 1);
+    for (unsigned i = 0; i < QOS_PIPELINE_DEPTH; i++) {
+        done(held[i]);
+    }
+    frame_t* ack = wait_frame();
+    assert(ack->has_flow && ack->flow.sport == 6002);
+    done(ack);
+#endif
+
+    // the SYNs are clamped both ways, the packet information does not get in the way
+    uint16_t clamped = mss_value() ? mss_value() : 1460;
+    from_tun(syn(6100, 1460));
+    frame_t* frame = wait_frame();
+    payload_t sent = {.stream = frame->raw, .len = frame->len};
+#if HEADER_COMPRESSION_ENABLED
+    stream_t restored_data[MAX_FRAME_SIZE];
+    payload_t restored = {.stream = restored_data, .len = sizeof(restored_data)};
+    bool decompressed = header_decompress(sent, &restored);
+    assert(decompressed);
+    sent = restored;
+#endif
+    assert(sent.len == 44 && mss_option(sent.stream) == clamped);
+    done(frame);
+
+    payload_t incoming = syn(6101, 1460);
+#if HEADER_COMPRESSION_ENABLED
+    stream_t compressed_data[MAX_FRAME_SIZE];
+    payload_t compressed = {.stream = compressed_data, .len = sizeof(compressed_data)};
+    bool compressed_ok = header_compress(incoming, &compressed);
+    assert(compressed_ok);
+    incoming = compressed;
+#endif
+    reconstruct_done(incoming);
+    stream_t written[MAX_FRAME_SIZE];
+    int nread = read(tun[1], written, sizeof(written));
+    assert(nread == (int)sizeof(struct tun_pi) + 44 && written[2] == 0x08 && written[3] == 0x00);
+    assert(mss_option(written + sizeof(struct tun_pi)) == clamped);
+    printf("SYNs clamped to a MSS of %u both ways\n", clamped);
+
+    // a packet of the MTU of the tun, as it is chunked, does not spill into one more chunk
+    if (mss_mtu()) {
+        for (unsigned i = 0; i < HC_FULL_REPEAT + 1; i++) {
+            from_tun(tcp(mss_mtu(), 6200, 80, 0x18, 1 + i * mss_value()));
+            frame = wait_frame();
+            printf("packet of %u bytes sent as %u bytes in %u chunks\n", mss_mtu(), frame->len, frame->parts);
+            assert(frame->len <= mss_mtu() + MSS_FRAME_GROWTH);
+            assert(frame->parts == (mss_mtu() + MSS_FRAME_GROWTH) / MAX_CARRIED);
+            done(frame);
+        }
+    }
+
+#if BUNDLING_ENABLED
+    // a small packet opens a bundle, the next one has no room behind it
+    from_tun(tcp(60, 5001, 80, 0x10, 1));
+    from_tun(tcp(MAX_FRAME_SIZE - 10, 5002, 80, 0x18, 1));
+    frame_t* bundle = wait_frame();
+    frame_t* big = wait_frame();
+    printf("bundle closed early: %u bytes, then %u bytes\n", bundle->len, big->len);
+    assert(bundle->len < BUNDLE_MAX_PACKET && bundle->has_flow && bundle->flow.sport == 5001);
+    assert(big->len == MAX_FRAME_SIZE - 10 && big->has_flow && big->flow.sport == 5002);
+    done(bundle);
+    done(big);
+#endif
+
+    close_workers();
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "structs.h"
+#include "compress.h"
+#include "chunker.h"
+#include "glue.h"
+#include "workers.h"
+
+#define NUM_FRAMES 200
+#define FRAME_LEN 1400
+
+int submitted = 0;
+int received = 0;
+
+/**
+ * Deterministic content for the frame number i, odd frames do not compress.
+ */
+void fill_frame(stream_t *buf, int i) {
+    for (int j = 0; j < FRAME_LEN; j++) {
+        buf[j] = (i % 2) ? rand() : (stream_t)(i + j / 64);
+    }
+    // the first bytes identify the frame
+    buf[0] = i >> 8;
+    buf[1] = i;
+}
+
+/**
+ * Called in the main thread, checks the frames come back in order.
+ */
+void collect(void) {
+    frame_t *frame;
+    while ((frame = next_ready_frame())) {
+        // the data is spread over the payloads of the chunks
+        stream_t joined[MAX_FRAME_SIZE];
+        for (unsigned i = 0; i < frame->parts; i++) {
+            unsigned len = chunk_size(frame->chunked_len, i) - sizeof(my_packet_header);
+            memcpy(joined + i * MAX_CARRIED, frame->chunks[i].packet.payload, len);
+        }
+        assert(frame->parts == needed_chunks(frame->chunked_len));
+
+        stream_t restored_data[MAX_FRAME_SIZE];
+        payload_t restored = {
+            .stream = joined,
+            .len = frame->chunked_len
+        };
+        if (frame->is_compressed) {
+            payload_t compressed = restored;
+            restored.stream = restored_data;
+            restored.len = MAX_FRAME_SIZE;
+            payload_decompress(compressed, &restored);
+        }
+        assert(restored.len == FRAME_LEN);
+        assert(restored.stream[0] == (received >> 8));
+        assert(restored.stream[1] == (received & 0xFF));
+        // only the compressible ones get smaller
+        assert(frame->is_compressed == !(received % 2));
+        release_frame(frame);
+        received++;
+    }
+}
+
+int main() {
+    fdglue_t fdg;
+    fdglue(&fdg);
+    init_compression();
+    init_workers(&fdg, collect);
+
+    while (received < NUM_FRAMES) {
+        frame_t *frame;
+        while (submitted < NUM_FRAMES && (frame = get_free_frame())) {
+            fill_frame(frame->raw, submitted++);
+            frame->len = FRAME_LEN;
+            frame->compress = true;
+            frame->has_flow = false;
+            submit_frame(frame);
+        }
+        fdg.listen(&fdg, 5, 0);
+    }
+    printf("%d frames compressed by %d threads came back in order\n", received, WORKER_THREADS);
+
+    close_workers();
+    close_compression();
+    return 0;
+}
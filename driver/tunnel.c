@@ -14,10 +14,12 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/if_ether.h>
 #include <arpa/inet.h>  
 #include <assert.h>
 
@@ -97,10 +99,31 @@ int tun_open(int client_no, char *dev) {
 
     // Set the global ifname variable 
     memcpy(ifname, dev, IFNAMSIZ);
+    tun_devices[client_no].ifname = ifname;
 
     return 1;
 }
 
+int tun_set_mtu(int client_no, int mtu) {
+    struct ifreq ifr;
+    int err;
+    // any socket does for the ioctl
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("Opening a socket to set the MTU");
+        return sock;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, tun_devices[client_no].ifname, IFNAMSIZ);
+    ifr.ifr_mtu = mtu;
+    if ((err = ioctl(sock, SIOCSIFMTU, (void *) &ifr)) < 0) {
+        perror("Setting the MTU");
+    }
+    close(sock);
+    return err;
+}
+
 void close_all_tunnels() {
     int fd;
     for (int i = 0; i < MAX_CLIENTS; i++) {
@@ -114,22 +137,41 @@ void close_all_tunnels() {
 int tun_read(int client_no, char *buf, int length){
     int fd = get_fd(client_no);
     int nread;
-
-    if((nread = read(fd, buf, length)) < 0){
+    // the packet information is read apart, so the packet lands at the start of buf
+    struct tun_pi pi;
+    struct iovec iov[2] = {
+        {.iov_base = &pi, .iov_len = sizeof(pi)},
+        {.iov_base = buf, .iov_len = length}
+    };
+
+    if((nread = readv(fd, iov, 2)) < 0){
         perror("Reading data");
         exit(1);
     }
-    return nread;
+    if (nread < (int)sizeof(pi) || (pi.flags & TUN_PKT_STRIP)) {
+        LOG_WARNING("dropping a truncated packet from the tun");
+        return 0;
+    }
+    return nread - sizeof(pi);
 }
 
 void tun_write(int client_no, payload_t data){
     int nwrite;
     int fd = get_fd(client_no);
+    // the kernel wants to be told what kind of packet it gets
+    struct tun_pi pi = {
+        .flags = 0,
+        .proto = htons((data.len && (data.stream[0] >> 4) == 6) ? ETH_P_IPV6 : ETH_P_IP)
+    };
+    struct iovec iov[2] = {
+        {.iov_base = &pi, .iov_len = sizeof(pi)},
+        {.iov_base = (void*)data.stream, .iov_len = data.len}
+    };
     
     // should not exit directly here maybe?
-    if((nwrite = write(fd, data.stream, data.len)) < 0) {
+    if((nwrite = writev(fd, iov, 2)) < 0) {
         perror("Writing data");
         exit(1);
     }
-    assert((unsigned) nwrite == data.len);
+    assert((unsigned) nwrite == sizeof(pi) + data.len);
 }
@@ -18,6 +18,16 @@
  */
 int tun_open(int client_no, char *dev);
 
+/** 
+ * Set the MTU of the device opened for the client.
+ * 
+ * @param client_no 
+ * @param mtu 
+ * 
+ * @return Error-code.
+ */
+int tun_set_mtu(int client_no, int mtu);
+
 /** 
  * @param client_no 
  * 
@@ -25,6 +35,14 @@ int tun_open(int client_no, char *dev);
  */
 int get_fd(int client_no);
 
+/** 
+ * Use a file descriptor already open for the client, instead of a tun device.
+ * 
+ * @param client_no 
+ * @param fd 
+ */
+void set_fd(int client_no, int fd);
+
 /** 
  * Close everything gracefully
  * 
@@ -34,17 +52,20 @@ void close_all_tunnels();
 
 /** 
  * Reads data from the tunnel and exits if a error occurred.
+ * The packet information the kernel puts in front (struct tun_pi) is
+ * stripped, buf gets the bare ip packet.
  * 
  * @param client_no
  * @param buf This is where the read data are written.
  * @param length maximum number of bytes to read.
  * 
- * @return number of bytes read.
+ * @return number of bytes read, 0 if the packet was dropped.
  */
 int tun_read(int client_no, char *buf, int n);
 
 /** 
  * Write on tun device without using the fancy queue
+ * The packet information the kernel expects is put in front.
  * 
  * @param client_no client connected
  * @param data payload to write
@@ -0,0 +1,212 @@
+/**
+ * Compression thread pool, see workers.h
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "compress.h"
+#include "chunker.h"
+#include "workers.h"
+
+#define POS(x) ((x) % WORKER_FRAMES)
+
+static frame_t* frames;
+// frames [head, taken) were given to the sender, [taken, next) are being compressed
+// or are done, [next, tail) are queued
+static unsigned head, taken, next, tail;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_t threads[WORKER_THREADS];
+static bool running;
+
+// the workers write a byte into it for every completed frame
+static int notify_pipe[2];
+static void (*frames_ready)(void);
+
+/**
+ * Compress a frame into its chunks, keeping the original data if it does not get smaller.
+ *
+ * @param strm the compression stream of the calling thread
+ * @param frame frame to compress
+ */
+void _workers_compress(z_stream* strm, frame_t* frame) {
+    payload_t raw = {
+        .stream = frame->raw,
+        .len = frame->len,
+        .is_compressed = false
+    };
+
+    // no more space than the original, so deflate stops when it does not pay off
+    frame->is_compressed = frame->compress && frame->len > 1
+        && stream_compress_chunks(strm, raw, frame->chunks, frame->len - 1, &frame->chunked_len) == Z_OK;
+    if (frame->is_compressed) {
+        print_gained(raw.len, frame->chunked_len);
+        frame->parts = needed_chunks(frame->chunked_len);
+    } else {
+        if (frame->compress) {
+            LOG_DEBUG("compression disabled, non compressible data");
+        }
+        frame->chunked_len = raw.len;
+        frame->parts = split_payload(raw, frame->chunks);
+    }
+    if (frame->compress && frame->has_flow) {
+        flow_record(&frame->flow, frame->is_compressed);
+    }
+
+    frame->parity = FEC_ENABLED ? fec_parity_count(frame->parts) : 0;
+    if (frame->parity) {
+        stream_t const* data[FEC_MAX_PARTS];
+        stream_t* parity[FEC_MAX_PARITY];
+        for (unsigned j = 0; j < frame->parts; j++) {
+            data[j] = frame->chunks[j].packet.payload;
+        }
+        for (unsigned i = 0; i < frame->parity; i++) {
+            parity[i] = frame->chunks[frame->parts + i].packet.payload;
+        }
+        unsigned last_len = frame->chunked_len - (frame->parts - 1) * MAX_CARRIED;
+        fec_encode(data, frame->parts, last_len, frame->parity, parity);
+    }
+}
+
+/**
+ * Main function of every worker thread.
+ */
+void* _workers_run(void* arg) {
+    (void)arg;
+    z_stream strm;
+    init_compressor(&strm);
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (running && next == tail) {
+            pthread_cond_wait(&queued, &lock);
+        }
+        if (!running) {
+            break;
+        }
+        frame_t* frame = &frames[POS(next++)];
+        frame->state = FRAME_BUSY;
+        pthread_mutex_unlock(&lock);
+
+        _workers_compress(&strm, frame);
+
+        pthread_mutex_lock(&lock);
+        frame->state = FRAME_DONE;
+        char c = 0;
+        if (write(notify_pipe[1], &c, 1) != 1) {
+            LOG_WARNING("could not notify the main thread");
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    close_compressor(&strm);
+    return NULL;
+}
+
+/**
+ * Invoked by the glue module when some worker completed a frame.
+ */
+void _workers_notified(fdglue_handler_t* that) {
+    (void)that;
+    char buf[WORKER_FRAMES];
+    // the pipe is non blocking, empty it
+    while (read(notify_pipe[0], buf, sizeof(buf)) > 0);
+    frames_ready();
+}
+
+void init_workers(fdglue_t* g, void (*ready)(void)) {
+    assert(ready);
+    frames = calloc(WORKER_FRAMES, sizeof(frame_t));
+    assert(frames);
+    head = taken = next = tail = 0;
+    frames_ready = ready;
+
+    if (pipe(notify_pipe) == -1) {
+        LOG_ERROR("could not create the notification pipe");
+        exit(1);
+    }
+    fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK);
+    fdglue_handler_t hand_notify = {
+        .p = NULL,
+        .handle = _workers_notified
+    };
+    g->set_handler(g, notify_pipe[0], FDGHT_READ, hand_notify, FDGHR_APPEND, NULL);
+
+    running = true;
+    for (int i = 0; i < WORKER_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, _workers_run, NULL)) {
+            LOG_ERROR("could not start compression thread %d", i);
+            exit(1);
+        }
+    }
+    LOG_DEBUG("started %d compression threads", WORKER_THREADS);
+}
+
+void close_workers(void) {
+    pthread_mutex_lock(&lock);
+    running = false;
+    pthread_cond_broadcast(&queued);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < WORKER_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    close(notify_pipe[0]);
+    close(notify_pipe[1]);
+    free(frames);
+    frames = NULL;
+}
+
+frame_t* get_free_frame(void) {
+    frame_t* frame = NULL;
+    pthread_mutex_lock(&lock);
+    if (tail - head < WORKER_FRAMES) {
+        frame = &frames[POS(tail)];
+        assert(frame->state == FRAME_FREE);
+    }
+    pthread_mutex_unlock(&lock);
+    return frame;
+}
+
+void submit_frame(frame_t* frame) {
+    pthread_mutex_lock(&lock);
+    assert(frame == &frames[POS(tail)]);
+    frame->state = FRAME_QUEUED;
+    tail++;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+}
+
+unsigned pending_frames(void) {
+    pthread_mutex_lock(&lock);
+    unsigned pending = tail - head;
+    pthread_mutex_unlock(&lock);
+    return pending;
+}
+
+frame_t* next_ready_frame(void) {
+    frame_t* frame = NULL;
+    pthread_mutex_lock(&lock);
+    if (taken != tail && frames[POS(taken)].state == FRAME_DONE) {
+        frame = &frames[POS(taken++)];
+        frame->state = FRAME_SENDING;
+    }
+    pthread_mutex_unlock(&lock);
+    return frame;
+}
+
+void release_frame(frame_t* frame) {
+    pthread_mutex_lock(&lock);
+    assert(frame->state == FRAME_SENDING);
+    frame->state = FRAME_FREE;
+    // the slots come back in order, the ones released early wait for the older ones
+    while (head != taken && frames[POS(head)].state == FRAME_FREE) {
+        head++;
+    }
+    pthread_mutex_unlock(&lock);
+}
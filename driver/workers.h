@@ -0,0 +1,107 @@
+/**
+ * Pool of threads compressing the packets read from the tun device.
+ *
+ * Frames live in a small ring. The main thread fills a free frame and
+ * submits it, one of the workers compresses it and the main thread gets the
+ * frames back in the same order they were submitted, so the packet N+1 can
+ * be compressed while the packet N is still being sent over the serial.
+ * Several frames can be given to the sender at once and released in any
+ * order.
+ *
+ * @author Andrea Crotti, Marius Grysla, Oscar Dustmann
+ */
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "structs.h"
+#include "glue.h"
+#include "flow.h"
+#include "fec.h"
+
+/// number of compression threads
+#ifndef WORKER_THREADS
+#define WORKER_THREADS 2
+#endif
+
+/// frames that can be in the pipeline (compressing or waiting to be sent)
+#ifndef WORKER_FRAMES
+#define WORKER_FRAMES 8
+#endif
+
+/// chunks needed for the biggest frame
+#define FRAME_CHUNKS ((MAX_FRAME_SIZE + MAX_CARRIED - 1) / MAX_CARRIED)
+
+typedef enum {
+    FRAME_FREE = 0,
+    FRAME_QUEUED,
+    FRAME_BUSY,
+    FRAME_DONE,
+    FRAME_SENDING
+} frame_state_t;
+
+/**
+ * A packet going through the pipeline.
+ */
+typedef struct frame_t {
+    frame_state_t state;
+    /// try to deflate the data, otherwise it's sent as it is
+    bool compress;
+    /// the packet belongs to this flow, if set, and the outcome of the compression is recorded for it
+    bool has_flow;
+    flow_key_t flow;
+    /// length of the data written by the main thread into raw
+    streamlen_t len;
+    stream_t raw[MAX_FRAME_SIZE];
+    /// set by the workers: the data to send already split, only the headers are missing,
+    /// followed by the parity chunks
+    chunk_t chunks[FRAME_CHUNKS + FEC_MAX_PARITY];
+    unsigned parts;
+    unsigned parity;
+    /// total length of the data in the chunks
+    streamlen_t chunked_len;
+    bool is_compressed;
+} frame_t;
+
+/**
+ * Start the worker threads.
+ *
+ * @param g the glue object, used to be woken up when a frame is completed
+ * @param ready called in the main thread whenever frames are completed
+ */
+void init_workers(fdglue_t* g, void (*ready)(void));
+
+/**
+ * Stop the worker threads and release their resources.
+ */
+void close_workers(void);
+
+/**
+ * @return the next frame that can be filled, or NULL if the pipeline is full
+ */
+frame_t* get_free_frame(void);
+
+/**
+ * Hand a frame obtained with get_free_frame over to the workers.
+ * raw, len, compress and has_flow must have been set.
+ */
+void submit_frame(frame_t* frame);
+
+/**
+ * @return frames submitted and not released yet
+ */
+unsigned pending_frames(void);
+
+/**
+ * Take the oldest completed frame not taken yet.
+ *
+ * @return the frame, NULL if the next one is not completed
+ */
+frame_t* next_ready_frame(void);
+
+/**
+ * Give back a frame obtained with next_ready_frame once it has been sent,
+ * not necessarily in the order they were taken.
+ */
+void release_frame(frame_t* frame);
+
+#endif /* WORKERS_H */
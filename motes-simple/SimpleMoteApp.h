@@ -38,6 +38,14 @@ enum {
     PACKET_QUEUE_SIZE = 16
 };
 
+/*
+ * Messages from the serial between two reports of the radio queue,
+ * one is sent right away when the queue is full or refused a message.
+ */
+enum {
+    STATUS_INTERVAL = 8
+};
+
 typedef nx_uint8_t nx_seq_no_t;
 typedef nx_uint8_t nx_boolean;
 
@@ -50,10 +58,31 @@ typedef nx_struct myPacketHeader {
     nx_am_addr_t destination;
     nx_seq_no_t seq_no;
     nx_uint8_t ord_no;
-    // tells if the payload is compressed or not
-    nx_boolean is_compressed;
+    // CHUNK_* bits, the high ones count how often the message was sent again
+    nx_uint8_t flags;
     // how many chunks in total
     nx_uint8_t parts;
 } myPacketHeader;
 
+/*
+ * Control messages, told apart from the chunks by parts == 0.
+ * ord_no carries the type.
+ * WARNING must be the same as the ones in control.h
+ */
+enum {
+    CONTROL_MOTE_STATUS = 0,
+    CONTROL_NACK = 1,
+    CONTROL_LOSS_REPORT = 2
+};
+
+// sent to the pc every STATUS_INTERVAL messages received over the serial, and when the radio is overrun
+typedef nx_struct moteStatus {
+    myPacketHeader header;
+    // messages waiting for the radio
+    nx_uint8_t queue_len;
+    nx_uint8_t queue_size;
+    // messages that did not fit in the radio queue, wraps around
+    nx_uint8_t dropped;
+} moteStatus;
+
 #endif
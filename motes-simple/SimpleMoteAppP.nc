@@ -39,34 +39,49 @@ implementation{
 
     // A queue for every mote, in which we save the latest 16 messages to 
     // identify duplicates.
-    // The higher byte will hold the sequential number, while the lower byte
-    // will hold the number of the chunk.
-    uint16_t queues[MAX_MOTES][PACKET_QUEUE_SIZE];
+    // The bytes hold, from the highest, the sequential number, the number of the
+    // chunk, the flags and the number of parts. A chunk sent again has other
+    // flags, and control messages have no parts, so they are not taken for duplicates.
+    uint32_t queues[MAX_MOTES][PACKET_QUEUE_SIZE];
     // Array of pointers to the queues' heads.
-    uint16_t *heads[MAX_MOTES];
+    uint32_t *heads[MAX_MOTES];
 
     // The message that is used for serial acknowledgements.
     message_t ack_msg;
 
+    // Messages handed to the radio queue and not sent yet.
+    uint8_t radio_queued = 0;
+    // Messages the radio queue refused.
+    uint8_t radio_dropped = 0;
+    // Messages from the serial since the last status report, and the drops it told.
+    uint8_t since_status = 0;
+    uint8_t reported_dropped = 0;
+
     /*************/
     /* Functions */
     /*************/
 
+    /**
+     * Builds the signature of a message, as kept in the queues.
+     *
+     * @param myph The header of the message.
+     */
+    uint32_t messageId(myPacketHeader* myph){
+        return (((uint32_t) myph->seq_no) << 24) | (((uint32_t) myph->ord_no) << 16)
+            | (((uint32_t) myph->flags) << 8) | myph->parts;
+    }
+
     /** 
      * Test, whether an message signature is in the queue (was recently seen).
      * 
      * @param client The TOS_NODE_ID. Should be smaller that MAX_MOTES!!!
-     * @param seq_no The sequential number of the message.
-     * @param ord_no The chunk number.
+     * @param myph The header of the message.
      * 
      * @return 1, if the signature is contained, 0 otherwise.
      */
-    boolean inQueue(am_addr_t client, seq_no_t seq_no, uint8_t ord_no){
+    boolean inQueue(am_addr_t client, myPacketHeader* myph){
         uint8_t i;
-        uint16_t identifier;
-
-        // Build identifier from seq_nr and ord_nr
-        identifier = (((uint16_t) seq_no) << 8) | ord_no;
+        uint32_t identifier = messageId(myph);
 
         // Just loop over all elements
         for(i = 0; i < PACKET_QUEUE_SIZE; i++){
@@ -82,14 +97,10 @@ implementation{
      * Inserts a new message identifier into one of the queues.
      * 
      * @param client The TOS_NODE_ID. Should be smaller that MAX_MOTES!!!
-     * @param seq_nr The sequential number of the message.
-     * @param ord_nr The chunk number.
+     * @param myph The header of the message.
      */
-    void addToQueue(am_addr_t client, seq_no_t seq_no, uint8_t ord_no){
-        uint16_t identifier;
-
-        // Build identifier from seq_nr and ord_nr
-        identifier = (((uint16_t) seq_no) << 8) | ord_no;
+    void addToQueue(am_addr_t client, myPacketHeader* myph){
+        uint32_t identifier = messageId(myph);
 
         if(heads[client] == &queues[client][PACKET_QUEUE_SIZE - 1]){
             // We are at the end of the queue
@@ -133,7 +144,19 @@ implementation{
     message_t sR_m;
     uint8_t sR_len;
     task void sendRadio(){
-        call RadioSend.send(sR_dest, &sR_m, sR_len);
+        if(call RadioSend.send(sR_dest, &sR_m, sR_len) == SUCCESS){
+            radio_queued++;
+        }else{
+            radio_dropped++;
+        }
+
+        // Tell the connected PC how the radio is doing, now and then or when it is overrun
+        if(++since_status >= STATUS_INTERVAL || radio_dropped != reported_dropped
+           || radio_queued >= RADIO_QUEUE_SIZE){
+            since_status = 0;
+            reported_dropped = radio_dropped;
+            post sendSerialAck();
+        }
     }
 
     /** 
@@ -147,13 +170,25 @@ implementation{
     }
 
     /**
-     * Sends an acknowledgement for the last packet over the serial.
-     * An acknowledgement is just of an empty Active Message.
+     * Sends the status of the radio queue over the serial, so the pc can slow down
+     * or speed up. It is only sent every STATUS_INTERVAL messages and when the
+     * queue is full or refused a message, the serial is busy enough with the chunks.
      */
     task void sendSerialAck(){
-
-        //TODO: Does that work, or does TinyOS give us an error for the 0?
-        call SerialSend.send(AM_BROADCAST_ADDR, &ack_msg, 0);
+        moteStatus* status = (moteStatus*) call SerialSend.getPayload(&ack_msg, sizeof(moteStatus));
+
+        status->header.sender = TOS_NODE_ID;
+        status->header.destination = TOS_NODE_ID;
+        status->header.seq_no = 0;
+        status->header.ord_no = CONTROL_MOTE_STATUS;
+        status->header.flags = 0;
+        status->header.parts = 0;
+        status->queue_len = radio_queued;
+        status->queue_size = RADIO_QUEUE_SIZE;
+        status->dropped = radio_dropped;
+
+        // the serial queue copies the message, so ack_msg can be reused right away
+        call SerialSend.send(AM_BROADCAST_ADDR, &ack_msg, sizeof(moteStatus));
     }
 
     /**********/
@@ -215,9 +250,6 @@ implementation{
      */
     event message_t* SerialReceive.receive(message_t* m, void* payload, uint8_t len){
 
-        // Send an acknowledgement to the connected PC
-        //post sendSerialAck();
-
         // broadcast the message over the radio
         sR_dest = AM_BROADCAST_ADDR; sR_m = *m; sR_len = len;
         post sendRadio();
@@ -244,6 +276,9 @@ implementation{
      * @see tos.interfaces.Send.sendDone
      */
     event void RadioSend.sendDone(message_t* m, error_t err){
+        if(radio_queued > 0){
+            radio_queued--;
+        }
         if(err == SUCCESS){
             radioBlink();
         }else{
@@ -263,9 +298,9 @@ implementation{
         am_addr_t source = myph->sender;
 
         // Test, whether this message is a duplicate
-        if(!inQueue(source, myph->seq_no, myph->ord_no)){
+        if(!inQueue(source, myph)){
             // Add this message to the queue of seen messages
-            addToQueue(source, myph->seq_no, myph->ord_no); 
+            addToQueue(source, myph);
                     
             // Test if the message is for us
             if(myph->destination == TOS_NODE_ID){